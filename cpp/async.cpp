@@ -0,0 +1,535 @@
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include "async.h"
+#include "byteorder.h"
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <utility>
+
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define BLOBFS_HAS_ZLIB 1
+#endif
+
+namespace blobfs {
+    /** Size of the chunks strings are loaded in, since their size is unknown until the NULL terminator is found */
+    constexpr uint32_t ASYNC_STR_CHUNK_SIZE = 32;
+
+    /** Size of the blocks compressed files are decompressed in */
+    constexpr uint32_t ASYNC_INFLATE_BLOCK_SIZE = 4096;
+
+    /** Size of the compressed chunks loaded at a time -- Larger than the synchronous reader's, since each one is a round-trip */
+    constexpr uint32_t ASYNC_INFLATE_INPUT_SIZE = 4096;
+
+    // ================= Tasks =================
+
+    std::coroutine_handle<> AsyncTask::promise_type::final_awaiter::await_suspend(handle_t handle) noexcept {
+        promise_type &promise = handle.promise();
+        if (promise.continuation) {
+            return promise.continuation;
+        }
+        if (promise.detached) {
+            handle.destroy();
+        }
+        return std::noop_coroutine();
+    }
+
+    static AsyncTask spawned(AsyncTask task, async_done_t done, void* arg) {
+        int ret = co_await task;
+        if (done) {
+            done(arg, ret);
+        }
+        co_return ret;
+    }
+
+    void async_spawn(AsyncTask &&task, async_done_t done, void* arg) {
+        AsyncTask wrapper = spawned(std::move(task), done, arg);
+        AsyncTask::handle_t handle = wrapper._handle;
+        wrapper._handle = nullptr;
+        handle.promise().detached = true;
+        handle.resume();
+    }
+
+    typedef struct {
+        bool finished;
+        /** Set if `async_wait` gave up, the state is then released by the task */
+        bool abandoned;
+        int result;
+    } wait_state_t;
+
+    static void wait_done(void* arg, int result) {
+        wait_state_t* state = (wait_state_t*)arg;
+        if (state->abandoned) {
+            free(state);
+            return;
+        }
+        state->finished = true;
+        state->result = result;
+    }
+
+    int async_wait(AsyncHAL &hal, AsyncTask &&task) {
+        wait_state_t* state = (wait_state_t*)malloc(sizeof(wait_state_t));
+        if (state == nullptr) {
+            return ENOMEM;
+        }
+        state->finished = false;
+        state->abandoned = false;
+        state->result = 0;
+
+        async_spawn(std::move(task), wait_done, state);
+        while (!state->finished) {
+            uint32_t completed;
+            int ret = hal.poll(completed, true);
+            if (ret) {
+                state->abandoned = true;
+                return ret;
+            }
+        }
+        int result = state->result;
+        free(state);
+        return result;
+    }
+
+    void AsyncLoadChunk::done(void* arg, int result) {
+        AsyncLoadChunk* self = (AsyncLoadChunk*)arg;
+        self->_result = result;
+        self->_awaiting.resume();
+    }
+
+
+
+
+    // ================= Main FS functions =================
+
+    AsyncTask AsyncBlobFS::load_str(char* &str, offset_t offset) {
+        // Don't read past the end of the blob, if its size is known
+        uint32_t limit = 0;
+        uint32_t size;
+        if (_hal.blob_size(size) == 0) {
+            if (offset >= size) {
+                co_return EINVAL;
+            }
+            limit = size - offset;
+        }
+
+        char* buffer = nullptr;
+        uint32_t len = 0;
+        while (true) {
+            uint32_t chunk = ASYNC_STR_CHUNK_SIZE;
+            if (limit) {
+                if (len >= limit) {
+                    free(buffer);
+                    co_return EINVAL;  // Not NULL-terminated
+                }
+                if (chunk > limit - len) {
+                    chunk = limit - len;
+                }
+            }
+            char* grown = (char*)realloc(buffer, len + chunk);
+            if (grown == nullptr) {
+                free(buffer);
+                co_return ENOMEM;
+            }
+            buffer = grown;
+
+            int ret = co_await load_chunk(buffer + len, offset + len, chunk);
+            if (ret) {
+                free(buffer);
+                co_return ret;
+            }
+            if (memchr(buffer + len, '\0', chunk) != nullptr) {
+                str = buffer;
+                co_return 0;
+            }
+            len += chunk;
+        }
+    }
+
+    void AsyncBlobFS::free_str(char* str) {
+        free(str);
+    }
+
+    AsyncTask AsyncBlobFS::stat(inode_data_t &inode_data, inode_t inode) {
+        int ret = co_await load_chunk(&inode_data, inode, sizeof(inode_data_t));
+        if (ret) {
+            co_return ret;
+        }
+        fix_endianess(inode_data);
+        co_return 0;
+    }
+
+    AsyncTask AsyncBlobFS::lookup_child(inode_t &child, inode_t parent_inode, const char* name) {
+        inode_data_t parent;
+        int ret = co_await stat(parent, parent_inode);
+        if (ret) {
+            co_return ret;
+        }
+
+        if ((parent.flags & FLAG_NESTED) != 0) {
+            // A different blob
+            co_return EXDEV;
+        }
+        if ((parent.flags & FLAG_DIR) == 0) {
+            // We cannot lookup into a file, only into directories
+            co_return ENOTDIR;
+        }
+        if ((parent.flags & FLAG_DEFLATE) != 0) {
+            // Compression is not supported on directory indexes
+            co_return ENOSYS;
+        }
+        if ((parent.flags & FLAG_SHARD) != 0) {
+            // Stored in other blobs
+            co_return EXDEV;
+        }
+
+        // Entries are sorted by name, and every probe is a round-trip to the backend: Binary search
+        uint32_t low = 0;
+        uint32_t high = parent.data_size;
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            offset_t entry_offset = parent.data_offset + middle * sizeof(dir_entry_t);
+
+            offset_t name_offset;
+            ret = co_await load_chunk(&name_offset, entry_offset + offsetof(dir_entry_t, name_offset), sizeof(offset_t));
+            if (ret) {
+                co_return ret;
+            }
+            fix_endianess(name_offset);
+
+            char* entry_name;
+            ret = co_await load_str(entry_name, name_offset);
+            if (ret) {
+                co_return ret;
+            }
+            int cmp = strcmp(name, entry_name);
+            free_str(entry_name);
+
+            if (cmp == 0) {
+                child = entry_offset + offsetof(dir_entry_t, inode_data);
+                co_return 0;
+            } else if (cmp < 0) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        co_return ENOENT;
+    }
+
+    AsyncTask AsyncBlobFS::lookup(inode_t &inode, const char* path) {
+        // Path must start with "/"
+        if (path == nullptr || path[0] != '/') {
+            co_return ENOENT;
+        }
+        inode = 0;
+
+        const char* chunk_start = path + 1;
+        for (const char* chunk_end=chunk_start; ; chunk_end++) {
+            char endchar = *chunk_end;
+            if ((endchar == '/') || (endchar == '\0')) {
+                if (chunk_end != chunk_start) { // Ignore empty chunks -- .e.g "/foo//bar/" == "/foo/bar"
+                    size_t chunk_size = chunk_end - chunk_start;
+                    char* chunk_name = (char*)malloc(chunk_size + 1);
+                    if (chunk_name == nullptr) {
+                        co_return ENOMEM;
+                    }
+                    memcpy(chunk_name, chunk_start, chunk_size);
+                    chunk_name[chunk_size] = '\0';
+
+                    int ret = co_await lookup_child(inode, inode, chunk_name);
+                    free(chunk_name);
+
+                    if (ret) {
+                        co_return ret;
+                    }
+                }
+                chunk_start = chunk_end + 1;
+            }
+            if (endchar == '\0') {
+                break;
+            }
+        }
+
+        co_return 0;
+    }
+
+    AsyncTask AsyncBlobFS::stored_size(uint32_t &size, const inode_data_t &inode_data) {
+        size = 0;
+        if ((inode_data.flags & FLAG_EXT) != 0) {
+            inode_data_t root;
+            superblock_t sb;
+            memset(&sb, 0, sizeof(superblock_t));
+            int ret = co_await load_chunk(&root, 0, sizeof(inode_data_t));
+            if (ret) {
+                co_return ret;
+            }
+            fix_endianess(root);
+            if ((root.flags & FLAG_SUPERBLOCK) != 0) {
+                ret = co_await load_chunk(&sb, sizeof(inode_data_t), offsetof(superblock_t, mime_count));
+                if (ret) {
+                    co_return ret;
+                }
+                fix_endianess(sb);
+                if (sb.magic == SUPERBLOCK_MAGIC && sb.file_ext_size > offsetof(file_ext_t, stored_size) && inode_data.data_offset >= sb.file_ext_size) {
+                    ret = co_await load_chunk(&size, inode_data.data_offset - sb.file_ext_size + offsetof(file_ext_t, stored_size), sizeof(uint32_t));
+                    if (ret) {
+                        co_return ret;
+                    }
+                    fix_endianess(size);
+                }
+            }
+        }
+        // Otherwise the stream is bounded by the end of the blob, if known
+        uint32_t blob_size;
+        if (size == 0 && _hal.blob_size(blob_size) == 0 && inode_data.data_offset <= blob_size) {
+            size = blob_size - inode_data.data_offset;
+        }
+        co_return 0;
+    }
+
+    AsyncTask AsyncBlobFS::open(AsyncFileHandle* &file, const char* path) {
+        inode_t inode;
+        int ret = co_await lookup(inode, path);
+        if (ret) {
+            co_return ret;
+        }
+        inode_data_t inode_data;
+        ret = co_await stat(inode_data, inode);
+        if (ret) {
+            co_return ret;
+        }
+
+        if ((inode_data.flags & FLAG_DIR) != 0) {
+            // open only takes regular files
+            co_return EISDIR;
+        }
+        uint32_t size = 0;
+        if ((inode_data.flags & FLAG_DEFLATE) != 0) {
+            // Reads of the stream are clamped to its size, they would run past the end of the blob otherwise
+            ret = co_await stored_size(size, inode_data);
+            if (ret) {
+                co_return ret;
+            }
+            if (size == 0) {
+                co_return EINVAL;
+            }
+        }
+        AsyncFileHandle* handle = new AsyncFileHandle(*this, inode_data, inode, size);
+        if ((inode_data.flags & FLAG_DEFLATE) != 0) {
+#ifdef BLOBFS_HAS_ZLIB
+            if (handle->_inflate == nullptr) {
+                delete handle;
+                co_return ENOMEM;
+            }
+#else
+            // Built without zlib
+            delete handle;
+            co_return ENOSYS;
+#endif
+        }
+        file = handle;
+        co_return 0;
+    }
+
+    AsyncTask AsyncBlobFS::opendir(AsyncDirHandle* &dir, const char* path) {
+        inode_t inode;
+        int ret = co_await lookup(inode, path);
+        if (ret) {
+            co_return ret;
+        }
+        inode_data_t inode_data;
+        ret = co_await stat(inode_data, inode);
+        if (ret) {
+            co_return ret;
+        }
+
+        if ((inode_data.flags & FLAG_DIR) == 0) {
+            // opendir only takes directories
+            co_return ENOTDIR;
+        }
+        if ((inode_data.flags & FLAG_DEFLATE) != 0) {
+            // Compression is not supported on directory indexes
+            co_return ENOSYS;
+        }
+        if ((inode_data.flags & FLAG_SHARD) != 0) {
+            // Stored in other blobs
+            co_return EXDEV;
+        }
+
+        dir = new AsyncDirHandle(*this, inode_data, inode);
+        co_return 0;
+    }
+
+
+
+
+    // ================= File Handle =================
+
+#ifdef BLOBFS_HAS_ZLIB
+    typedef struct {
+        z_stream stream;
+        /** Compressed size, loads of the stream never go past it */
+        uint32_t stored_size;
+        /** Offset of the next compressed byte to be loaded, relative to `data_offset` */
+        uint32_t input_offset;
+        uint8_t input[ASYNC_INFLATE_INPUT_SIZE];
+
+        uint8_t block[ASYNC_INFLATE_BLOCK_SIZE];
+        uint32_t block_index;
+        uint32_t block_len;
+        bool block_valid;
+        /** Index of the next block `stream` will produce */
+        uint32_t next_block;
+    } inflate_state_t;
+#endif
+
+    AsyncFileHandle::AsyncFileHandle(AsyncBlobFS& blobfs, inode_data_t inode_data, inode_t inode, uint32_t stored_size)
+    : _blobfs(blobfs), _inode_data(inode_data), _inode(inode), _inflate(nullptr)
+    {
+#ifdef BLOBFS_HAS_ZLIB
+        if ((inode_data.flags & FLAG_DEFLATE) != 0) {
+            inflate_state_t* state = (inflate_state_t*)calloc(1, sizeof(inflate_state_t));
+            if (state != nullptr && inflateInit(&state->stream) != Z_OK) {
+                free(state);
+                state = nullptr;
+            }
+            if (state != nullptr) {
+                state->stored_size = stored_size;
+            }
+            _inflate = state;
+        }
+#endif
+    }
+
+    AsyncFileHandle::~AsyncFileHandle() {
+#ifdef BLOBFS_HAS_ZLIB
+        inflate_state_t* state = (inflate_state_t*)_inflate;
+        if (state != nullptr) {
+            inflateEnd(&state->stream);
+            free(state);
+        }
+#endif
+    }
+
+    AsyncTask AsyncFileHandle::pread(void *dest, uint32_t &size, uint32_t position) {
+        // Return empty buffer on EOF
+        if (position >= _inode_data.data_size) {
+            size = 0;
+            co_return 0;
+        }
+
+        // Trim the buffer if we are near EOF
+        uint32_t remaining = _inode_data.data_size - position;
+        if (size > remaining) {
+            size = remaining;
+        }
+
+        if (_inflate != nullptr) {
+            co_return co_await inflate_pread(dest, size, position);
+        }
+        co_return co_await _blobfs.load_chunk(dest, _inode_data.data_offset + position, size);
+    }
+
+    AsyncTask AsyncFileHandle::inflate_pread(void *dest, uint32_t &size, uint32_t position) {
+#ifdef BLOBFS_HAS_ZLIB
+        inflate_state_t* state = (inflate_state_t*)_inflate;
+        z_stream &stream = state->stream;
+
+        uint32_t done = 0;
+        while (done < size) {
+            uint32_t current = position + done;
+            uint32_t index = current / ASYNC_INFLATE_BLOCK_SIZE;
+
+            if (!state->block_valid || state->block_index != index) {
+                if (index < state->next_block) {
+                    // Seeking backwards starts over
+                    if (inflateReset(&stream) != Z_OK) {
+                        co_return EIO;
+                    }
+                    stream.avail_in = 0;
+                    state->input_offset = 0;
+                    state->next_block = 0;
+                }
+                while (state->next_block <= index) {
+                    uint32_t expected = _inode_data.data_size - state->next_block * ASYNC_INFLATE_BLOCK_SIZE;
+                    if (expected > ASYNC_INFLATE_BLOCK_SIZE) {
+                        expected = ASYNC_INFLATE_BLOCK_SIZE;
+                    }
+                    state->block_valid = false;
+                    stream.next_out = state->block;
+                    stream.avail_out = expected;
+                    while (stream.avail_out > 0) {
+                        if (stream.avail_in == 0) {
+                            if (state->input_offset >= state->stored_size) {
+                                co_return EIO;  // Truncated stream
+                            }
+                            uint32_t len = ASYNC_INFLATE_INPUT_SIZE;
+                            if (len > state->stored_size - state->input_offset) {
+                                len = state->stored_size - state->input_offset;
+                            }
+                            int ret = co_await _blobfs.load_chunk(state->input, _inode_data.data_offset + state->input_offset, len);
+                            if (ret) {
+                                co_return ret;
+                            }
+                            stream.next_in = state->input;
+                            stream.avail_in = len;
+                            state->input_offset += len;
+                        }
+                        int ret = inflate(&stream, Z_NO_FLUSH);
+                        if (ret == Z_STREAM_END) {
+                            break;
+                        }
+                        if (ret != Z_OK) {
+                            co_return EIO;
+                        }
+                    }
+                    if (stream.avail_out != 0) {
+                        co_return EIO;  // Stream is shorter than `data_size`
+                    }
+                    state->block_index = state->next_block++;
+                    state->block_len = expected;
+                    state->block_valid = true;
+                }
+            }
+
+            uint32_t block_offset = current % ASYNC_INFLATE_BLOCK_SIZE;
+            if (block_offset >= state->block_len) {
+                co_return EIO;
+            }
+            uint32_t len = state->block_len - block_offset;
+            if (len > size - done) {
+                len = size - done;
+            }
+            memcpy((uint8_t*)dest + done, state->block + block_offset, len);
+            done += len;
+        }
+        co_return 0;
+#else
+        co_return ENOSYS;
+#endif
+    }
+
+
+
+
+    // ================= Directory Handle =================
+
+    AsyncTask AsyncDirHandle::readdir(dir_entry_t &direntry, inode_t &inode, char* &name) {
+        if (_position >= _inode_data.data_size) {
+            co_return ENOENT;
+        }
+        offset_t entry_offset = _inode_data.data_offset + (_position++) * sizeof(dir_entry_t);
+        inode = entry_offset + offsetof(dir_entry_t, inode_data);
+
+        int ret = co_await _blobfs.load_chunk(&direntry, entry_offset, sizeof(dir_entry_t));
+        if (ret) {
+            co_return ret;
+        }
+        fix_endianess(direntry);
+
+        co_return co_await _blobfs.load_str(name, direntry.name_offset);
+    }
+}
+
+#endif // C++20
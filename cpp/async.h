@@ -0,0 +1,350 @@
+# pragma once
+
+#if __cplusplus < 202002L || !__has_include(<coroutine>)
+#error <blobfs/async.h> requires C++20 coroutines
+#endif
+
+#include "blobfs.h"
+#include <coroutine>
+
+namespace blobfs {
+    /**
+     * Called when an asynchronous operation completes
+     *
+     * @param[in] arg The argument passed when the operation was started
+     * @param[in] result 0 on success, or errno
+     */
+    typedef void (*async_done_t)(void* arg, int result);
+
+    /**
+     * Asynchronous HAL used to access chunks of the blob
+     *
+     * Completions are delivered by `poll`, on the thread that calls it -- Typically the event loop.
+     */
+    class AsyncHAL {
+    public:
+        virtual ~AsyncHAL() {}
+
+        /**
+         * Starts loading a chunk of the blob in local memory
+         *
+         * @param[out] dest buffer chunk will be copied to, must stay valid until `done` is called
+         * @param[in] offset Offset at the blob where the chunk starts
+         * @param[in] len Size of the chunk
+         * @param[in] done Called once the chunk is loaded, or the load failed
+         * @param[in] arg Argument passed to `done`
+         */
+        virtual void async_load_chunk(void* dest, offset_t offset, uint32_t len, async_done_t done, void* arg) = 0;
+
+        /**
+         * Runs the callbacks of the loads that completed
+         *
+         * @param[out] completed Number of callbacks run
+         * @param[in] wait Block until at least one load completes, if none did
+         * @return 0 on success, or errno
+         */
+        virtual int poll(uint32_t &completed, bool wait) = 0;
+
+        /**
+         * Returns a file descriptor that becomes readable when `poll` has completions to deliver, for use with
+         * epoll & co., or -1 if not supported
+         */
+        virtual int fd() {
+            return -1;
+        }
+
+        /**
+         * Returns the size of the blob
+         *
+         * @param[out] size The blob size
+         * @return 0 on success, ENOSYS if unknown
+         */
+        virtual int blob_size(uint32_t &/*size*/) {
+            return ENOSYS;
+        }
+    };
+
+    /**
+     * A coroutine returning errno
+     *
+     * It only starts running when awaited (`int ret = co_await task;`), or with `async_spawn` / `async_wait`.
+     */
+    class AsyncTask {
+    public:
+        struct promise_type;
+        typedef std::coroutine_handle<promise_type> handle_t;
+
+        struct promise_type {
+            int result = 0;
+            std::coroutine_handle<> continuation;
+            /** Started by `async_spawn`, destroys itself when done */
+            bool detached = false;
+
+            struct final_awaiter {
+                inline bool await_ready() noexcept {
+                    return false;
+                }
+                std::coroutine_handle<> await_suspend(handle_t handle) noexcept;
+                inline void await_resume() noexcept {}
+            };
+
+            inline AsyncTask get_return_object() {
+                return AsyncTask(handle_t::from_promise(*this));
+            }
+            inline std::suspend_always initial_suspend() noexcept {
+                return {};
+            }
+            inline final_awaiter final_suspend() noexcept {
+                return {};
+            }
+            inline void return_value(int value) {
+                result = value;
+            }
+            inline void unhandled_exception() {
+                result = EIO;
+            }
+        };
+
+        inline AsyncTask(AsyncTask &&other)
+        : _handle(other._handle)
+        {
+            other._handle = nullptr;
+        }
+
+        AsyncTask(const AsyncTask &) = delete;
+
+        inline ~AsyncTask() {
+            if (_handle) {
+                _handle.destroy();
+            }
+        }
+
+        inline bool await_ready() {
+            return false;
+        }
+
+        inline std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+            _handle.promise().continuation = awaiting;
+            return _handle;
+        }
+
+        inline int await_resume() {
+            return _handle.promise().result;
+        }
+
+    protected:
+        friend void async_spawn(AsyncTask &&task, async_done_t done, void* arg);
+
+        handle_t _handle;
+
+        inline explicit AsyncTask(handle_t handle)
+        : _handle(handle)
+        {}
+    };
+
+    /**
+     * Starts a task without waiting for it
+     *
+     * @param[in] task The task, owned by the call
+     * @param[in] done Called with the result of the task, or nullptr
+     * @param[in] arg Argument passed to `done`
+     */
+    void async_spawn(AsyncTask &&task, async_done_t done = nullptr, void* arg = nullptr);
+
+    /**
+     * Runs a task to completion, polling the HAL meanwhile -- For callers that are not coroutines
+     *
+     * @param[in] hal The HAL the task does I/O with
+     * @param[in] task The task, owned by the call
+     * @return The result of the task, or errno if polling failed
+     */
+    int async_wait(AsyncHAL &hal, AsyncTask &&task);
+
+    /** Awaits a single `AsyncHAL::async_load_chunk` */
+    class AsyncLoadChunk {
+        AsyncHAL& _hal;
+        void* _dest;
+        offset_t _offset;
+        uint32_t _len;
+        int _result;
+        std::coroutine_handle<> _awaiting;
+
+        static void done(void* arg, int result);
+
+    public:
+        inline AsyncLoadChunk(AsyncHAL& hal, void* dest, offset_t offset, uint32_t len)
+        : _hal(hal), _dest(dest), _offset(offset), _len(len), _result(0)
+        {}
+
+        inline bool await_ready() {
+            return _len == 0;
+        }
+
+        inline void await_suspend(std::coroutine_handle<> awaiting) {
+            _awaiting = awaiting;
+            _hal.async_load_chunk(_dest, _offset, _len, &done, this);
+        }
+
+        inline int await_resume() {
+            return _result;
+        }
+    };
+
+    class AsyncFileHandle;
+    class AsyncDirHandle;
+
+    /**
+     * Asynchronous version of BlobFS, for event loops
+     *
+     * Lookups, reads and listings are coroutines that suspend on every access to the blob, so thousands of them can
+     * overlap their I/O on a single thread:
+     *
+     *     AsyncTask serve(AsyncBlobFS& fs, const char* path) {
+     *         AsyncFileHandle* file;
+     *         int ret = co_await fs.open(file, path);
+     *         ...
+     *     }
+     *
+     * Files with FLAG_DEFLATE can be read if zlib is available. Paths going into nested blobs or shards fail with EXDEV.
+     */
+    class AsyncBlobFS {
+    protected:
+        friend class AsyncFileHandle;
+        friend class AsyncDirHandle;
+
+        AsyncHAL& _hal;
+
+        inline AsyncLoadChunk load_chunk(void* dest, offset_t offset, uint32_t len) {
+            return AsyncLoadChunk(_hal, dest, offset, len);
+        }
+
+        AsyncTask load_str(char* &str, offset_t offset);
+        AsyncTask lookup_child(inode_t &child, inode_t parent_inode, const char* name);
+        /** Compressed size of a file with FLAG_DEFLATE, from its extension record or else the end of the blob, 0 if unknown */
+        AsyncTask stored_size(uint32_t &size, const inode_data_t &inode_data);
+
+    public:
+        inline AsyncBlobFS(AsyncHAL& hal)
+        : _hal(hal)
+        {}
+
+        /**
+         * Lookup an inode from an absolute path
+         *
+         * @param[out] inode Address of the inode, if found
+         * @param[in] path Full path to the inode being looked up, must stay valid until the task completes
+         * @return 0 on success, EXDEV if the path goes into a nested blob or shard, or errno
+         */
+        AsyncTask lookup(inode_t &inode, const char* path);
+
+        /**
+         * Returns all the metadata of the specified inode
+         *
+         * @param[out] inode_data metadata of the specified inode
+         * @param[in] inode The inode number being queried
+         * @return 0 on success, or errno
+         */
+        AsyncTask stat(inode_data_t &inode_data, inode_t inode);
+
+        /**
+         * Opens a file for reading
+         *
+         * After use, the file handle must be released with `delete file`
+         *
+         * @param[out] file the file handle.
+         * @param[in] path The path of the file in the filesystem, must stay valid until the task completes
+         * @return 0 on success, or errno
+         */
+        AsyncTask open(AsyncFileHandle* &file, const char* path);
+
+        /**
+         * Opens the directory for listing files
+         *
+         * After use, the directory handle must be released with `delete dir`
+         *
+         * @param[out] dir the directory handle.
+         * @param[in] path The path of the directory in the filesystem, must stay valid until the task completes
+         * @return 0 on success, or errno
+         */
+        AsyncTask opendir(AsyncDirHandle* &dir, const char* path);
+
+        /**
+         * Releases a name returned by `AsyncDirHandle::readdir`
+         */
+        void free_str(char* str);
+    };
+
+    /**
+     * Represents an open file of an AsyncBlobFS
+     *
+     * Only one operation may be in flight at a time on each handle.
+     */
+    class AsyncFileHandle {
+    protected:
+        friend class AsyncBlobFS;
+
+        AsyncBlobFS& _blobfs;
+        inode_data_t _inode_data;
+        inode_t _inode;
+        /** State of the decompression of files with FLAG_DEFLATE, or nullptr */
+        void* _inflate;
+
+        AsyncFileHandle(AsyncBlobFS& blobfs, inode_data_t inode_data, inode_t inode, uint32_t stored_size);
+
+        AsyncTask inflate_pread(void *dest, uint32_t &size, uint32_t position);
+
+    public:
+        ~AsyncFileHandle();
+
+        /**
+         * Returns all the metadata of the current inode
+         *
+         * @param[out] inode_data metadata of the current inode
+         * @param[out] inode The inode number of the current file
+         * @return 0 on success, or errno
+         */
+        inline int stat(inode_data_t &inode_data, inode_t &inode) {
+            inode_data = _inode_data;
+            inode = _inode;
+            return 0;
+        }
+
+        /**
+         * Reads up to `size` bytes into the buffer from the specified file position
+         *
+         * @param[out] dest Buffer to be filled with file contents
+         * @param[in,out] size Input: Size of the `dest` buffer; Output: number of bytes actually read
+         * @param[in] position Position on the file being read
+         * @return 0 on success, or errno
+         */
+        AsyncTask pread(void *dest, uint32_t &size, uint32_t position);
+    };
+
+    /**
+     * Represents an open directory of an AsyncBlobFS
+     */
+    class AsyncDirHandle {
+    protected:
+        friend class AsyncBlobFS;
+
+        AsyncBlobFS& _blobfs;
+        inode_data_t _inode_data;
+        inode_t _inode;
+        uint32_t _position;
+
+        inline AsyncDirHandle(AsyncBlobFS& blobfs, inode_data_t inode_data, inode_t inode)
+        : _blobfs(blobfs), _inode_data(inode_data), _inode(inode), _position(0)
+        {}
+
+    public:
+        /**
+         * Reads the next entry in this directory
+         *
+         * @param[out] direntry The data associated with the entry
+         * @param[out] inode The inode associated with the entry
+         * @param[out] name Name of the entry, must be released with `AsyncBlobFS::free_str`
+         * @return 0 on success, ENOENT if it reached the end of the list of entries, or errno
+         */
+        AsyncTask readdir(dir_entry_t &direntry, inode_t &inode, char* &name);
+    };
+}
@@ -0,0 +1,230 @@
+#if defined(__linux__) && __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include "async_linux.h"
+#include <cerrno>
+#include <cstdlib>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace blobfs {
+    // ================= Thread pool =================
+
+    ThreadPoolHAL::ThreadPoolHAL(BlobFS& blobfs)
+    : _blobfs(blobfs), _eventfd(-1), _stopping(false)
+    {}
+
+    ThreadPoolHAL::~ThreadPoolHAL() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _pending_cv.notify_all();
+        for (std::thread &thread : _threads) {
+            thread.join();
+        }
+        if (_eventfd >= 0) {
+            close(_eventfd);
+        }
+    }
+
+    int ThreadPoolHAL::begin(uint32_t threads) {
+        _eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_eventfd < 0) {
+            return errno;
+        }
+        for (uint32_t i = 0; i < threads; i++) {
+            _threads.emplace_back(&ThreadPoolHAL::worker, this);
+        }
+        return 0;
+    }
+
+    void ThreadPoolHAL::worker() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _pending_cv.wait(lock, [this] { return _stopping || !_pending.empty(); });
+            if (_stopping) {
+                return;
+            }
+            request_t request = _pending.front();
+            _pending.pop_front();
+
+            lock.unlock();
+            request.result = _blobfs.load_chunk(request.dest, request.offset, request.len);
+            lock.lock();
+
+            _completed.push_back(request);
+            uint64_t one = 1;
+            if (write(_eventfd, &one, sizeof(one)) < 0) {
+                // Counter is already nonzero, poll will see the completion anyway
+            }
+        }
+    }
+
+    void ThreadPoolHAL::async_load_chunk(void* dest, offset_t offset, uint32_t len, async_done_t done, void* arg) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _pending.push_back(request_t{dest, offset, len, done, arg, 0});
+        }
+        _pending_cv.notify_one();
+    }
+
+    int ThreadPoolHAL::poll(uint32_t &completed, bool wait) {
+        completed = 0;
+        while (true) {
+            uint64_t counter;
+            if (read(_eventfd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+                return errno;
+            }
+
+            std::deque<request_t> ready;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                ready.swap(_completed);
+            }
+            if (!ready.empty() || !wait) {
+                // Callbacks run without the lock, they usually start more loads
+                for (const request_t &request : ready) {
+                    request.done(request.arg, request.result);
+                    completed++;
+                }
+                return 0;
+            }
+
+            struct pollfd pfd = {_eventfd, POLLIN, 0};
+            if (::poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                return errno;
+            }
+        }
+    }
+
+    int ThreadPoolHAL::fd() {
+        return _eventfd;
+    }
+
+    int ThreadPoolHAL::blob_size(uint32_t &size) {
+        return _blobfs.blob_size(size);
+    }
+
+
+
+
+    // ================= io_uring =================
+
+#ifdef BLOBFS_HAS_URING
+    UringHAL::UringHAL()
+    : _ring_ready(false), _fd(-1), _size(0)
+    {}
+
+    UringHAL::~UringHAL() {
+        if (_ring_ready) {
+            io_uring_queue_exit(&_ring);
+        }
+    }
+
+    int UringHAL::begin(int fd, uint32_t entries) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            return errno;
+        }
+        int ret = io_uring_queue_init(entries, &_ring, 0);
+        if (ret < 0) {
+            return -ret;
+        }
+        _ring_ready = true;
+        _fd = fd;
+        _size = st.st_size;
+        return 0;
+    }
+
+    int UringHAL::submit(request_t* request) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&_ring);
+        if (sqe == nullptr) {
+            // Submission queue is full, flush it
+            io_uring_submit(&_ring);
+            sqe = io_uring_get_sqe(&_ring);
+            if (sqe == nullptr) {
+                return EAGAIN;
+            }
+        }
+        io_uring_prep_read(sqe, _fd, request->dest, request->len, request->offset);
+        io_uring_sqe_set_data(sqe, request);
+
+        // Submit right away, callers may wait on `fd()` without calling `poll` first.
+        // On failure the entry stays queued and the next `poll` retries it
+        io_uring_submit(&_ring);
+        return 0;
+    }
+
+    void UringHAL::async_load_chunk(void* dest, offset_t offset, uint32_t len, async_done_t done, void* arg) {
+        request_t* request = (request_t*)malloc(sizeof(request_t));
+        if (request == nullptr) {
+            done(arg, ENOMEM);
+            return;
+        }
+        *request = request_t{(uint8_t*)dest, offset, len, done, arg};
+        int ret = submit(request);
+        if (ret) {
+            free(request);
+            done(arg, ret);
+        }
+    }
+
+    int UringHAL::poll(uint32_t &completed, bool wait) {
+        completed = 0;
+        int ret = io_uring_submit(&_ring);
+        if (ret < 0) {
+            return -ret;
+        }
+
+        struct io_uring_cqe* cqe;
+        if (wait) {
+            do {
+                ret = io_uring_wait_cqe(&_ring, &cqe);
+            } while (ret == -EINTR);
+            if (ret < 0) {
+                return -ret;
+            }
+        }
+        while (io_uring_peek_cqe(&_ring, &cqe) == 0) {
+            request_t* request = (request_t*)io_uring_cqe_get_data(cqe);
+            int res = cqe->res;
+            io_uring_cqe_seen(&_ring, cqe);
+
+            int result = 0;
+            if (res < 0) {
+                result = -res;
+            } else if (res == 0) {
+                result = EIO;  // Past the end of the file
+            } else if ((uint32_t)res < request->len) {
+                // Short read, load the rest
+                request->dest += res;
+                request->offset += res;
+                request->len -= res;
+                result = submit(request);
+                if (result == 0) {
+                    continue;
+                }
+            }
+            async_done_t done = request->done;
+            void* arg = request->arg;
+            free(request);
+            done(arg, result);
+            completed++;
+        }
+        return 0;
+    }
+
+    int UringHAL::fd() {
+        return _ring.ring_fd;
+    }
+
+    int UringHAL::blob_size(uint32_t &size) {
+        size = _size;
+        return 0;
+    }
+#endif
+}
+
+#endif // __linux__ && C++20
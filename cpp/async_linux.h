@@ -0,0 +1,116 @@
+# pragma once
+
+#if !defined(__linux__)
+#error <blobfs/async_linux.h> is only enabled on Linux
+#endif
+
+#include "async.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if __has_include(<liburing.h>)
+#include <liburing.h>
+#define BLOBFS_HAS_URING 1
+#endif
+
+namespace blobfs {
+    /**
+     * AsyncHAL running the `load_chunk` of a synchronous BlobFS on a pool of threads
+     *
+     * Fallback for backends without native asynchronous I/O. The completions are delivered by `poll`, and signaled on
+     * an eventfd.
+     */
+    class ThreadPoolHAL : public AsyncHAL {
+    protected:
+        typedef struct {
+            void* dest;
+            offset_t offset;
+            uint32_t len;
+            async_done_t done;
+            void* arg;
+            int result;
+        } request_t;
+
+        BlobFS& _blobfs;
+        int _eventfd;
+        std::mutex _mutex;
+        std::condition_variable _pending_cv;
+        std::deque<request_t> _pending;
+        std::deque<request_t> _completed;
+        std::vector<std::thread> _threads;
+        bool _stopping;
+
+        void worker();
+
+    public:
+        /**
+         * @param[in] blobfs The blob, whose `load_chunk` must be thread-safe
+         */
+        ThreadPoolHAL(BlobFS& blobfs);
+
+        /**
+         * Stops the threads, pending loads are never completed
+         */
+        virtual ~ThreadPoolHAL();
+
+        /**
+         * Starts the threads
+         *
+         * @param[in] threads Number of threads
+         * @return 0 on success, or errno
+         */
+        int begin(uint32_t threads = 4);
+
+        virtual void async_load_chunk(void* dest, offset_t offset, uint32_t len, async_done_t done, void* arg);
+        virtual int poll(uint32_t &completed, bool wait);
+        virtual int fd();
+        virtual int blob_size(uint32_t &size);
+    };
+
+#ifdef BLOBFS_HAS_URING
+    /**
+     * AsyncHAL reading a blob file with io_uring
+     *
+     * Loads are submitted as soon as they are queued, so `fd()` becomes readable when they complete even if `poll` was
+     * never called. Short reads are resubmitted.
+     */
+    class UringHAL : public AsyncHAL {
+    protected:
+        typedef struct {
+            uint8_t* dest;
+            offset_t offset;
+            uint32_t len;
+            async_done_t done;
+            void* arg;
+        } request_t;
+
+        struct io_uring _ring;
+        bool _ring_ready;
+        int _fd;
+        uint32_t _size;
+
+        int submit(request_t* request);
+
+    public:
+        UringHAL();
+        virtual ~UringHAL();
+
+        /**
+         * Sets up the ring
+         *
+         * @param[in] fd The blob file, which must stay open
+         * @param[in] entries Size of the submission queue
+         * @return 0 on success, or errno
+         */
+        int begin(int fd, uint32_t entries = 256);
+
+        virtual void async_load_chunk(void* dest, offset_t offset, uint32_t len, async_done_t done, void* arg);
+        virtual int poll(uint32_t &completed, bool wait);
+        virtual int fd();
+        virtual int blob_size(uint32_t &size);
+    };
+#endif
+}
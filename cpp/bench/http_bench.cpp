@@ -0,0 +1,170 @@
+/**
+ * Loopback benchmark of HttpServer
+ *
+ * Serves a blob on 127.0.0.1 and hammers it with N keep-alive connections, reporting requests/sec and latency.
+ *
+ * Build & run:
+ *   g++ -O2 -std=c++11 -pthread -Icpp cpp/bench/http_bench.cpp cpp/http_posix.cpp cpp/http.cpp cpp/blobfs.cpp cpp/validate.cpp cpp/swap.cpp -lz -o http_bench
+ *   ./http_bench blob.bin /index.html [connections=16] [seconds=5] [accept-encoding=gzip, br]
+ */
+#include "blobfs.h"
+#include "http_posix.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace blobfs;
+using bench_clock = std::chrono::steady_clock;
+
+static std::vector<char> read_file(const char* path) {
+    std::vector<char> data;
+    FILE* f = fopen(path, "rb");
+    if (f == nullptr) {
+        perror(path);
+        exit(1);
+    }
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        data.insert(data.end(), buffer, buffer + n);
+    }
+    fclose(f);
+    return data;
+}
+
+/** Reads one response, returns its status or -1 on error */
+static int read_response(int fd, std::vector<char> &buffer) {
+    size_t buffered = 0;
+    while (true) {
+        if (buffered == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+        ssize_t n = recv(fd, buffer.data() + buffered, buffer.size() - buffered, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        buffered += n;
+
+        char* headers_end = (char*)memmem(buffer.data(), buffered, "\r\n\r\n", 4);
+        if (headers_end == nullptr) {
+            continue;
+        }
+        size_t headers_size = headers_end + 4 - buffer.data();
+        char* content_length = (char*)memmem(buffer.data(), headers_size, "Content-Length: ", 16);
+        size_t body_size = content_length ? strtoul(content_length + 16, nullptr, 10) : 0;
+        int status = atoi(buffer.data() + 9);
+        if (status == 304 || memcmp(buffer.data(), "HTTP/1.1", 8) != 0) {
+            body_size = 0;
+        }
+
+        // Drain the body
+        size_t remaining = headers_size + body_size - std::min(buffered, headers_size + body_size);
+        while (remaining > 0) {
+            n = recv(fd, buffer.data(), std::min(remaining, buffer.size()), 0);
+            if (n <= 0) {
+                return -1;
+            }
+            remaining -= n;
+        }
+        return status;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s BLOB PATH [connections] [seconds] [accept-encoding]\n", argv[0]);
+        return 1;
+    }
+    const char* path = argv[2];
+    int connections = argc > 3 ? atoi(argv[3]) : 16;
+    int seconds = argc > 4 ? atoi(argv[4]) : 5;
+    const char* accept_encoding = argc > 5 ? argv[5] : "gzip, br";
+
+    std::vector<char> blob = read_file(argv[1]);
+    MemoryBlobFS blobfs(blob.data(), blob.size());
+    int ret = blobfs.validate();
+    if (ret) {
+        fprintf(stderr, "Invalid blob: %s\n", strerror(ret));
+        return 1;
+    }
+    HttpServer server(blobfs);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(listen_fd, 128) || getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len)) {
+        perror("listen");
+        return 1;
+    }
+    std::thread([&server, listen_fd]() {
+        http_serve(server, listen_fd);
+    }).detach();
+
+    char request[1024];
+    int request_size = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: %s\r\n\r\n", path, accept_encoding);
+
+    std::atomic<bool> running(true);
+    std::atomic<int> errors(0);
+    std::vector<std::vector<double>> latencies(connections);
+    std::vector<std::thread> clients;
+    for (int i = 0; i < connections; i++) {
+        clients.emplace_back([&, i]() {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+                errors++;
+                return;
+            }
+            std::vector<char> buffer(65536);
+            while (running) {
+                auto start = bench_clock::now();
+                if (send(fd, request, request_size, MSG_NOSIGNAL) != request_size) {
+                    errors++;
+                    break;
+                }
+                int status = read_response(fd, buffer);
+                if (status < 200 || status >= 400) {
+                    errors++;
+                    break;
+                }
+                latencies[i].push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - start).count());
+            }
+            close(fd);
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    running = false;
+    for (auto &client : clients) {
+        client.join();
+    }
+
+    std::vector<double> all;
+    for (auto &l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    std::sort(all.begin(), all.end());
+    if (all.empty()) {
+        fprintf(stderr, "No successful requests (%d errors)\n", errors.load());
+        return 1;
+    }
+    printf("connections=%d requests=%zu errors=%d\n", connections, all.size(), errors.load());
+    printf("requests/sec=%.0f\n", all.size() / (double)seconds);
+    printf("latency_us p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+        all[all.size() / 2], all[all.size() * 9 / 10], all[all.size() * 99 / 100], all.back());
+    return 0;
+}
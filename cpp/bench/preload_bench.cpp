@@ -0,0 +1,181 @@
+/**
+ * Mount-time benchmark of PreloadBlobFS
+ *
+ * Reads a blob file with pread, optionally adding a latency to every read to emulate a slow backend, and compares
+ * looking up, stating and listing every entry of the blob directly and after preloading its metadata.
+ *
+ * Build & run:
+ *   g++ -O2 -std=c++11 -Icpp cpp/bench/preload_bench.cpp cpp/preload.cpp cpp/blobfs.cpp cpp/validate.cpp -o preload_bench -lz
+ *   ./preload_bench blob.bin [latency-us=0]
+ */
+#include "blobfs.h"
+#include "preload.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace blobfs;
+using bench_clock = std::chrono::steady_clock;
+
+/** A blob read from a file, counting the reads */
+class FileBackend : public BlobFS {
+protected:
+    int _fd;
+    uint32_t _size;
+    std::chrono::microseconds _latency;
+
+    int read_at(void* dest, offset_t offset, uint32_t len) {
+        reads++;
+        bytes_read += len;
+        if (_latency.count() > 0) {
+            std::this_thread::sleep_for(_latency);
+        }
+        ssize_t n = pread(_fd, dest, len, offset);
+        return n == (ssize_t)len ? 0 : EIO;
+    }
+
+public:
+    uint64_t reads = 0;
+    uint64_t bytes_read = 0;
+
+    FileBackend(int fd, uint32_t size, uint32_t latency_us) : _fd(fd), _size(size), _latency(latency_us) {}
+
+    virtual int load_chunk(void* dest, offset_t offset, uint32_t len) {
+        if (offset > _size || len > _size - offset) {
+            return EINVAL;
+        }
+        return read_at(dest, offset, len);
+    }
+
+    virtual int load_str(const char* &str, offset_t offset) {
+        std::string value;
+        char buffer[64];
+        while (offset < _size) {
+            uint32_t len = _size - offset < sizeof(buffer) ? _size - offset : sizeof(buffer);
+            int ret = read_at(buffer, offset, len);
+            if (ret) {
+                return ret;
+            }
+            size_t n = strnlen(buffer, len);
+            value.append(buffer, n);
+            if (n < len) {
+                str = strdup(value.c_str());
+                return str == nullptr ? ENOMEM : 0;
+            }
+            offset += len;
+        }
+        return EINVAL;
+    }
+
+    virtual void free_str(const char* str) {
+        free((void*)str);
+    }
+
+    virtual int blob_size(uint32_t &size) {
+        size = _size;
+        return 0;
+    }
+};
+
+typedef struct {
+    std::vector<std::string> paths;
+} entries_t;
+
+static int collect(void* arg, const char* path, inode_t inode, const inode_data_t &inode_data, uint32_t depth) {
+    entries_t* entries = (entries_t*)arg;
+    entries->paths.push_back(path);
+    return 0;
+}
+
+/** Looks up and stats every entry, and lists every directory */
+static void run(const char* label, BlobFS &fs, FileBackend &backend, const entries_t &entries) {
+    uint64_t reads = backend.reads;
+    bench_clock::time_point start = bench_clock::now();
+    int errors = 0;
+    for (size_t i = 0; i < entries.paths.size(); i++) {
+        BlobFS* blobfs;
+        inode_t inode;
+        inode_data_t inode_data;
+        if (fs.lookup(blobfs, inode, entries.paths[i].c_str()) || blobfs->stat(inode_data, inode)) {
+            errors++;
+            continue;
+        }
+        if (inode_data.flags & FLAG_DIR) {
+            DirHandle* dir;
+            if (blobfs->opendir(dir, inode)) {
+                errors++;
+                continue;
+            }
+            dir_entry_t entry;
+            inode_t child;
+            const char* name;
+            while (dir->readdir(entry, child, name) == 0) {
+                blobfs->free_str(name);
+            }
+            delete dir;
+        }
+    }
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+    printf("%-10s %8zu entries  %10.1f us/entry  %8.2f backend reads/entry  %d errors\n", label, entries.paths.size(),
+           seconds * 1e6 / entries.paths.size(), (double)(backend.reads - reads) / entries.paths.size(), errors);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s blob.bin [latency-us=0]\n", argv[0]);
+        return 1;
+    }
+    uint32_t latency_us = argc > 2 ? atoi(argv[2]) : 0;
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    // Paths are collected without latency
+    entries_t entries;
+    {
+        FileBackend backend(fd, st.st_size, 0);
+        if (backend.validate() || backend.walk("/", collect, &entries)) {
+            fprintf(stderr, "Invalid blob\n");
+            return 1;
+        }
+    }
+
+    FileBackend backend(fd, st.st_size, latency_us);
+    run("direct", backend, backend, entries);
+
+    PreloadBlobFS fs(backend);
+    size_t estimate;
+    uint64_t reads = backend.reads;
+    bench_clock::time_point start = bench_clock::now();
+    int ret = fs.estimate(estimate);
+    double estimate_ms = std::chrono::duration<double>(bench_clock::now() - start).count() * 1e3;
+    uint64_t estimate_reads = backend.reads - reads;
+
+    reads = backend.reads;
+    uint64_t bytes_read = backend.bytes_read;
+    start = bench_clock::now();
+    if (ret == 0) {
+        ret = fs.begin();
+    }
+    double mount_ms = std::chrono::duration<double>(bench_clock::now() - start).count() * 1e3;
+    if (ret) {
+        fprintf(stderr, "Preload failed: %s\n", strerror(ret));
+        return 1;
+    }
+    printf("estimate   %8zu bytes  %10.1f ms  %8llu backend reads\n", estimate, estimate_ms, (unsigned long long)estimate_reads);
+    printf("mount      %8zu bytes  %10.1f ms  %8llu backend reads, %llu bytes (blob: %lld bytes)\n", fs.memory_used(), mount_ms,
+           (unsigned long long)(backend.reads - reads), (unsigned long long)(backend.bytes_read - bytes_read), (long long)st.st_size);
+    run("preloaded", fs, backend, entries);
+    close(fd);
+    return 0;
+}
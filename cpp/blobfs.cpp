@@ -1,32 +1,77 @@
 #include "blobfs.h"
+#include "byteorder.h"
 #include <cstring>
 #include <cstdlib>
 #include <cstddef>
 
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define BLOBFS_HAS_ZLIB 1
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 
 namespace blobfs {
-    // ================= Fix byte-order on data structures loaded from the blob =================
+    // ================= Work budget =================
 
-    static inline uint32_t ntohl(uint32_t n) {
-#if ((__BYTE_ORDER__) == (__ORDER_LITTLE_ENDIAN__))
-        return n;
-#else
-        return ((n & 0xff) << 24) | ((n & 0xff00) << 8) | ((n >> 8)  & 0xff00) | ((n >> 24) & 0xff);
-#endif
-    }
+    /** Size of the chunks uncompressed files are loaded in by `read_some`, when it has a deadline */
+    constexpr uint32_t READ_SOME_CHUNK_SIZE = 512;
 
-    static inline void fix_endianess(uint32_t &data) {
-        data = ntohl(data);
-    }
-    static inline void fix_endianess(inode_data_t &data) {
-        data.data_size = ntohl(data.data_size);
-        data.data_offset = ntohl(data.data_offset);
-    }
-    static inline void fix_endianess(dir_entry_t &data) {
-        data.name_offset = ntohl(data.name_offset);
-        data.inode_data.data_size = ntohl(data.inode_data.data_size);
-        data.inode_data.data_offset = ntohl(data.inode_data.data_offset);
-    }
+    /** Tracks the work left in a read_budget_t */
+    class WorkBudget {
+        uint32_t _input_bytes;
+        bool _limited;
+        uint32_t (*_clock)();
+        uint32_t _deadline;
+        bool _started;
+    public:
+        /** No limit */
+        inline WorkBudget()
+        : _input_bytes(0), _limited(false), _clock(nullptr), _deadline(0), _started(false)
+        {}
+
+        inline WorkBudget(const read_budget_t &budget)
+        : _input_bytes(budget.input_bytes), _limited(budget.input_bytes != 0), _clock(budget.clock), _deadline(budget.deadline), _started(false)
+        {}
+
+        inline bool has_deadline() {
+            return _clock != nullptr;
+        }
+
+        /**
+         * Takes the next chunk of input from the budget
+         *
+         * The first chunk is always granted, so that every call makes progress.
+         *
+         * @param[in,out] len Size of the chunk, trimmed to what is left of the budget
+         * @return false if the budget is exhausted
+         */
+        inline bool take(uint32_t &len) {
+            if (_started) {
+                if (_limited && _input_bytes == 0) {
+                    return false;
+                }
+                if (_clock != nullptr && (int32_t)(_clock() - _deadline) >= 0) {
+                    return false;
+                }
+            }
+            _started = true;
+            if (_limited) {
+                if (len > _input_bytes) {
+                    len = _input_bytes;
+                }
+                _input_bytes -= len;
+            }
+            return true;
+        }
+    };
 
 
 
@@ -54,151 +99,2064 @@ namespace blobfs {
             return 0;
         }
 
-        virtual int read(void *dest, uint32_t &size) {
-            int ret = pread(dest, size, _position);
+        virtual int read(void *dest, uint32_t &size) {
+            int ret = pread(dest, size, _position);
+            if (ret == 0) {
+                _position += size; // On success, move file cursor
+            }
+            return ret;
+        }
+
+        virtual int pread(void *dest, uint32_t &size, uint32_t position) {
+            // Return empty buffer on EOF
+            if (position >= _inode_data.data_size) {
+                size = 0;
+                return 0;
+            }
+
+            // Trim the buffer if we are near EOF
+            uint32_t remaining = _inode_data.data_size - position;
+            if (size > remaining) {
+                size = remaining;
+            }
+
+            // Perform the actual read
+            return _blobfs.load_chunk(dest, _inode_data.data_offset + position, size);
+        }
+
+        virtual int read_some(void *dest, uint32_t &size, const read_budget_t &budget) {
+            WorkBudget work(budget);
+
+            // Return empty buffer on EOF
+            if (_position >= _inode_data.data_size) {
+                size = 0;
+                return 0;
+            }
+
+            // Trim the buffer if we are near EOF
+            uint32_t remaining = _inode_data.data_size - _position;
+            if (size > remaining) {
+                size = remaining;
+            }
+
+            // Loaded in chunks, so that the budget is checked between backend calls
+            uint32_t done = 0;
+            while (done < size) {
+                uint32_t len = size - done;
+                if (work.has_deadline() && len > READ_SOME_CHUNK_SIZE) {
+                    len = READ_SOME_CHUNK_SIZE;
+                }
+                if (!work.take(len)) {
+                    break;
+                }
+                int ret = _blobfs.load_chunk((uint8_t*)dest + done, _inode_data.data_offset + _position + done, len);
+                if (ret) {
+                    return ret;
+                }
+                done += len;
+            }
+            size = done;
+            _position += done;
+            return 0;
+        }
+
+        virtual int map(const void* &data, uint32_t &size, uint32_t position) {
+            // Return empty buffer on EOF
+            if (position >= _inode_data.data_size) {
+                size = 0;
+                return 0;
+            }
+
+            // Trim the buffer if we are near EOF
+            uint32_t remaining = _inode_data.data_size - position;
+            if (size > remaining) {
+                size = remaining;
+            }
+
+            return _blobfs.map_chunk(data, _inode_data.data_offset + position, size);
+        }
+    };
+
+
+
+
+#ifdef BLOBFS_HAS_ZLIB
+    // ================= Compressed File Handle =================
+
+    /** Size of the blocks files are decompressed in, unless a BlockCache sets a different one */
+    constexpr uint32_t INFLATE_BLOCK_SIZE = 4096;
+
+    /** Size of the compressed chunks fed to zlib on blobs that can't be memory-mapped */
+    constexpr uint32_t INFLATE_INPUT_SIZE = 512;
+
+    /**
+     * Reads a file with FLAG_DEFLATE
+     *
+     * The contents are a single zlib stream, which is decompressed block by block. Seeking forward keeps decompressing
+     * the same stream, while seeking backwards starts over from the beginning -- Unless the block is in the BlockCache.
+     *
+     * Decompression is incremental: A block can be decompressed across several `read_some` calls.
+     */
+    class CompressedFileHandle : public FileHandle {
+        uint32_t _position;
+        /** Compressed size, reads of the stream never go past it */
+        uint32_t _stored_size;
+        BlockCache* _cache;
+
+        z_stream _stream;
+        /** Offset of the next compressed byte to be fed to `_stream`, relative to `data_offset` */
+        uint32_t _input_offset;
+        /** Buffer for the compressed data, if it can't be mapped */
+        uint8_t* _input;
+
+        /** The last decompressed block */
+        uint8_t* _block;
+        /** Buffer `_next_block` is decompressed into -- Separate from `_block` when blocks can also come from the cache */
+        uint8_t* _output;
+        uint32_t _block_size;
+        uint32_t _block_index;
+        uint32_t _block_len;
+        bool _block_valid;
+        /** Index of the next block `_stream` will produce */
+        uint32_t _next_block;
+        /** Set while `_output` holds part of `_next_block` */
+        bool _decoding;
+
+        inline uint64_t block_key(uint32_t index) {
+            return ((uint64_t)_inode << 32) | index;
+        }
+
+        /** Maps or loads `len` compressed bytes at `_input_offset` */
+        int load_input(const void* &ptr, uint32_t len) {
+            int ret = _blobfs.map_chunk(ptr, _inode_data.data_offset + _input_offset, len);
+            if (ret == ENOSYS) {
+                if (_input == nullptr) {
+                    _input = (uint8_t*)malloc(INFLATE_INPUT_SIZE);
+                    if (_input == nullptr) {
+                        return ENOMEM;
+                    }
+                }
+                ret = _blobfs.load_chunk(_input, _inode_data.data_offset + _input_offset, len);
+                ptr = _input;
+            }
+            return ret;
+        }
+
+        int feed(WorkBudget &budget) {
+            if (_input_offset >= _stored_size) {
+                return EIO;  // Truncated stream
+            }
+            uint32_t len = INFLATE_INPUT_SIZE;
+            if (len > _stored_size - _input_offset) {
+                len = _stored_size - _input_offset;
+            }
+            if (!budget.take(len)) {
+                return EAGAIN;
+            }
+
+            const void* ptr;
+            int ret = load_input(ptr, len);
+            if (ret) {
+                return ret;
+            }
+            _stream.next_in = (Bytef*)ptr;
+            _stream.avail_in = len;
+            _input_offset += len;
+            return 0;
+        }
+
+        int restart() {
+            if (inflateReset(&_stream) != Z_OK) {
+                return EIO;
+            }
+            _stream.avail_in = 0;
+            _input_offset = 0;
+            _next_block = 0;
+            _decoding = false;
+            return 0;
+        }
+
+        /** Decompresses (the rest of) the next block of the stream into `_block`, EAGAIN if the budget runs out first */
+        int inflate_block(WorkBudget &budget) {
+            uint32_t block_start = _next_block * _block_size;
+            uint32_t expected = _inode_data.data_size - block_start;
+            if (expected > _block_size) {
+                expected = _block_size;
+            }
+
+            if (!_decoding) {
+                if (_output == _block) {
+                    _block_valid = false;
+                }
+                _stream.next_out = _output;
+                _stream.avail_out = expected;
+                _decoding = true;
+            }
+            while (_stream.avail_out > 0) {
+                if (_stream.avail_in == 0) {
+                    int ret = feed(budget);
+                    if (ret) {
+                        return ret;
+                    }
+                }
+                int ret = inflate(&_stream, Z_NO_FLUSH);
+                if (ret == Z_STREAM_END) {
+                    break;
+                }
+                if (ret != Z_OK) {
+                    return EIO;
+                }
+            }
+            if (_stream.avail_out != 0) {
+                return EIO;  // Stream is shorter than `data_size`
+            }
+
+            _decoding = false;
+            if (_output != _block) {
+                uint8_t* block = _block;
+                _block = _output;
+                _output = block;
+            }
+            _block_index = _next_block++;
+            _block_len = expected;
+            _block_valid = true;
+            if (_cache) {
+                _cache->put(block_key(_block_index), _block, _block_len);
+            }
+            return 0;
+        }
+
+        int load_block(uint32_t index, WorkBudget &budget) {
+            if (_block_valid && _block_index == index) {
+                return 0;
+            }
+            // A block half-way decompressed is finished instead of looked up
+            if (_cache && !(_decoding && index == _next_block)) {
+                // `get` might overwrite the block even if it fails
+                _block_valid = false;
+                if (_cache->get(_block, _block_len, block_key(index)) == 0) {
+                    _block_index = index;
+                    _block_valid = true;
+                    return 0;
+                }
+            }
+            if (index < _next_block) {
+                int ret = restart();
+                if (ret) {
+                    return ret;
+                }
+            }
+            while (_next_block <= index) {
+                int ret = inflate_block(budget);
+                if (ret) {
+                    return ret;
+                }
+            }
+            return 0;
+        }
+
+        int read_blocks(void *dest, uint32_t &size, uint32_t position, WorkBudget &budget) {
+            // Return empty buffer on EOF
+            if (position >= _inode_data.data_size) {
+                size = 0;
+                return 0;
+            }
+
+            // Trim the buffer if we are near EOF
+            uint32_t remaining = _inode_data.data_size - position;
+            if (size > remaining) {
+                size = remaining;
+            }
+
+            uint32_t done = 0;
+            while (done < size) {
+                uint32_t current = position + done;
+                int ret = load_block(current / _block_size, budget);
+                if (ret == EAGAIN && done > 0) {
+                    break;
+                }
+                if (ret) {
+                    return ret;
+                }
+                uint32_t block_offset = current % _block_size;
+                if (block_offset >= _block_len) {
+                    return EIO;
+                }
+                uint32_t len = _block_len - block_offset;
+                if (len > size - done) {
+                    len = size - done;
+                }
+                memcpy((uint8_t*)dest + done, _block + block_offset, len);
+                done += len;
+            }
+            size = done;
+            return 0;
+        }
+
+    public:
+        inline CompressedFileHandle(BlobFS& blobfs, inode_data_t inode_data, inode_t inode, uint32_t stored_size)
+        : FileHandle(blobfs, inode_data, inode), _position(0), _stored_size(stored_size), _cache(blobfs._block_cache),
+          _input_offset(0), _input(nullptr), _block(nullptr), _output(nullptr), _block_size(INFLATE_BLOCK_SIZE), _block_index(0), _block_len(0),
+          _block_valid(false), _next_block(0), _decoding(false)
+        {
+            memset(&_stream, 0, sizeof(_stream));
+            if (_cache) {
+                _block_size = _cache->block_size();
+            }
+        }
+
+        virtual ~CompressedFileHandle() {
+            inflateEnd(&_stream);
+            free(_input);
+            if (_output != _block) {
+                free(_output);
+            }
+            free(_block);
+        }
+
+        int begin() {
+            if (_block_size == 0) {
+                return ENXIO;  // The cache is not usable, e.g. it failed to open
+            }
+            _block = (uint8_t*)malloc(_block_size);
+            if (_block == nullptr) {
+                return ENOMEM;
+            }
+            _output = _block;
+            if (_cache) {
+                _output = (uint8_t*)malloc(_block_size);
+                if (_output == nullptr) {
+                    return ENOMEM;
+                }
+            }
+            if (inflateInit(&_stream) != Z_OK) {
+                return ENOMEM;
+            }
+            return 0;
+        }
+
+        virtual int tell(uint32_t& position) {
+            position = _position;
+            return 0;
+        }
+
+        virtual int seek(uint32_t position)  {
+            if (position > _inode_data.data_size) {
+                return EINVAL;
+            }
+            _position = position;
+            return 0;
+        }
+
+        virtual int read(void *dest, uint32_t &size) {
+            int ret = pread(dest, size, _position);
+            if (ret == 0) {
+                _position += size; // On success, move file cursor
+            }
+            return ret;
+        }
+
+        virtual int pread(void *dest, uint32_t &size, uint32_t position) {
+            WorkBudget budget;
+            return read_blocks(dest, size, position, budget);
+        }
+
+        virtual int read_some(void *dest, uint32_t &size, const read_budget_t &budget) {
+            WorkBudget work(budget);
+            int ret = read_blocks(dest, size, _position, work);
+            if (ret == 0) {
+                _position += size; // On success, move file cursor
+            }
+            return ret;
+        }
+    };
+#endif
+
+
+
+
+    // ================= Directory Handle =================
+
+    /** Number of entries `readdir_bulk` loads at a time from blobs that can't be memory-mapped */
+    constexpr uint32_t DIR_BULK_BATCH_SIZE = 16;
+
+    /** Size of the chunks `readdir_bulk` loads names in, from blobs that can't be memory-mapped */
+    constexpr uint32_t DIR_BULK_NAME_CHUNK_SIZE = 32;
+
+    int DirHandle::readdir(dir_entry_t& direntry, inode_t &inode) {
+        if (_position >= _end) {
+            return ENOENT;
+        }
+        offset_t entry_offset = _inode_data.data_offset + (_position++) * sizeof(dir_entry_t);
+        inode = entry_offset + offsetof(dir_entry_t, inode_data);
+
+        int ret = _blobfs.load_chunk(&direntry, entry_offset, sizeof(dir_entry_t));
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(direntry);
+
+        return 0;
+    }
+
+    int DirHandle::compare_prefix(int &cmp, uint32_t index, const char* prefix, size_t prefix_len) {
+        offset_t name_offset;
+        int ret = _blobfs.load_chunk(&name_offset, _inode_data.data_offset + index * sizeof(dir_entry_t) + offsetof(dir_entry_t, name_offset), sizeof(offset_t));
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(name_offset);
+
+        const char* name;
+        ret = _blobfs.load_str(name, name_offset);
+        if (ret) {
+            return ret;
+        }
+        cmp = strncmp(name, prefix, prefix_len);
+        _blobfs.free_str(name);
+        return 0;
+    }
+
+    int DirHandle::seek_prefix(const char* prefix) {
+        size_t prefix_len = strlen(prefix);
+
+        // First entry >= prefix
+        uint32_t low = 0;
+        uint32_t high = _inode_data.data_size;
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            int cmp;
+            int ret = compare_prefix(cmp, middle, prefix, prefix_len);
+            if (ret) {
+                return ret;
+            }
+            if (cmp < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        uint32_t start = low;
+
+        // First entry past the prefix
+        high = _inode_data.data_size;
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            int cmp;
+            int ret = compare_prefix(cmp, middle, prefix, prefix_len);
+            if (ret) {
+                return ret;
+            }
+            if (cmp <= 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        _position = start;
+        _end = low;
+        return 0;
+    }
+
+    int DirHandle::load_name(char* dest, uint32_t capacity, offset_t offset, uint32_t &len, bool mapped) {
+        if (mapped) {
+            // load_str is just a pointer into the blob
+            const char* str;
+            int ret = _blobfs.load_str(str, offset);
+            if (ret) {
+                return ret;
+            }
+            size_t str_len = strlen(str);
+            if (str_len >= capacity) {
+                _blobfs.free_str(str);
+                return ENOSPC;
+            }
+            memcpy(dest, str, str_len + 1);
+            _blobfs.free_str(str);
+            len = str_len;
+            return 0;
+        }
+
+        // Loaded straight into the buffer, one chunk at a time until the NULL terminator
+        uint32_t blob_size;
+        bool has_size = _blobfs.blob_size(blob_size) == 0;
+        uint32_t loaded = 0;
+        while (true) {
+            uint32_t chunk = DIR_BULK_NAME_CHUNK_SIZE;
+            if (chunk > capacity - loaded) {
+                chunk = capacity - loaded;
+            }
+            if (has_size) {
+                if (offset + loaded >= blob_size) {
+                    return EINVAL;  // Not NULL-terminated
+                }
+                if (chunk > blob_size - offset - loaded) {
+                    chunk = blob_size - offset - loaded;
+                }
+            }
+            if (chunk == 0) {
+                return ENOSPC;
+            }
+            int ret = _blobfs.load_chunk(dest + loaded, offset + loaded, chunk);
+            if (ret) {
+                return ret;
+            }
+            const char* end = (const char*)memchr(dest + loaded, '\0', chunk);
+            if (end != nullptr) {
+                len = end - dest;
+                return 0;
+            }
+            loaded += chunk;
+        }
+    }
+
+    int DirHandle::readdir_bulk(void* buffer, uint32_t capacity, uint32_t &count) {
+        count = 0;
+        uint8_t* out = (uint8_t*)buffer;
+        uint32_t used = 0;
+        dir_entry_t batch[DIR_BULK_BATCH_SIZE];
+        bool full = false;
+
+        while (!full && _position < _end) {
+            // Memory-mapped blobs take the whole rest of the table at once, others are loaded in batches
+            uint32_t n = _end - _position;
+            offset_t table_offset = _inode_data.data_offset + _position * sizeof(dir_entry_t);
+            const void* table;
+            int ret = _blobfs.map_chunk(table, table_offset, n * sizeof(dir_entry_t));
+            bool mapped = ret == 0;
+            if (ret == ENOSYS) {
+                if (n > DIR_BULK_BATCH_SIZE) {
+                    n = DIR_BULK_BATCH_SIZE;
+                }
+                ret = _blobfs.load_chunk(batch, table_offset, n * sizeof(dir_entry_t));
+                table = batch;
+            }
+            if (ret) {
+                return ret;
+            }
+
+            for (uint32_t i = 0; i < n; i++) {
+                if (capacity - used <= sizeof(bulk_dirent_t)) {
+                    full = true;
+                    break;
+                }
+                dir_entry_t entry;
+                memcpy(&entry, (const dir_entry_t*)table + i, sizeof(dir_entry_t));
+                fix_endianess(entry);
+
+                bulk_dirent_t* record = (bulk_dirent_t*)(out + used);
+                uint32_t name_len;
+                ret = load_name((char*)(record + 1), capacity - used - sizeof(bulk_dirent_t), entry.name_offset, name_len, mapped);
+                if (ret == ENOSPC) {
+                    full = true;
+                    break;
+                }
+                if (ret) {
+                    return ret;
+                }
+
+                // Records are aligned to 4 bytes, except for the last one if there is no room for the padding
+                uint32_t record_size = (sizeof(bulk_dirent_t) + name_len + 1 + 3) & ~3u;
+                if (record_size > capacity - used) {
+                    record_size = capacity - used;
+                }
+                record->record_size = record_size;
+                record->inode = table_offset + i * sizeof(dir_entry_t) + offsetof(dir_entry_t, inode_data);
+                record->inode_data = entry.inode_data;
+
+                used += record_size;
+                count++;
+                _position++;
+            }
+        }
+
+        if (count == 0 && _position < _end) {
+            return EINVAL;  // Buffer too small for the next entry
+        }
+        return 0;
+    }
+
+
+
+
+    // ================= Main FS functions =================
+
+    BlobFS::~BlobFS() {
+        while (_nested != nullptr) {
+            SubBlobFS* next = _nested->_next;
+            delete _nested;
+            _nested = next;
+        }
+    }
+
+    /** Checks that the entries of a directory can be looked up in this blob */
+    static int lookup_dir_status(const inode_data_t &parent) {
+        if ((parent.flags & FLAG_NESTED) != 0) {
+            // A different blob, use `nested()` to get it
+            return EXDEV;
+        }
+        if ((parent.flags & FLAG_DIR) == 0) {
+            // We cannot lookup into a file, only into directories
+            return ENOTDIR;
+        }
+        if ((parent.flags & FLAG_DEFLATE) != 0) {
+            // Compression is not supported on directory indexes
+            return ENOSYS;
+        }
+        if ((parent.flags & FLAG_SHARD) != 0) {
+            // Stored in other blobs, only ShardedBlobFS can follow it
+            return EXDEV;
+        }
+        return 0;
+    }
+
+    /** ASCII case folding, as used by the case-folded name index */
+    static inline uint8_t fold_char(char c) {
+        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    bool BlobFS::fold_equal(const char* a, const char* b) {
+        while (*a && fold_char(*a) == fold_char(*b)) {
+            a++;
+            b++;
+        }
+        return fold_char(*a) == fold_char(*b);
+    }
+
+    /** Initial value of `fold_hash` */
+    constexpr uint32_t FOLD_HASH_SEED = 2166136261u;
+
+    static inline uint32_t fold_hash_step(uint32_t hash, char c) {
+        return (hash ^ fold_char(c)) * 16777619u;
+    }
+
+    uint32_t BlobFS::fold_hash(const char* name) {
+        uint32_t hash = FOLD_HASH_SEED;
+        for (const char* c = name; *c; c++) {
+            hash = fold_hash_step(hash, *c);
+        }
+        return hash;
+    }
+
+    uint64_t BlobFS::bloom_hash(const char* name) {
+        uint64_t hash = 14695981039346656037ull;
+        for (const char* c = name; *c; c++) {
+            hash = (hash ^ fold_char(*c)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    /** Multipliers picking the bit set in each word of a Bloom filter block */
+    static const uint32_t BLOOM_SALTS[BLOOM_BLOCK_WORDS] = {
+        0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du, 0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u,
+    };
+
+    int BlobFS::bloom_rejects(bool &rejected, const dir_ext_t &ext, const char* name) {
+        rejected = false;
+        if (ext.bloom_offset == 0 || ext.bloom_blocks == 0) {
+            return 0;
+        }
+        uint64_t hash = bloom_hash(name);
+        uint32_t block_index = ((hash >> 32) * ext.bloom_blocks) >> 32;
+        bloom_block_t block;
+        int ret = load_chunk(&block, ext.bloom_offset + block_index * sizeof(bloom_block_t), sizeof(bloom_block_t));
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(block);
+        for (uint32_t i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+            uint32_t bit = ((uint32_t)hash * BLOOM_SALTS[i]) >> 27;
+            if ((block.words[i] & (1u << bit)) == 0) {
+                rejected = true;
+                break;
+            }
+        }
+        return 0;
+    }
+
+    int BlobFS::lookup_child(inode_t &child, inode_t parent_inode, const char* name) {
+        inode_data_t parent;
+        int ret = load_chunk(&parent, parent_inode, sizeof(inode_data_t));
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(parent);
+        return find_child(child, parent, name);
+    }
+
+    int BlobFS::find_child(inode_t &child, const inode_data_t &parent, const char* name) {
+        int ret = lookup_dir_status(parent);
+        if (ret) {
+            return ret;
+        }
+
+        // Most missing names are rejected by the Bloom filter, without looking at the entries
+        dir_ext_t ext;
+        if (load_dir_ext(ext, parent) == 0) {
+            bool rejected;
+            ret = bloom_rejects(rejected, ext, name);
+            if (ret) {
+                return ret;
+            }
+            if (rejected) {
+                return ENOENT;
+            }
+            uint32_t child_index;
+            ret = ext_index_find(child_index, parent, ext, name, false);
+            if (ret == 0) {
+                child = parent.data_offset + child_index * sizeof(dir_entry_t) + offsetof(dir_entry_t, inode_data);
+                return 0;
+            }
+            if (ret != ENOSYS) {
+                return ret;
+            }
+        }
+
+        if (_dir_index != nullptr) {
+            uint32_t child_index;
+            ret = _dir_index->find(child_index, *this, parent, name, false);
+            if (ret == 0) {
+                child = parent.data_offset + child_index * sizeof(dir_entry_t) + offsetof(dir_entry_t, inode_data);
+                return 0;
+            }
+            if (ret != ENOSYS) {
+                return ret;
+            }
+        }
+
+        //TODO: Use binary search instead
+
+        offset_t current_direntry_ptr = parent.data_offset;
+        for (uint32_t child_index = 0; child_index < parent.data_size; child_index++) {
+            offset_t child_name_offset;
+            ret = load_chunk(&child_name_offset, current_direntry_ptr + offsetof(dir_entry_t, name_offset), sizeof(offset_t)); // Don't need
+            if (ret) {
+                return ret;
+            }
+            fix_endianess(child_name_offset);
+
+            const char* child_name;
+            ret = load_str(child_name, child_name_offset);
+            if (ret) {
+                return ret;
+            }
+
+            int cmp = strcmp(name, child_name);
+            free_str(child_name);
+
+
+            // Found a matching name
+            if (cmp == 0) {
+                child = current_direntry_ptr + offsetof(dir_entry_t, inode_data);
+                return 0;
+            }
+
+            // Go to the next entry
+            current_direntry_ptr += sizeof(dir_entry_t);
+        }
+
+        // Not found
+        return ENOENT;
+    }
+
+    int BlobFS::lookup_child_folded(inode_t &child, inode_t parent_inode, const char* name) {
+        inode_data_t parent;
+        int ret = load_chunk(&parent, parent_inode, sizeof(inode_data_t));
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(parent);
+        return find_child_folded(child, parent, name);
+    }
+
+    int BlobFS::find_child_folded(inode_t &child, const inode_data_t &parent, const char* name) {
+        int ret = lookup_dir_status(parent);
+        if (ret) {
+            return ret;
+        }
+
+        // The index and the Bloom filter are referenced by the directory extension record
+        offset_t index_offset = 0;
+        dir_ext_t ext;
+        if (load_dir_ext(ext, parent) == 0) {
+            bool rejected;
+            ret = bloom_rejects(rejected, ext, name);
+            if (ret) {
+                return ret;
+            }
+            if (rejected) {
+                return ENOENT;
+            }
+            uint32_t child_index;
+            ret = ext_index_find(child_index, parent, ext, name, true);
+            if (ret == 0) {
+                child = parent.data_offset + child_index * sizeof(dir_entry_t) + offsetof(dir_entry_t, inode_data);
+                return 0;
+            }
+            if (ret != ENOSYS) {
+                return ret;
+            }
+            index_offset = ext.fold_index_offset;
+        }
+
+        if (_dir_index != nullptr) {
+            uint32_t child_index;
+            ret = _dir_index->find(child_index, *this, parent, name, true);
+            if (ret == 0) {
+                child = parent.data_offset + child_index * sizeof(dir_entry_t) + offsetof(dir_entry_t, inode_data);
+                return 0;
+            }
+            if (ret != ENOSYS) {
+                return ret;
+            }
+        }
+
+        uint32_t first = 0;
+        uint32_t last = parent.data_size;
+        uint32_t hash = fold_hash(name);
+        if (index_offset != 0) {
+            // Only the entries with the same hash are compared
+            uint32_t low = 0;
+            uint32_t high = parent.data_size;
+            while (low < high) {
+                uint32_t middle = low + (high - low) / 2;
+                uint32_t middle_hash;
+                ret = load_chunk(&middle_hash, index_offset + middle * sizeof(fold_entry_t) + offsetof(fold_entry_t, hash), sizeof(uint32_t));
+                if (ret) {
+                    return ret;
+                }
+                fix_endianess(middle_hash);
+                if (middle_hash < hash) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            first = low;
+        }
+
+        for (uint32_t position = first; position < last; position++) {
+            uint32_t child_index = position;
+            if (index_offset != 0) {
+                fold_entry_t fold_entry;
+                ret = load_chunk(&fold_entry, index_offset + position * sizeof(fold_entry_t), sizeof(fold_entry_t));
+                if (ret) {
+                    return ret;
+                }
+                fix_endianess(fold_entry);
+                if (fold_entry.hash != hash) {
+                    break;
+                }
+                if (fold_entry.index >= parent.data_size) {
+                    return EINVAL;
+                }
+                child_index = fold_entry.index;
+            }
+
+            offset_t child_direntry_ptr = parent.data_offset + child_index * sizeof(dir_entry_t);
+            offset_t child_name_offset;
+            ret = load_chunk(&child_name_offset, child_direntry_ptr + offsetof(dir_entry_t, name_offset), sizeof(offset_t));
+            if (ret) {
+                return ret;
+            }
+            fix_endianess(child_name_offset);
+
+            const char* child_name;
+            ret = load_str(child_name, child_name_offset);
+            if (ret) {
+                return ret;
+            }
+            bool equal = fold_equal(name, child_name);
+            free_str(child_name);
+
+            if (equal) {
+                child = child_direntry_ptr + offsetof(dir_entry_t, inode_data);
+                return 0;
+            }
+        }
+
+        // Not found
+        return ENOENT;
+    }
+
+    /** Returns the node after `node` in the order of the keys of an Eytzinger tree of `count` nodes, or 0 after the last one */
+    static inline uint64_t eytzinger_next(uint64_t node, uint32_t count) {
+        if (2 * node + 1 <= count) {
+            // Leftmost node of the right subtree
+            node = 2 * node + 1;
+            while (2 * node <= count) {
+                node = 2 * node;
+            }
+            return node;
+        }
+        // First ancestor whose left subtree contains it
+        while (node & 1) {
+            node >>= 1;
+        }
+        return node >> 1;
+    }
+
+    int BlobFS::eytzinger_find(uint32_t &index, const inode_data_t &dir, offset_t keys_offset, const char* name, bool folded) {
+        uint32_t count = dir.data_size;
+        uint32_t hash = fold_hash(name);
+        uint64_t prefetch_stride = (uint64_t)1 << EYTZINGER_PREFETCH_LEVELS;
+
+        // Corrupted sizes would wrap around
+        uint64_t keys_size = (uint64_t)count * sizeof(fold_entry_t);
+        if (keys_size > UINT32_MAX) {
+            return EINVAL;
+        }
+
+        // Lower bound of the hash: Go left while the keys are >= hash
+        uint64_t node = 1;
+        const void* mapped;
+        if (map_chunk(mapped, keys_offset, (uint32_t)keys_size) == 0) {
+            // Branchless, the descendants a few levels down are prefetched while the current node is compared
+            const fold_entry_t* keys = (const fold_entry_t*)mapped;
+            while (node <= count) {
+                if (node * prefetch_stride <= count) {
+                    __builtin_prefetch(keys + node * prefetch_stride - 1);
+                }
+                node = 2 * node + (ntohl(keys[node - 1].hash) < hash);
+            }
+        } else {
+            while (node <= count) {
+                if (node * prefetch_stride <= count) {
+                    prefetch(keys_offset + (node * prefetch_stride - 1) * sizeof(fold_entry_t), prefetch_stride * sizeof(fold_entry_t));
+                }
+                uint32_t node_hash;
+                int ret = load_chunk(&node_hash, keys_offset + (node - 1) * sizeof(fold_entry_t) + offsetof(fold_entry_t, hash), sizeof(uint32_t));
+                if (ret) {
+                    return ret;
+                }
+                fix_endianess(node_hash);
+                node = 2 * node + (node_hash < hash);
+            }
+        }
+        // Undo the right turns taken after the last left turn
+        node >>= __builtin_ffsll(~node);
+
+        // Names with the same hash follow it
+        for (; node != 0; node = eytzinger_next(node, count)) {
+            fold_entry_t entry;
+            int ret = load_chunk(&entry, keys_offset + (node - 1) * sizeof(fold_entry_t), sizeof(fold_entry_t));
+            if (ret) {
+                return ret;
+            }
+            fix_endianess(entry);
+            if (entry.hash != hash) {
+                break;
+            }
+            if (entry.index >= count) {
+                return EINVAL;
+            }
+
+            bool equal;
+            ret = compare_entry_name(equal, dir, entry.index, name, folded);
+            if (ret) {
+                return ret;
+            }
+            if (equal) {
+                index = entry.index;
+                return 0;
+            }
+        }
+        return ENOENT;
+    }
+
+    int BlobFS::ext_index_find(uint32_t &index, const inode_data_t &dir, const dir_ext_t &ext, const char* name, bool folded) {
+        if (ext.eytzinger_offset != 0) {
+            return eytzinger_find(index, dir, ext.eytzinger_offset, name, folded);
+        }
+        if (ext.btree_offset != 0) {
+            return btree_find(index, dir, ext, name, folded);
+        }
+        if (ext.fingerprint_offset != 0) {
+            return fingerprint_find(index, dir, ext.fingerprint_offset, name, folded);
+        }
+        // The sorted fold index is only used by case-insensitive lookups
+        return ENOSYS;
+    }
+
+    /** Returns the i-th word following the header of a B+-tree node: Its keys, and then its values */
+    static inline uint32_t btree_word(const uint8_t* node, uint32_t i) {
+        uint32_t word;
+        memcpy(&word, node + sizeof(btree_node_t) + i * sizeof(uint32_t), sizeof(uint32_t));
+        return ntohl(word);
+    }
+
+    int BlobFS::load_btree_node(const uint8_t* &node, btree_node_t &header, uint8_t* &buffer, offset_t offset, uint32_t node_size) {
+        if (node_size < sizeof(btree_node_t) || node_size > BTREE_MAX_NODE_SIZE) {
+            return EINVAL;
+        }
+        const void* mapped;
+        if (map_chunk(mapped, offset, node_size) == 0) {
+            node = (const uint8_t*)mapped;
+        } else {
+            // A whole node is a single read, reused for every level
+            if (buffer == nullptr) {
+                buffer = (uint8_t*)malloc(node_size);
+                if (buffer == nullptr) {
+                    return ENOMEM;
+                }
+            }
+            int ret = load_chunk(buffer, offset, node_size);
+            if (ret) {
+                return ret;
+            }
+            node = buffer;
+        }
+        memcpy(&header, node, sizeof(btree_node_t));
+        fix_endianess(header);
+        if (sizeof(btree_node_t) + 2 * (uint64_t)header.count * sizeof(uint32_t) > node_size) {
+            return EINVAL;
+        }
+        return 0;
+    }
+
+    int BlobFS::btree_find(uint32_t &index, const inode_data_t &dir, const dir_ext_t &ext, const char* name, bool folded) {
+        uint8_t* buffer = nullptr;
+        int ret = btree_search(index, dir, ext, name, folded, buffer);
+        free(buffer);
+        return ret;
+    }
+
+    int BlobFS::btree_search(uint32_t &index, const inode_data_t &dir, const dir_ext_t &ext, const char* name, bool folded, uint8_t* &buffer) {
+        uint32_t hash = fold_hash(name);
+        offset_t offset = ext.btree_offset;
+        const uint8_t* node;
+        btree_node_t header;
+        uint32_t first;
+        for (uint32_t depth = 0; ; depth++) {
+            if (depth == BTREE_MAX_DEPTH) {
+                return EINVAL;
+            }
+            int ret = load_btree_node(node, header, buffer, offset, ext.btree_node_size);
+            if (ret) {
+                return ret;
+            }
+
+            // Lower bound of the hash
+            first = 0;
+            uint32_t last = header.count;
+            while (first < last) {
+                uint32_t mid = first + (last - first) / 2;
+                if (btree_word(node, mid) < hash) {
+                    first = mid + 1;
+                } else {
+                    last = mid;
+                }
+            }
+            if (header.leaf) {
+                break;
+            }
+
+            // The hash can only be in the last child starting below it, or in the next ones
+            if (header.count == 0) {
+                return EINVAL;
+            }
+            offset_t child = btree_word(node, header.count + (first == 0 ? 0 : first - 1));
+            // Children are stored before their parents, so lookups always end
+            if (child >= offset) {
+                return EINVAL;
+            }
+            offset = child;
+        }
+
+        // Names with the same hash, which might continue on the next leaves
+        while (true) {
+            for (; first < header.count && btree_word(node, first) == hash; first++) {
+                uint32_t entry_index = btree_word(node, header.count + first);
+                if (entry_index >= dir.data_size) {
+                    return EINVAL;
+                }
+                bool equal;
+                int ret = compare_entry_name(equal, dir, entry_index, name, folded);
+                if (ret) {
+                    return ret;
+                }
+                if (equal) {
+                    index = entry_index;
+                    return 0;
+                }
+            }
+            if (first < header.count || header.next == 0) {
+                return ENOENT;
+            }
+            if (header.next <= offset) {
+                return EINVAL;
+            }
+            offset = header.next;
+            int ret = load_btree_node(node, header, buffer, offset, ext.btree_node_size);
+            if (ret) {
+                return ret;
+            }
+            if (!header.leaf) {
+                return EINVAL;
+            }
+            first = 0;
+        }
+    }
+
+    int BlobFS::compare_entry_name(bool &equal, const inode_data_t &dir, uint32_t index, const char* name, bool folded) {
+        offset_t name_offset;
+        int ret = load_chunk(&name_offset, dir.data_offset + index * sizeof(dir_entry_t) + offsetof(dir_entry_t, name_offset), sizeof(offset_t));
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(name_offset);
+        const char* entry_name;
+        ret = load_str(entry_name, name_offset);
+        if (ret) {
+            return ret;
+        }
+        equal = folded ? fold_equal(name, entry_name) : strcmp(name, entry_name) == 0;
+        free_str(entry_name);
+        return 0;
+    }
+
+    /** Number of fingerprints loaded at a time from blobs that can't be memory-mapped */
+    constexpr uint32_t FINGERPRINT_BATCH_SIZE = 64;
+
+    /**
+     * Returns the position of the first occurrence of `needle` in `fingerprints`, or `count` if there is none
+     *
+     * Compares 16 fingerprints per instruction with AVX2, 8 with SSE2 or NEON.
+     */
+    static uint32_t fingerprint_scan(const uint16_t* fingerprints, uint32_t count, uint16_t needle) {
+        uint32_t i = 0;
+#if defined(__AVX2__)
+        __m256i needles = _mm256_set1_epi16((short)needle);
+        for (; i + 16 <= count; i += 16) {
+            __m256i block = _mm256_loadu_si256((const __m256i*)(fingerprints + i));
+            uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(block, needles));
+            if (mask) {
+                return i + __builtin_ctz(mask) / 2;
+            }
+        }
+#elif defined(__SSE2__)
+        __m128i needles = _mm_set1_epi16((short)needle);
+        for (; i + 8 <= count; i += 8) {
+            __m128i block = _mm_loadu_si128((const __m128i*)(fingerprints + i));
+            uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi16(block, needles));
+            if (mask) {
+                return i + __builtin_ctz(mask) / 2;
+            }
+        }
+#elif defined(__ARM_NEON)
+        uint16x8_t needles = vdupq_n_u16(needle);
+        for (; i + 8 <= count; i += 8) {
+            uint16x8_t matches = vceqq_u16(vld1q_u16(fingerprints + i), needles);
+            // A byte per fingerprint
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(matches, 4)), 0);
+            if (mask) {
+                return i + __builtin_ctzll(mask) / 8;
+            }
+        }
+#endif
+        for (; i < count; i++) {
+            // Columns are not necessarily aligned
+            uint16_t fingerprint;
+            memcpy(&fingerprint, fingerprints + i, sizeof(fingerprint));
+            if (fingerprint == needle) {
+                return i;
+            }
+        }
+        return count;
+    }
+
+    int BlobFS::fingerprint_find(uint32_t &index, const inode_data_t &dir, offset_t fingerprint_offset, const char* name, bool folded) {
+        // Fingerprints are compared as stored (little-endian), swapping the one being looked up instead
+        uint16_t needle = ntohs(fingerprint(name));
+
+        // Corrupted sizes would wrap around
+        uint64_t column_size = (uint64_t)dir.data_size * sizeof(uint16_t);
+        if (column_size > UINT32_MAX) {
+            return EINVAL;
+        }
+
+        const void* mapped = nullptr;
+        map_chunk(mapped, fingerprint_offset, (uint32_t)column_size);
+        uint16_t batch[FINGERPRINT_BATCH_SIZE];
+        for (uint32_t start = 0; start < dir.data_size; ) {
+            const uint16_t* fingerprints;
+            uint32_t count = dir.data_size - start;
+            if (mapped != nullptr) {
+                fingerprints = (const uint16_t*)mapped + start;
+            } else {
+                if (count > FINGERPRINT_BATCH_SIZE) {
+                    count = FINGERPRINT_BATCH_SIZE;
+                }
+                int ret = load_chunk(batch, fingerprint_offset + start * sizeof(uint16_t), count * sizeof(uint16_t));
+                if (ret) {
+                    return ret;
+                }
+                fingerprints = batch;
+            }
+
+            // Only the names with a matching fingerprint are compared
+            uint32_t position = fingerprint_scan(fingerprints, count, needle);
+            if (position == count) {
+                start += count;
+                continue;
+            }
+            bool equal;
+            int ret = compare_entry_name(equal, dir, start + position, name, folded);
+            if (ret) {
+                return ret;
+            }
+            if (equal) {
+                index = start + position;
+                return 0;
+            }
+            start += position + 1;
+        }
+        return ENOENT;
+    }
+
+    int BlobFS::lookup(inode_t &inode, const char* path) {
+        BlobFS* blobfs;
+        int ret = lookup(blobfs, inode, path);
+        if (ret) {
+            return ret;
+        }
+        if (blobfs != this) {
+            return EXDEV;
+        }
+        return 0;
+    }
+
+    int BlobFS::lookup(BlobFS* &blobfs, inode_t &inode, const char* path) {
+        inode_data_t inode_data;
+        inode_data_t parent;
+        return walk(blobfs, inode, inode_data, parent, path);
+    }
+
+    /**
+     * Walks a path like `lookup`, also returning the inode data of the inode and of the directory it was found in
+     *
+     * `parent` has flags 0 if the inode is the root of a blob, i.e. it isn't an entry of any directory.
+     */
+    int BlobFS::walk(BlobFS* &blobfs, inode_t &inode, inode_data_t &inode_data, inode_data_t &parent, const char* path) {
+        blobfs = this;
+        inode = 0;  // start from root inode
+        memset(&parent, 0, sizeof(inode_data_t));
+
+        // Path must start with "/"
+        if (path == nullptr || path[0] != '/') {
+            return ENOENT;
+        }
+
+        // The inode data of each level is loaded once: it is both checked for nested blobs and searched
+        int ret = stat(inode_data, inode);
+        if (ret) {
+            return ret;
+        }
+
+        if (supports_prefetch()) {
+            prefetch_path(path, inode_data);
+        }
+
+        const char* chunk_start = path + 1;
+        for (const char* chunk_end=chunk_start; ; chunk_end++) {
+            char endchar = *chunk_end;
+            if ((endchar == '/') || (endchar == '\0')) {
+                if (chunk_end != chunk_start) { // Ignore empty chunks -- .e.g "/foo//bar/" == "/foo/bar"
+                    size_t chunk_size = chunk_end - chunk_start;
+                    char* chunk_name = (char*)malloc(chunk_size + 1);
+                    memcpy(chunk_name, chunk_start, chunk_size);
+                    chunk_name[chunk_size] = '\0';
+
+                    parent = inode_data;
+                    ret = _case_insensitive ? blobfs->find_child_folded(inode, inode_data, chunk_name) : blobfs->find_child(inode, inode_data, chunk_name);
+                    free(chunk_name);
+                    if (ret == 0) {
+                        ret = blobfs->stat(inode_data, inode);
+                    }
+
+                    // Nested blobs are traversed as if they were mounted on their file
+                    if (ret == 0 && (inode_data.flags & FLAG_NESTED) != 0) {
+                        ret = blobfs->nested(blobfs, inode);
+                        inode = 0;
+                        memset(&parent, 0, sizeof(inode_data_t));
+                        if (ret == 0) {
+                            ret = blobfs->stat(inode_data, inode);
+                        }
+                    }
+
+                    if (ret) {
+                        return ret;
+                    }
+                }
+                chunk_start = chunk_end + 1;
+            }
+            if (endchar == '\0') {
+                break;
+            }
+        }
+
+        return 0;
+    }
+
+    /** Clamps the size of a chunk to prefetch */
+    static inline uint32_t prefetch_size(uint64_t size) {
+        return size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    }
+
+    void BlobFS::prefetch_path(const char* path, const inode_data_t &root) {
+        superblock_t sb;
+        if (superblock(sb) || sb.path_hint_offset == 0 || sb.path_hint_capacity == 0 || (sb.path_hint_capacity & (sb.path_hint_capacity - 1)) != 0) {
+            return;
+        }
+
+        // Hashes of the directories the walk goes through, like the builder's: "/a", "/a/b", ... but not the last component
+        uint32_t hashes[PATH_HINT_MAX_DEPTH];
+        uint32_t count = 0;
+        uint32_t hash = FOLD_HASH_SEED;
+        const char* c = path;
+        while (count < PATH_HINT_MAX_DEPTH) {
+            while (*c == '/') {
+                c++;
+            }
+            if (*c == '\0') {
+                break;
+            }
+            hash = fold_hash_step(hash, '/');
+            while (*c != '\0' && *c != '/') {
+                hash = fold_hash_step(hash, *c++);
+            }
+            if (*c == '\0') {
+                break;
+            }
+            hashes[count++] = hash;
+        }
+        if (count == 0) {
+            return;
+        }
+
+        // All the slots first, then all the directories they point to, then their indexes: A few round-trips,
+        // whatever the depth
+        uint32_t mask = sb.path_hint_capacity - 1;
+        for (uint32_t i = 0; i < count; i++) {
+            prefetch(sb.path_hint_offset + (hashes[i] & mask) * sizeof(path_hint_t), sizeof(path_hint_t));
+        }
+        inode_data_t dirs[PATH_HINT_MAX_DEPTH + 1];
+        uint32_t dir_count = 0;
+        dirs[dir_count++] = root;
+        prefetch_dir(root, sb);
+        for (uint32_t i = 0; i < count; i++) {
+            for (uint32_t slot = hashes[i] & mask, probes = 0; probes < sb.path_hint_capacity; slot = (slot + 1) & mask, probes++) {
+                path_hint_t hint;
+                if (load_chunk(&hint, sb.path_hint_offset + slot * sizeof(path_hint_t), sizeof(path_hint_t))) {
+                    return;
+                }
+                fix_endianess(hint);
+                if (hint.dir.data_offset == 0) {
+                    break;
+                }
+                if (hint.hash == hashes[i]) {
+                    prefetch_dir(hint.dir, sb);
+                    dirs[dir_count++] = hint.dir;
+                    break;
+                }
+            }
+        }
+        for (uint32_t i = 0; i < dir_count; i++) {
+            dir_ext_t ext;
+            if (load_dir_ext(ext, dirs[i]) == 0) {
+                prefetch_dir_indexes(dirs[i], ext);
+            }
+        }
+    }
+
+    void BlobFS::prefetch_dir(const inode_data_t &dir, const superblock_t &sb) {
+        // Its entries, and the extension record right before them
+        uint32_t ext_size = (dir.flags & FLAG_EXT) ? sb.dir_ext_size : 0;
+        if ((dir.flags & FLAG_DIR) != 0 && dir.data_offset >= ext_size) {
+            prefetch(dir.data_offset - ext_size, prefetch_size(ext_size + (uint64_t)dir.data_size * sizeof(dir_entry_t)));
+        }
+    }
+
+    void BlobFS::prefetch_dir_indexes(const inode_data_t &dir, const dir_ext_t &ext) {
+        // Backends only read the beginning of big chunks, which is where searches start anyway
+        if (ext.bloom_offset != 0) {
+            prefetch(ext.bloom_offset, prefetch_size((uint64_t)ext.bloom_blocks * sizeof(bloom_block_t)));
+        }
+        if (ext.eytzinger_offset != 0) {
+            prefetch(ext.eytzinger_offset, prefetch_size((uint64_t)dir.data_size * sizeof(fold_entry_t)));
+        }
+        if (ext.btree_offset != 0) {
+            prefetch(ext.btree_offset, ext.btree_node_size);
+        }
+        if (ext.fingerprint_offset != 0) {
+            prefetch(ext.fingerprint_offset, prefetch_size((uint64_t)dir.data_size * sizeof(uint16_t)));
+        }
+        if (ext.fold_index_offset != 0 && _case_insensitive) {
+            prefetch(ext.fold_index_offset, prefetch_size((uint64_t)dir.data_size * sizeof(fold_entry_t)));
+        }
+    }
+
+    int BlobFS::nested(BlobFS* &blobfs, inode_t inode) {
+        for (SubBlobFS* sub = __atomic_load_n(&_nested, __ATOMIC_ACQUIRE); sub != nullptr; sub = sub->_next) {
+            if (sub->_mount_inode == inode) {
+                blobfs = sub;
+                return 0;
+            }
+        }
+
+        inode_data_t inode_data;
+        int ret = stat(inode_data, inode);
+        if (ret) {
+            return ret;
+        }
+        if ((inode_data.flags & FLAG_NESTED) == 0) {
+            return EINVAL;
+        }
+        SubBlobFS* sub = new SubBlobFS(*this, inode_data.data_offset, inode_data.data_size);
+        sub->_mount_inode = inode;
+        if (_validated) {
+            // Keep the guarantees of a validated blob
+            ret = sub->validate();
+            if (ret) {
+                delete sub;
+                return ret;
+            }
+        }
+
+        // Racing threads might both mount it, which only wastes a few bytes until this blob is destroyed
+        sub->_next = __atomic_load_n(&_nested, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&_nested, &sub->_next, sub, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {}
+        blobfs = sub;
+        return 0;
+    }
+
+    int BlobFS::stat(inode_data_t &inode_data, inode_t inode) {
+        int ret = load_chunk(&inode_data, inode, sizeof(inode_data_t));
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(inode_data);
+        return 0;
+    }
+
+    int BlobFS::load_superblock(superblock_t &sb) {
+        // Zeroed on failure too
+        memset(&sb, 0, sizeof(superblock_t));
+        inode_data_t root;
+        int ret = load_chunk(&root, 0, sizeof(inode_data_t));
+        if (ret) {
+            return ret;
+        }
+        if ((root.flags & FLAG_SUPERBLOCK) == 0) {
+            return ENODATA;
+        }
+
+        // Old blobs might have a smaller superblock, and newer ones a bigger one
+        ret = load_chunk(&sb, sizeof(inode_data_t), offsetof(superblock_t, file_ext_size));
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(sb);
+        if (sb.magic != SUPERBLOCK_MAGIC || sb.superblock_size < offsetof(superblock_t, file_ext_size)) {
+            return EINVAL;
+        }
+        uint32_t size = sb.superblock_size < sizeof(superblock_t) ? sb.superblock_size : sizeof(superblock_t);
+        ret = load_chunk(&sb, sizeof(inode_data_t), size);
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(sb);
+        return 0;
+    }
+
+    /** Sets `state.path` to `state.path[0:path_len] + "/" + name` */
+    static int walk_path(walk_state_t &state, uint32_t path_len, const char* name, uint32_t &new_len) {
+        size_t name_len = strlen(name);
+        new_len = path_len + 1 + name_len;
+        if (new_len + 1 > state.path_capacity) {
+            uint32_t capacity = state.path_capacity ? state.path_capacity : 64;
+            while (capacity < new_len + 1) {
+                capacity *= 2;
+            }
+            char* path = (char*)realloc(state.path, capacity);
+            if (path == nullptr) {
+                return ENOMEM;
+            }
+            state.path = path;
+            state.path_capacity = capacity;
+        }
+        state.path[path_len] = '/';
+        memcpy(state.path + path_len + 1, name, name_len + 1);
+        return 0;
+    }
+
+    int BlobFS::walk(const char* root, walk_visitor_t visitor, void* arg) {
+        inode_t inode;
+        inode_data_t inode_data;
+        int ret = lookup(inode, root);
+        if (ret == 0) {
+            ret = stat(inode_data, inode);
+        }
+        if (ret) {
+            return ret;
+        }
+
+        // Paths of the entries are appended to the root, without its trailing '/'
+        walk_state_t state = {visitor, arg, nullptr, 0, nullptr, nullptr};
+        uint32_t root_len = strlen(root);
+        while (root_len > 0 && root[root_len - 1] == '/') {
+            root_len--;
+        }
+        state.path_capacity = root_len + 1;
+        state.path = (char*)malloc(state.path_capacity);
+        if (state.path == nullptr) {
+            return ENOMEM;
+        }
+        memcpy(state.path, root, root_len);
+        state.path[root_len] = '\0';
+
+        ret = visitor(arg, root_len ? state.path : "/", inode, inode_data, 0);
+        if (ret == 0 && (inode_data.flags & FLAG_DIR) != 0) {
+            ret = walk_dir(state, inode_data, root_len, 1);
+        }
+        free(state.path);
+        return ret == WALK_SKIP_SUBTREE ? 0 : ret;
+    }
+
+    int BlobFS::walk_dir(walk_state_t &state, const inode_data_t &dir, uint32_t path_len, uint32_t depth) {
+        if ((dir.flags & FLAG_DIR) == 0 || (dir.flags & (FLAG_DEFLATE | FLAG_SHARD)) != 0 || dir.data_size == 0) {
+            return 0;  // Nothing that can be listed here
+        }
+
+        // Whole table at once -- Corrupted sizes would wrap around
+        if ((uint64_t)dir.data_size * sizeof(dir_entry_t) > UINT32_MAX) {
+            return EINVAL;
+        }
+        uint32_t table_size = dir.data_size * sizeof(dir_entry_t);
+        const void* mapped;
+        dir_entry_t* table = nullptr;
+        int ret = map_chunk(mapped, dir.data_offset, table_size);
+        if (ret == ENOSYS) {
+            table = (dir_entry_t*)malloc(table_size);
+            if (table == nullptr) {
+                return ENOMEM;
+            }
+            ret = load_chunk(table, dir.data_offset, table_size);
+            mapped = table;
+        }
+        if (ret) {
+            free(table);
+            return ret;
+        }
+        const dir_entry_t* entries = (const dir_entry_t*)mapped;
+
+        // The visitor goes through the names while the subdirectory tables are being loaded
+        for (uint32_t i = 0; i < dir.data_size; i++) {
+            dir_entry_t entry;
+            memcpy(&entry, &entries[i], sizeof(dir_entry_t));
+            fix_endianess(entry);
+            if ((entry.inode_data.flags & FLAG_DIR) != 0 && (entry.inode_data.flags & (FLAG_DEFLATE | FLAG_SHARD)) == 0) {
+                prefetch(entry.inode_data.data_offset, entry.inode_data.data_size * sizeof(dir_entry_t));
+            }
+        }
+
+        for (uint32_t i = 0; i < dir.data_size && ret == 0; i++) {
+            dir_entry_t entry;
+            memcpy(&entry, &entries[i], sizeof(dir_entry_t));
+            fix_endianess(entry);
+            inode_t inode = dir.data_offset + i * sizeof(dir_entry_t) + offsetof(dir_entry_t, inode_data);
+
+            const char* name;
+            ret = load_str(name, entry.name_offset);
+            if (ret) {
+                break;
+            }
+            uint32_t child_len;
+            ret = walk_path(state, path_len, name, child_len);
+            free_str(name);
+            if (ret) {
+                break;
+            }
+
+            ret = state.visitor(state.arg, state.path, inode, entry.inode_data, depth);
+            if (ret == WALK_SKIP_SUBTREE) {
+                ret = 0;
+            } else if (ret == 0 && (entry.inode_data.flags & FLAG_DIR) != 0) {
+                if (state.defer != nullptr) {
+                    ret = state.defer(state.defer_arg, inode, entry.inode_data, state.path, depth + 1);
+                } else {
+                    ret = walk_dir(state, entry.inode_data, child_len, depth + 1);
+                }
+            }
+        }
+        free(table);
+        return ret;
+    }
+
+    bool BlobFS::glob_match(const char* pattern, size_t pattern_len, const char* name) {
+        const char* p = pattern;
+        const char* end = pattern + pattern_len;
+        // Position of the last `*`, and of the name when it was reached, to backtrack to
+        const char* star = nullptr;
+        const char* star_name = nullptr;
+        while (*name) {
+            if (p < end && *p == '*') {
+                star = p++;
+                star_name = name;
+            } else if (p < end && (*p == '?' || *p == *name)) {
+                p++;
+                name++;
+            } else if (star != nullptr) {
+                p = star + 1;
+                name = ++star_name;
+            } else {
+                return false;
+            }
+        }
+        while (p < end && *p == '*') {
+            p++;
+        }
+        return p == end;
+    }
+
+    int BlobFS::glob_dir(walk_state_t &state, inode_t dir, uint32_t path_len, const char* pattern, uint32_t depth) {
+        while (*pattern == '/') {
+            pattern++;
+        }
+        const char* component_end = strchr(pattern, '/');
+        if (component_end == nullptr) {
+            component_end = pattern + strlen(pattern);
+        }
+        size_t component_len = component_end - pattern;
+        const char* rest = *component_end ? component_end + 1 : nullptr;
+        while (rest != nullptr && *rest == '/') {
+            rest++;
+        }
+        if (rest != nullptr && *rest == '\0') {
+            rest = nullptr;  // Trailing '/'
+        }
+
+        inode_data_t dir_data;
+        int ret = stat(dir_data, dir);
+        if (ret) {
+            return ret;
+        }
+        if ((dir_data.flags & FLAG_DIR) == 0 || (dir_data.flags & (FLAG_DEFLATE | FLAG_SHARD)) != 0) {
+            return 0;  // Nothing that can be listed here
+        }
+
+        bool recursive = component_len == 2 && pattern[0] == '*' && pattern[1] == '*';
+        if (recursive && rest == nullptr) {
+            // Everything below
+            return walk_dir(state, dir_data, path_len, depth);
+        }
+        if (recursive) {
+            // Zero directories...
+            ret = glob_dir(state, dir, path_len, rest, depth);
+            if (ret) {
+                return ret;
+            }
+            // ...or one more
+        }
+
+        size_t literal_len = strcspn(pattern, "*?/");
+        if (!recursive && literal_len >= component_len) {
+            // No wildcards, just a lookup
+            char* name = (char*)malloc(component_len + 1);
+            if (name == nullptr) {
+                return ENOMEM;
+            }
+            memcpy(name, pattern, component_len);
+            name[component_len] = '\0';
+            inode_t child;
+            ret = lookup_child(child, dir, name);
             if (ret == 0) {
-                _position += size; // On success, move file cursor
+                uint32_t child_len;
+                ret = walk_path(state, path_len, name, child_len);
+                if (ret == 0) {
+                    ret = glob_visit(state, child, child_len, rest, depth);
+                }
+            } else if (ret == ENOENT || ret == ENOTDIR) {
+                ret = 0;
             }
+            free(name);
             return ret;
         }
 
-        virtual int pread(void *dest, uint32_t &size, uint32_t position) {
-            // Return empty buffer on EOF
-            if (position >= _inode_data.data_size) {
-                size = 0;
-                return 0;
-            }
+        // Only the entries starting with the literal prefix of the pattern are listed
+        DirHandle* handle;
+        ret = opendir(handle, dir);
+        if (ret) {
+            return ret;
+        }
+        char* prefix = (char*)malloc(literal_len + 1);
+        if (prefix == nullptr) {
+            delete handle;
+            return ENOMEM;
+        }
+        memcpy(prefix, pattern, recursive ? 0 : literal_len);
+        prefix[recursive ? 0 : literal_len] = '\0';
+        ret = handle->seek_prefix(prefix);
+        free(prefix);
 
-            // Trim the buffer if we are near EOF
-            uint32_t remaining = _inode_data.data_size - position;
-            if (size > remaining) {
-                size = remaining;
+        while (ret == 0) {
+            dir_entry_t entry;
+            inode_t child;
+            const char* name;
+            ret = handle->readdir(entry, child, name);
+            if (ret) {
+                break;
+            }
+            if (recursive) {
+                if ((entry.inode_data.flags & FLAG_DIR) != 0) {
+                    uint32_t child_len;
+                    ret = walk_path(state, path_len, name, child_len);
+                    if (ret == 0) {
+                        ret = glob_dir(state, child, child_len, pattern, depth + 1);
+                    }
+                }
+            } else if (glob_match(pattern, component_len, name)) {
+                uint32_t child_len;
+                ret = walk_path(state, path_len, name, child_len);
+                if (ret == 0) {
+                    ret = glob_visit(state, child, child_len, rest, depth);
+                }
             }
+            free_str(name);
+        }
+        delete handle;
+        return ret == ENOENT ? 0 : ret;
+    }
 
-            // Perform the actual read
-            return _blobfs.load_chunk(dest, _inode_data.data_offset + position, size);
+    int BlobFS::glob_visit(walk_state_t &state, inode_t inode, uint32_t path_len, const char* rest, uint32_t depth) {
+        if (rest != nullptr) {
+            return glob_dir(state, inode, path_len, rest, depth + 1);
         }
-    };
+        inode_data_t inode_data;
+        int ret = stat(inode_data, inode);
+        if (ret) {
+            return ret;
+        }
+        ret = state.visitor(state.arg, state.path, inode, inode_data, depth);
+        return ret == WALK_SKIP_SUBTREE ? 0 : ret;
+    }
 
+    int BlobFS::glob(const char* pattern, walk_visitor_t visitor, void* arg) {
+        // Pattern must start with "/"
+        if (pattern == nullptr || pattern[0] != '/') {
+            return EINVAL;
+        }
+        walk_state_t state = {visitor, arg, nullptr, 0, nullptr, nullptr};
+        state.path_capacity = 64;
+        state.path = (char*)malloc(state.path_capacity);
+        if (state.path == nullptr) {
+            return ENOMEM;
+        }
+        state.path[0] = '\0';
 
+        int ret;
+        if (pattern[strspn(pattern, "/")] == '\0') {
+            // Just the root
+            inode_data_t inode_data;
+            ret = stat(inode_data, 0);
+            if (ret == 0) {
+                ret = visitor(arg, "/", 0, inode_data, 0);
+            }
+        } else {
+            ret = glob_dir(state, 0, 0, pattern, 1);
+        }
+        free(state.path);
+        return ret == WALK_SKIP_SUBTREE ? 0 : ret;
+    }
 
+    int BlobFS::superblock(superblock_t &superblock) {
+        if (__atomic_load_n(&_superblock_state, __ATOMIC_ACQUIRE) == SUPERBLOCK_LOADED) {
+            superblock = _superblock;
+            return _superblock_status;
+        }
 
-    // ================= Directory Handle =================
+        // Loaded into a local copy, and published once: Racing threads only waste a load
+        int status = load_superblock(superblock);
+        uint8_t expected = SUPERBLOCK_UNLOADED;
+        if (__atomic_compare_exchange_n(&_superblock_state, &expected, (uint8_t)SUPERBLOCK_PUBLISHING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            _superblock = superblock;
+            _superblock_status = status;
+            __atomic_store_n(&_superblock_state, (uint8_t)SUPERBLOCK_LOADED, __ATOMIC_RELEASE);
+        }
+        return status;
+    }
 
-    int DirHandle::readdir(dir_entry_t& direntry, inode_t &inode) {
-        if (_position >= _inode_data.data_size) {
-            return ENOENT;
+    int BlobFS::stat_ext(file_ext_t &ext, inode_t inode) {
+        inode_data_t inode_data;
+        int ret = stat(inode_data, inode);
+        if (ret) {
+            return ret;
+        }
+        if ((inode_data.flags & FLAG_EXT) == 0 || (inode_data.flags & FLAG_DIR) != 0) {
+            return ENODATA;
         }
-        offset_t entry_offset = _inode_data.data_offset + (_position++) * sizeof(dir_entry_t);
-        inode = entry_offset + offsetof(dir_entry_t, inode_data);
 
-        int ret = _blobfs.load_chunk(&direntry, entry_offset, sizeof(dir_entry_t));
+        superblock_t sb;
+        ret = superblock(sb);
         if (ret) {
             return ret;
         }
-        fix_endianess(direntry);
 
+        if (inode_data.data_offset < sb.file_ext_size) {
+            return EINVAL;
+        }
+
+        memset(&ext, 0, sizeof(file_ext_t));
+        uint32_t size = sb.file_ext_size < sizeof(file_ext_t) ? sb.file_ext_size : sizeof(file_ext_t);
+        ret = load_chunk(&ext, inode_data.data_offset - sb.file_ext_size, size);
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(ext);
+        return 0;
+    }
+
+    int BlobFS::stat_dir_ext(dir_ext_t &ext, inode_t inode) {
+        inode_data_t inode_data;
+        int ret = stat(inode_data, inode);
+        if (ret) {
+            return ret;
+        }
+        ret = load_dir_ext(ext, inode_data);
+        if (ret) {
+            return ret;
+        }
+        if (ext.file_count == DIR_EXT_TOTALS_UNKNOWN) {
+            return ENODATA;  // The record only carries indexes
+        }
         return 0;
     }
 
+    int BlobFS::load_dir_ext(dir_ext_t &ext, const inode_data_t &dir) {
+        if ((dir.flags & FLAG_EXT) == 0 || (dir.flags & FLAG_DIR) == 0) {
+            return ENODATA;
+        }
 
+        superblock_t sb;
+        int ret = superblock(sb);
+        if (ret) {
+            return ret;
+        }
+        if (sb.dir_ext_size == 0) {
+            return ENODATA;
+        }
+        if (dir.data_offset < sb.dir_ext_size) {
+            return EINVAL;
+        }
 
+        // Fields missing from older blobs read as zero
+        memset(&ext, 0, sizeof(dir_ext_t));
+        uint32_t size = sb.dir_ext_size < sizeof(dir_ext_t) ? sb.dir_ext_size : sizeof(dir_ext_t);
+        ret = load_chunk(&ext, dir.data_offset - sb.dir_ext_size, size);
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(ext);
+        return 0;
+    }
 
-    // ================= Main FS functions =================
+    /** Whether the inode table can be addressed with 32-bit offsets, which a corrupted count would wrap around */
+    static inline bool inode_table_fits(const superblock_t &sb) {
+        return (uint64_t)sb.inode_table_offset + (uint64_t)sb.inode_count * sizeof(offset_t) <= UINT32_MAX;
+    }
 
-    int BlobFS::lookup_child(inode_t &child, inode_t parent_inode, const char* name) {
-        inode_data_t parent;
-        int ret = load_chunk(&parent, parent_inode, sizeof(inode_data_t));
+    int BlobFS::inode_count(uint32_t &count) {
+        superblock_t sb;
+        int ret = superblock(sb);
         if (ret) {
             return ret;
         }
-        fix_endianess(parent);
+        if (sb.inode_table_offset == 0) {
+            return ENODATA;
+        }
+        if (!inode_table_fits(sb)) {
+            return EINVAL;
+        }
+        count = sb.inode_count;
+        return 0;
+    }
 
-        if ((parent.flags & FLAG_DIR) == 0) {
-            // We cannot lookup into a file, only into directories
-            return ENOTDIR;
+    int BlobFS::inode_at(inode_t &inode, uint32_t number) {
+        superblock_t sb;
+        int ret = superblock(sb);
+        if (ret) {
+            return ret;
         }
-        if ((parent.flags & FLAG_DEFLATE) != 0) {
-            // Compression is not supported on directory indexes
-            return ENOSYS;
+        if (sb.inode_table_offset == 0) {
+            return ENODATA;
+        }
+        if (!inode_table_fits(sb)) {
+            return EINVAL;
+        }
+        if (number >= sb.inode_count) {
+            return ENOENT;
+        }
+        ret = load_chunk(&inode, sb.inode_table_offset + number * sizeof(offset_t), sizeof(offset_t));
+        if (ret) {
+            return ret;
         }
+        fix_endianess(inode);
+        return 0;
+    }
 
-        //TODO: Use binary search instead
+    int BlobFS::inode_number(uint32_t &number, inode_t inode) {
+        superblock_t sb;
+        int ret = superblock(sb);
+        if (ret) {
+            return ret;
+        }
+        if (sb.inode_table_offset == 0) {
+            return ENODATA;
+        }
+        if (!inode_table_fits(sb)) {
+            return EINVAL;
+        }
 
-        offset_t current_direntry_ptr = parent.data_offset;
-        for (uint32_t child_index = 0; child_index < parent.data_size; child_index++) {
-            offset_t child_name_offset;
-            ret = load_chunk(&child_name_offset, current_direntry_ptr + offsetof(dir_entry_t, name_offset), sizeof(offset_t)); // Don't need
-            if (ret) {
-                return ret;
+        // Searched in place if the table can be mapped, otherwise one entry at a time
+        const void* mapped = nullptr;
+        map_chunk(mapped, sb.inode_table_offset, sb.inode_count * sizeof(offset_t));
+        uint32_t first = 0;
+        uint32_t last = sb.inode_count;
+        while (first < last) {
+            uint32_t mid = first + (last - first) / 2;
+            offset_t offset;
+            if (mapped != nullptr) {
+                memcpy(&offset, (const uint8_t*)mapped + mid * sizeof(offset_t), sizeof(offset_t));
+            } else {
+                ret = load_chunk(&offset, sb.inode_table_offset + mid * sizeof(offset_t), sizeof(offset_t));
+                if (ret) {
+                    return ret;
+                }
             }
-            fix_endianess(child_name_offset);
+            fix_endianess(offset);
+            if (offset == inode) {
+                number = mid;
+                return 0;
+            } else if (offset < inode) {
+                first = mid + 1;
+            } else {
+                last = mid;
+            }
+        }
+        return ENOENT;
+    }
 
-            const char* child_name;
-            ret = load_str(child_name, child_name_offset);
+    /** Number of an entry of `dir` from its inode_base, falling back to the inode table if it has none (or `dir` is unknown) */
+    int BlobFS::entry_number(uint32_t &number, const inode_data_t &dir, inode_t inode) {
+        if ((dir.flags & FLAG_DIR) == 0 && inode == 0) {
+            // The root is always first
+            uint32_t count;
+            int ret = inode_count(count);
             if (ret) {
                 return ret;
             }
+            number = 0;
+            return 0;
+        }
 
-            int cmp = strcmp(name, child_name);
-            free_str(child_name);
-
-
-            // Found a matching name
-            if (cmp == 0) {
-                child = current_direntry_ptr + offsetof(dir_entry_t, inode_data);
-                return 0;
+        dir_ext_t ext;
+        int ret = load_dir_ext(ext, dir);
+        if (ret == 0 && ext.inode_base != 0) {
+            offset_t first = dir.data_offset + offsetof(dir_entry_t, inode_data);
+            if (inode < first || (inode - first) % sizeof(dir_entry_t) != 0 || (inode - first) / sizeof(dir_entry_t) >= dir.data_size) {
+                return ENOENT;
             }
-
-            // Go to the next entry
-            current_direntry_ptr += sizeof(dir_entry_t);
+            number = ext.inode_base + (inode - first) / sizeof(dir_entry_t);
+            return 0;
         }
-
-        // Not found
-        return ENOENT;
+        if (ret != 0 && ret != ENODATA) {
+            return ret;
+        }
+        return inode_number(number, inode);
     }
 
-    int BlobFS::lookup(inode_t &inode, const char* path) {
-        inode = 0;  // start from root inode
+    int BlobFS::mime_type(const char* &mime_type, uint16_t mime_id) {
+        superblock_t sb;
+        int ret = superblock(sb);
+        if (ret) {
+            return ret;
+        }
+        if (mime_id >= sb.mime_count) {
+            return EINVAL;
+        }
 
-        // Path must start with "/"
-        if (path == nullptr || path[0] != '/') {
-            return ENOENT;
+        offset_t mime_offset;
+        ret = load_chunk(&mime_offset, sb.mime_table_offset + mime_id * sizeof(offset_t), sizeof(offset_t));
+        if (ret) {
+            return ret;
         }
+        fix_endianess(mime_offset);
+        return load_str(mime_type, mime_offset);
+    }
 
-        const char* chunk_start = path + 1;
-        for (const char* chunk_end=chunk_start; ; chunk_end++) {
-            char endchar = *chunk_end;
-            if ((endchar == '/') || (endchar == '\0')) {
-                if (chunk_end != chunk_start) { // Ignore empty chunks -- .e.g "/foo//bar/" == "/foo/bar"
-                    size_t chunk_size = chunk_end - chunk_start;
-                    char* chunk_name = (char*)malloc(chunk_size + 1);
-                    memcpy(chunk_name, chunk_start, chunk_size);
-                    chunk_name[chunk_size] = '\0';
+    int BlobFS::open_encoded(FileHandle* &file, inode_t inode, encoding_t encoding) {
+        if (encoding == ENCODING_IDENTITY) {
+            return open(file, inode);
+        }
 
-                    int ret = lookup_child(inode, inode, chunk_name);
-                    free(chunk_name);
+        file_ext_t ext;
+        int ret = stat_ext(ext, inode);
+        if (ret) {
+            return ret;
+        }
 
-                    if (ret) {
-                        return ret;
-                    }
+        encoded_data_t encoded;
+        switch (encoding) {
+            case ENCODING_GZIP:
+                encoded = ext.gzip;
+                break;
+            case ENCODING_BROTLI:
+                encoded = ext.brotli;
+                break;
+            case ENCODING_DEFLATE: {
+                inode_data_t inode_data;
+                ret = stat(inode_data, inode);
+                if (ret) {
+                    return ret;
                 }
-                chunk_start = chunk_end + 1;
-            }
-            if (endchar == '\0') {
+                if ((inode_data.flags & FLAG_DEFLATE) == 0) {
+                    return ENODATA;
+                }
+                encoded.data_size = ext.stored_size;
+                encoded.data_offset = inode_data.data_offset;
                 break;
             }
+            default:
+                return EINVAL;
+        }
+        if (encoded.data_size == 0) {
+            return ENODATA;
         }
 
+        inode_data_t inode_data;
+        inode_data.data_size = encoded.data_size;
+        inode_data.data_offset = encoded.data_offset;
+        inode_data.flags = 0;
+        file = new UncompressedFileHandle(*this, inode_data, inode);
         return 0;
     }
 
-    int BlobFS::stat(inode_data_t &inode_data, inode_t inode) {
-        int ret = load_chunk(&inode_data, inode, sizeof(inode_data_t));
+    int BlobFS::open(FileHandle* &file, const char* path) {
+        BlobFS* blobfs;
+        inode_t inode;
+        inode_data_t inode_data;
+        inode_data_t parent;
+        int ret = walk(blobfs, inode, inode_data, parent, path);
         if (ret) {
             return ret;
         }
-        fix_endianess(inode_data);
+        ret = blobfs->open(file, inode);
+        if (ret) {
+            return ret;
+        }
+        // Kept so that `FileHandle::stat` numbers the file without searching the inode table
+        file->_parent = parent;
         return 0;
     }
 
@@ -215,8 +2173,34 @@ namespace blobfs {
             return EISDIR;
         }
         if ((inode_data.flags & FLAG_DEFLATE) != 0) {
-            // TODO: Support for compressed files
+#ifdef BLOBFS_HAS_ZLIB
+            // Compressed size bounds the reads of the stream
+            uint32_t stored_size = 0;
+            file_ext_t ext;
+            if (stat_ext(ext, inode) == 0) {
+                stored_size = ext.stored_size;
+            }
+            uint32_t size;
+            if (stored_size == 0 && blob_size(size) == 0 && inode_data.data_offset <= size) {
+                stored_size = size - inode_data.data_offset;
+            }
+            if (stored_size == 0) {
+                // Neither the extension record nor the backend know where the stream ends: Reads would run past it
+                return EINVAL;
+            }
+
+            CompressedFileHandle* handle = new CompressedFileHandle(*this, inode_data, inode, stored_size);
+            ret = handle->begin();
+            if (ret) {
+                delete handle;
+                return ret;
+            }
+            file = handle;
+            return 0;
+#else
+            // Built without zlib
             return ENOSYS;
+#endif
         }
         file = new UncompressedFileHandle(*this, inode_data, inode);
         return 0;
@@ -238,6 +2222,10 @@ namespace blobfs {
             // Compression is not supported on directory indexes
             return ENOSYS;
         }
+        if ((inode_data.flags & FLAG_SHARD) != 0) {
+            // Stored in other blobs, only ShardedBlobFS can list it
+            return EXDEV;
+        }
 
         dir = new DirHandle(*this, inode_data, inode);
         return 0;
@@ -248,16 +2236,29 @@ namespace blobfs {
 
     // ================= Memory-mapped BlobFS =================
 
+    /** Maximum number of bytes prefetched into the CPU cache by a single `MemoryBlobFS::prefetch` */
+    constexpr uint32_t MEMORY_PREFETCH_SIZE = 1024;
+
     MemoryBlobFS::MemoryBlobFS(const void* blob)
-    : _blob(blob)
+    : _blob(blob), _size(0)
+    {}
+
+    MemoryBlobFS::MemoryBlobFS(const void* blob, uint32_t size)
+    : _blob(blob), _size(size)
     {}
 
     int MemoryBlobFS::load_chunk(void* dest, uint32_t offset, uint32_t len) {
+        if (_size && !_validated && (offset > _size || len > _size - offset)) {
+            return EINVAL;
+        }
         memcpy(dest, (char*)this->_blob + offset, len);
         return 0;
     }
 
     int MemoryBlobFS::load_str(const char* &str, offset_t offset) {
+        if (_size && !_validated && (offset >= _size || memchr((const char*)this->_blob + offset, '\0', _size - offset) == nullptr)) {
+            return EINVAL;
+        }
         str = (const char*)this->_blob + offset;
         return 0;
     }
@@ -265,4 +2266,91 @@ namespace blobfs {
     void MemoryBlobFS::free_str(const char* str) {
         //No-op, str is a direct pointer to the blob
     }
+
+    int MemoryBlobFS::map_chunk(const void* &ptr, offset_t offset, uint32_t len) {
+        if (_size && !_validated && (offset > _size || len > _size - offset)) {
+            return EINVAL;
+        }
+        ptr = (const char*)this->_blob + offset;
+        return 0;
+    }
+
+    int MemoryBlobFS::blob_size(uint32_t &size) {
+        if (_size == 0) {
+            return ENOSYS;
+        }
+        size = _size;
+        return 0;
+    }
+
+    void MemoryBlobFS::prefetch(offset_t offset, uint32_t len) {
+        if (_size && (offset > _size || len > _size - offset)) {
+            return;
+        }
+        // Just the first cache lines, enough to cover the table of a typical directory
+        if (len > MEMORY_PREFETCH_SIZE) {
+            len = MEMORY_PREFETCH_SIZE;
+        }
+        for (uint32_t i = 0; i < len; i += 64) {
+            __builtin_prefetch((const char*)_blob + offset + i);
+        }
+    }
+
+
+
+
+    // ================= Nested BlobFS =================
+
+    SubBlobFS::SubBlobFS(BlobFS& outer, offset_t base, uint32_t size)
+    : _outer(outer), _base(base), _size(size), _mount_inode(0), _next(nullptr)
+    {}
+
+    int SubBlobFS::load_chunk(void* dest, offset_t offset, uint32_t len) {
+        if (!_validated && (offset > _size || len > _size - offset)) {
+            return EINVAL;
+        }
+        return _outer.load_chunk(dest, _base + offset, len);
+    }
+
+    int SubBlobFS::load_str(const char* &str, offset_t offset) {
+        if (!_validated && offset >= _size) {
+            return EINVAL;
+        }
+        int ret = _outer.load_str(str, _base + offset);
+        if (ret) {
+            return ret;
+        }
+        if (!_validated && strlen(str) >= _size - offset) {
+            _outer.free_str(str);
+            return EINVAL;
+        }
+        return 0;
+    }
+
+    void SubBlobFS::free_str(const char* str) {
+        _outer.free_str(str);
+    }
+
+    int SubBlobFS::map_chunk(const void* &ptr, offset_t offset, uint32_t len) {
+        if (!_validated && (offset > _size || len > _size - offset)) {
+            return EINVAL;
+        }
+        return _outer.map_chunk(ptr, _base + offset, len);
+    }
+
+    int SubBlobFS::blob_size(uint32_t &size) {
+        size = _size;
+        return 0;
+    }
+
+    void SubBlobFS::prefetch(offset_t offset, uint32_t len) {
+        if (offset > _size || len > _size - offset) {
+            return;
+        }
+        _outer.prefetch(_base + offset, len);
+    }
+
+    bool SubBlobFS::supports_prefetch() {
+        return _outer.supports_prefetch();
+    }
 }
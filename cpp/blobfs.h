@@ -1,5 +1,6 @@
 # pragma once
 #include <cinttypes>
+#include <cstddef>
 #include <sys/errno.h>
 
 namespace blobfs {
@@ -20,16 +21,252 @@ namespace blobfs {
     /** inode_data_t with this flag represents a file whose contents are compressed with zlib -- Only valid for regular files! */
     constexpr uint8_t FLAG_DEFLATE = 2;
 
+    /**
+     * inode_data_t with this flag has an extension record stored right before its contents:
+     * - Regular files have a file_ext_t at `data_offset - superblock.file_ext_size`
+     * - Directories have a dir_ext_t at `data_offset - superblock.dir_ext_size`, right before their entries
+     *
+     * Only valid if the blob has a superblock, and not on directories with FLAG_SHARD
+     */
+    constexpr uint8_t FLAG_EXT = 4;
+
+    /**
+     * Only meaningful on layers of an OverlayBlobFS:
+     * - A regular file with this flag is a whiteout: It hides the entry with the same name in lower layers.
+     * - A directory with this flag is opaque: It hides the contents of the directory with the same path in lower layers.
+     */
+    constexpr uint8_t FLAG_WHITEOUT = 8;
+
+    /**
+     * Only meaningful on the root index of a sharded filesystem (See ShardedBlobFS):
+     * A directory with this flag is stored in other blobs. `data_offset` points to a table of `data_size` shard numbers
+     * (uint32_t), and each entry of the directory is stored in the root of the shard `table[shard_for_name(name) % data_size]`.
+     */
+    constexpr uint8_t FLAG_SHARD = 0x10;
+
+    /**
+     * A regular file with this flag is a blob itself, which path lookups traverse as if it was mounted on it
+     *
+     * The nested blob is stored uncompressed, so that it can be read in place (See SubBlobFS)
+     */
+    constexpr uint8_t FLAG_NESTED = 0x20;
+
+    /** The root inode_data_t with this flag is immediately followed by a superblock_t -- Only valid on the root inode! */
+    constexpr uint8_t FLAG_SUPERBLOCK = 0x80;
+
+    /** Value of superblock_t::magic ("BLFS") */
+    constexpr uint32_t SUPERBLOCK_MAGIC = 0x53464c42;
+
+    /** Size of file_ext_t::content_hash */
+    constexpr uint32_t CONTENT_HASH_SIZE = 16;
+
+    /** Size of the hashes in the integrity tree (SHA-256) */
+    constexpr uint32_t VERITY_HASH_SIZE = 32;
+
     /** An inode data */
     typedef struct {
         /** Size of a regular file (Uncompressed), or number of entries in a directory */
         uint32_t data_size;
         /** Offset of the contents of regular file, or offset to entries (dir_entry_t[data_size]) in a directory */
         offset_t data_offset;
-        /** Inode flags: FLAG_DIR, FLAG_DEFLATE */
+        /** Inode flags: FLAG_DIR, FLAG_DEFLATE, FLAG_EXT, FLAG_WHITEOUT, FLAG_SHARD, FLAG_NESTED, FLAG_SUPERBLOCK */
         uint8_t flags;
     } __attribute__((packed)) inode_data_t;
 
+    /**
+     * Optional blob-wide metadata, stored right after the root inode
+     *
+     * Builders may append new fields at the end, readers must use `superblock_size` to skip them.
+     * Fields missing from older blobs read as zero.
+     */
+    typedef struct {
+        /** Must be SUPERBLOCK_MAGIC */
+        uint32_t magic;
+        /** Size of the superblock as stored in the blob */
+        uint32_t superblock_size;
+        /** Size of the file_ext_t records stored before the contents of files with FLAG_EXT */
+        uint32_t file_ext_size;
+        /** Number of entries in the MIME type table */
+        uint32_t mime_count;
+        /** Offset of the MIME type table: offset_t[mime_count], each one pointing to a NULL-terminated string */
+        offset_t mime_table_offset;
+        /** Size of the blocks hashed by the integrity tree, or 0 if the blob has no integrity tree */
+        uint32_t verity_block_size;
+        /** Number of bytes protected by the integrity tree, starting at offset 0 */
+        uint32_t verity_data_size;
+        /** Offset of the integrity tree, stored level by level, starting from the top (single-block) level */
+        offset_t verity_tree_offset;
+        /** SHA-256 of the top block of the integrity tree -- Hashed as zeros when hashing the block that contains it */
+        uint8_t verity_root_hash[VERITY_HASH_SIZE];
+        /** Number of shards, if this blob is the root index of a sharded filesystem */
+        uint32_t shard_count;
+        /** Size of the dir_ext_t records stored before the entries of directories with FLAG_EXT */
+        uint32_t dir_ext_size;
+        /** Offset of the path hint table (path_hint_t[path_hint_capacity]), or 0 */
+        offset_t path_hint_offset;
+        /** Number of slots of the path hint table, a power of 2 */
+        uint32_t path_hint_capacity;
+        /** Offset of the inode table (offset_t[inode_count]): the inodes of the blob by dense number, or 0 */
+        offset_t inode_table_offset;
+        /** Number of inodes in the inode table, including the root */
+        uint32_t inode_count;
+    } __attribute__((packed)) superblock_t;
+
+    /**
+     * Slot of the path hint table: The directories of the blob, by the hash of their path
+     *
+     * It is an open-addressing hash table (linear probing, from slot `hash % path_hint_capacity`), whose empty slots
+     * are zero. `BlobFS::lookup` uses it to prefetch the directories along a path before walking it, so that deep
+     * paths cost a couple of round-trips to the backend instead of one per level. Hints are never trusted for lookups: a
+     * stale or colliding one only wastes a prefetch. `validate` checks that they point within the blob, since the
+     * extension records of the hinted directories are loaded to prefetch their indexes.
+     */
+    typedef struct {
+        /** `BlobFS::fold_hash` of the directory's path, without trailing slash, e.g. "/usr/share" */
+        uint32_t hash;
+        /** The directory */
+        inode_data_t dir;
+    } __attribute__((packed)) path_hint_t;
+
+    /** Maximum number of directories of a path prefetched by `BlobFS::lookup` */
+    constexpr uint32_t PATH_HINT_MAX_DEPTH = 16;
+
+    /** Content encodings that can be stored alongside a regular file */
+    typedef enum {
+        /** The file contents, as returned by `BlobFS::open` */
+        ENCODING_IDENTITY = 0,
+        /** Precompressed with gzip */
+        ENCODING_GZIP = 1,
+        /** Precompressed with brotli */
+        ENCODING_BROTLI = 2,
+        /** The zlib stream of a file with FLAG_DEFLATE, as stored in the blob (HTTP's `deflate` encoding) */
+        ENCODING_DEFLATE = 3,
+    } encoding_t;
+
+    /** A chunk of the blob storing a precompressed copy of a file */
+    typedef struct {
+        /** Size of the encoded data, or 0 if this encoding is not available */
+        uint32_t data_size;
+        /** Offset of the encoded data */
+        offset_t data_offset;
+    } __attribute__((packed)) encoded_data_t;
+
+    /** Extension record of a regular file with FLAG_EXT */
+    typedef struct {
+        /** First bytes of the SHA-256 of the uncompressed contents, usable as an ETag */
+        uint8_t content_hash[CONTENT_HASH_SIZE];
+        /** Index of the file's type in the MIME type table */
+        uint16_t mime_id;
+        /** Contents precompressed with gzip */
+        encoded_data_t gzip;
+        /** Contents precompressed with brotli */
+        encoded_data_t brotli;
+        /** Number of bytes the contents take in the blob (i.e., the compressed size of files with FLAG_DEFLATE) */
+        uint32_t stored_size;
+    } __attribute__((packed)) file_ext_t;
+
+    /** Value of dir_ext_t::file_count when the subtree goes into shards: The totals are unknown, the indexes are valid */
+    constexpr uint32_t DIR_EXT_TOTALS_UNKNOWN = 0xFFFFFFFF;
+
+    /**
+     * Extension record of a directory with FLAG_EXT: Totals of its whole subtree, precomputed by the builder
+     *
+     * The directory itself is not counted, nor are whiteouts. Nested blobs are counted as regular files.
+     * If the subtree has contents in other blobs (shards), every total is set to its maximum value instead, starting with
+     * `file_count == DIR_EXT_TOTALS_UNKNOWN`.
+     */
+    typedef struct {
+        /** Number of regular files */
+        uint32_t file_count;
+        /** Number of directories */
+        uint32_t dir_count;
+        /** Sum of the sizes of the regular files (Uncompressed) */
+        uint64_t logical_bytes;
+        /** Sum of the number of bytes the contents of the regular files take in the blob, before deduplication */
+        uint64_t stored_bytes;
+        /** Offset of the index of the case-folded names (fold_entry_t[data_size], sorted by hash), or 0 */
+        offset_t fold_index_offset;
+        /** Offset of the Bloom filter of the case-folded names (bloom_block_t[bloom_blocks]), or 0 */
+        offset_t bloom_offset;
+        /** Number of blocks of the Bloom filter */
+        uint32_t bloom_blocks;
+        /**
+         * Offset of the case-folded name index stored in Eytzinger order (fold_entry_t[data_size]), or 0
+         *
+         * The sorted index is stored as a binary search tree laid out level by level: Entry `k - 1` is node k, whose
+         * children are nodes 2k and 2k + 1. The first levels of all searches share a few cache lines or flash pages,
+         * and the descendants of a node a few levels down are contiguous, so they can be prefetched.
+         */
+        offset_t eytzinger_offset;
+        /**
+         * Offset of the fingerprints of the names (uint16_t[data_size], in entry order), or 0
+         *
+         * Each one is `BlobFS::fingerprint` of the name, so lookups scan them with SIMD instead of comparing every name.
+         */
+        offset_t fingerprint_offset;
+        /**
+         * Offset of the root node of a B+-tree of the case-folded name hashes (btree_node_t), or 0
+         *
+         * Each node takes `btree_node_size` bytes, typically a flash sector or disk block, and is aligned to it, so
+         * lookups on paged backends read a single page per level instead of one per step of a binary search.
+         */
+        offset_t btree_offset;
+        /** Size of the nodes of the B+-tree */
+        uint32_t btree_node_size;
+        /**
+         * Dense number of the first entry (See `BlobFS::inode_number`), or 0 if the blob has no inode table
+         *
+         * The entries of a directory are contiguous in the inode table, so entry `i` is number `inode_base + i`.
+         */
+        uint32_t inode_base;
+    } __attribute__((packed)) dir_ext_t;
+
+    /** Maximum number of levels of a directory's B+-tree */
+    constexpr uint32_t BTREE_MAX_DEPTH = 8;
+
+    /** Maximum size of the nodes of a directory's B+-tree */
+    constexpr uint32_t BTREE_MAX_NODE_SIZE = 64 * 1024;
+
+    /**
+     * Header of a node of a directory's B+-tree, see `dir_ext_t::btree_offset`
+     *
+     * It is followed by `count` keys (uint32_t, sorted `BlobFS::fold_hash` of names) and then by `count` values
+     * (uint32_t). On leaves, each value is the position of the entry whose name has that hash; on inner nodes, the
+     * offset of a child node, whose smallest key it is. Leaves are linked in order, for hashes spanning several of them.
+     */
+    typedef struct {
+        /** Number of keys */
+        uint16_t count;
+        /** 1 on leaves, 0 on inner nodes */
+        uint8_t leaf;
+        uint8_t reserved;
+        /** Offset of the next leaf, or 0 */
+        offset_t next;
+    } __attribute__((packed)) btree_node_t;
+
+    /** Number of levels ahead of the search whose Eytzinger nodes are prefetched */
+    constexpr uint32_t EYTZINGER_PREFETCH_LEVELS = 4;
+
+    /** Number of bits set by each name in its block of a directory's Bloom filter, one per word */
+    constexpr uint32_t BLOOM_BLOCK_WORDS = 8;
+
+    /**
+     * Block of a directory's split-block Bloom filter
+     *
+     * A name sets a single bit in each word of the block picked by `BlobFS::bloom_hash`, so testing it takes a single load.
+     */
+    typedef struct {
+        uint32_t words[BLOOM_BLOCK_WORDS];
+    } __attribute__((packed)) bloom_block_t;
+
+    /** Entry of the case-folded name index of a directory, see `BlobFS::lookup_child_folded` and `dir_ext_t::eytzinger_offset` */
+    typedef struct {
+        /** `BlobFS::fold_hash` of the entry's name */
+        uint32_t hash;
+        /** Position of the entry in the directory */
+        uint32_t index;
+    } __attribute__((packed)) fold_entry_t;
+
     /** Entry of a directory */
     typedef struct {
         /** Offset of the file name, which must be a NULL-terminated string withing the blob */
@@ -38,12 +275,139 @@ namespace blobfs {
         inode_data_t inode_data;
     } __attribute__((packed)) dir_entry_t;
 
+    /** Record written by `DirHandle::readdir_bulk`, followed by the entry's NULL-terminated name */
+    typedef struct bulk_dirent {
+        /** Size of this record, including its name and padding -- The next record starts right after it */
+        uint32_t record_size;
+        /** The inode associated with the entry */
+        inode_t inode;
+        /** The data associated with the entry, e.g. its type in `flags` */
+        inode_data_t inode_data;
+
+        /** Returns the name of the entry */
+        inline const char* name() const {
+            return (const char*)(this + 1);
+        }
+    } __attribute__((packed)) bulk_dirent_t;
+
+
+    /**
+     * Cache of the decompressed blocks of files with FLAG_DEFLATE, possibly shared with other processes (See ShmBlockCache)
+     *
+     * Blocks are identified by a key made of their inode and index, so a cache must only be used by a single blob.
+     */
+    class BlockCache {
+    public:
+        virtual ~BlockCache() {}
+
+        /**
+         * Returns the size of the cached blocks -- Files are decompressed in blocks of this size
+         *
+         * 0 means the cache is not usable (e.g. it failed to open), and compressed files fail to open with ENXIO.
+         */
+        virtual uint32_t block_size() = 0;
+
+        /**
+         * Looks up a block
+         *
+         * `dest` and `size` might be overwritten even if it fails, e.g. by a copy that raced with an eviction.
+         *
+         * @param[out] dest Buffer of `block_size()` bytes where the block is copied
+         * @param[out] size Size of the block, the last block of a file might be smaller
+         * @param[in] key The block being looked up
+         * @return 0 on success, ENOENT if the block is not cached, or errno
+         */
+        virtual int get(void* dest, uint32_t &size, uint64_t key) = 0;
+
+        /**
+         * Adds a block to the cache, possibly evicting another one
+         *
+         * @param[in] key The block being added
+         * @param[in] data The block contents
+         * @param[in] size Size of the block, up to `block_size()`
+         */
+        virtual void put(uint64_t key, const void* data, uint32_t size) = 0;
+    };
+
+    /**
+     * Limits the work done by a single `FileHandle::read_some` call
+     */
+    typedef struct {
+        /** Maximum number of bytes loaded from the blob (compressed bytes, on compressed files), or 0 for no limit */
+        uint32_t input_bytes;
+        /** Monotonic clock in microseconds (e.g. Arduino's `micros`), or nullptr for no time limit */
+        uint32_t (*clock)();
+        /** Value of `clock()` past which no more work is started */
+        uint32_t deadline;
+    } read_budget_t;
+
+    /** Returned by a walk_visitor_t to not descend into a directory */
+    constexpr int WALK_SKIP_SUBTREE = -1;
+
+    /**
+     * Called by `BlobFS::walk` for every entry of the subtree, parents before their children
+     *
+     * @param[in] arg The argument passed to `walk`
+     * @param[in] path Full path of the entry, only valid during the call
+     * @param[in] inode The inode of the entry
+     * @param[in] inode_data The data associated with the entry
+     * @param[in] depth Depth of the entry, 0 for the root of the walk
+     * @return 0 to continue, WALK_SKIP_SUBTREE to skip the contents of a directory, or errno to stop the walk
+     */
+    typedef int (*walk_visitor_t)(void* arg, const char* path, inode_t inode, const inode_data_t &inode_data, uint32_t depth);
+
+    /**
+     * Called instead of descending into a directory, by walks that schedule subtrees themselves
+     *
+     * @param[in] arg The argument in the walk_state_t
+     * @param[in] inode The inode of the directory
+     * @param[in] inode_data The directory
+     * @param[in] path Full path of the directory, only valid during the call
+     * @param[in] depth Depth of the directory
+     * @return 0 on success, or errno to stop the walk
+     */
+    typedef int (*walk_defer_t)(void* arg, inode_t inode, const inode_data_t &inode_data, const char* path, uint32_t depth);
+
+    /** State of a walk, see `BlobFS::walk_dir` */
+    typedef struct {
+        walk_visitor_t visitor;
+        void* arg;
+        /** Path of the current entry, grown as needed */
+        char* path;
+        uint32_t path_capacity;
+        /** If set, subdirectories are handed to it instead of being walked recursively */
+        walk_defer_t defer;
+        void* defer_arg;
+    } walk_state_t;
 
     class BlobFS;
     class FileHandle;
     class UncompressedFileHandle;
     class CompressedFileHandle;
     class DirHandle;
+    class SubBlobFS;
+
+    /**
+     * Index of the entries of directories kept in memory, speeding up lookups on blobs without on-disk indexes (See RamDirIndex)
+     *
+     * Directories are identified by the offset of their entries, so an index must only be used by a single blob.
+     */
+    class DirIndex {
+    public:
+        virtual ~DirIndex() {}
+
+        /**
+         * Finds the position of an entry in a directory
+         *
+         * @param[out] index Position of the entry in the directory
+         * @param[in] blobfs The blob the directory belongs to
+         * @param[in] dir The directory
+         * @param[in] name Name of the entry
+         * @param[in] folded Whether the case of ASCII letters is ignored
+         * @return 0 on success, ENOENT if there is no such entry, ENOSYS if the directory is not indexed, or errno
+         */
+        virtual int find(uint32_t &index, BlobFS &blobfs, const inode_data_t &dir, const char* name, bool folded) = 0;
+    };
 
     /**
      * HAL used to access a chunk of the blob
@@ -53,15 +417,40 @@ namespace blobfs {
      */
     class BlobFS {
     public:
+        virtual ~BlobFS();
+
         /**
          * Lookup an inode from an absolute path
          *
          * @param[out] child Address of the inode, if found
          * @param[in] name Full path to the inode being looked up
-         * @return 0 on success, or errno
+         * @return 0 on success, EXDEV if the path goes into a nested blob, or errno
          */
         int lookup(inode_t &inode, const char* path);
 
+        /**
+         * Lookup an inode from an absolute path, going into nested blobs (FLAG_NESTED)
+         *
+         * A nested blob is mounted on the file that contains it, i.e., looking up that file returns the nested blob's root.
+         *
+         * If the blob has a path hint table, the directories along the path are prefetched before walking it.
+         *
+         * @param[out] blobfs The blob the inode belongs to -- Either this one or a nested one, valid as long as this one
+         * @param[out] inode Address of the inode, if found
+         * @param[in] path Full path to the inode being looked up
+         * @return 0 on success, or errno
+         */
+        int lookup(BlobFS* &blobfs, inode_t &inode, const char* path);
+
+        /**
+         * Returns a blob nested in this one, mounting it on first use
+         *
+         * @param[out] blobfs The nested blob, valid as long as this one
+         * @param[in] inode A file with FLAG_NESTED
+         * @return 0 on success, or errno
+         */
+        int nested(BlobFS* &blobfs, inode_t inode);
+
         /**
          * Lookup a child inode by name
          *
@@ -72,6 +461,56 @@ namespace blobfs {
          */
         int lookup_child(inode_t &child, inode_t parent_inode, const char* name);
 
+        /**
+         * Lookup a child inode by name, ignoring the case of ASCII letters
+         *
+         * Directories built with a case-folded name index are searched in O(log n), others are scanned.
+         * Builders reject directories with names that only differ by case, so there is at most one match.
+         *
+         * @param[out] child Address of the child, if found
+         * @param[in] parent Address of the parent inode, where the child is being looked up
+         * @param[in] name Name of the child being looked up, in any case
+         * @return 0 on success, or errno
+         */
+        int lookup_child_folded(inode_t &child, inode_t parent_inode, const char* name);
+
+        /**
+         * Hash of a name with its ASCII letters folded to lowercase (FNV-1a), as stored in the case-folded name index
+         *
+         * @param[in] name The name
+         * @return The hash
+         */
+        static uint32_t fold_hash(const char* name);
+
+        /**
+         * 64-bit hash of a name with its ASCII letters folded to lowercase (FNV-1a), as used by the Bloom filters
+         *
+         * Filters are built from the folded names, so that they can reject both exact and case-insensitive lookups.
+         *
+         * @param[in] name The name
+         * @return The hash: The high 32 bits pick the block, the low 32 bits the bits within it
+         */
+        static uint64_t bloom_hash(const char* name);
+
+        /**
+         * Compares two names, ignoring the case of ASCII letters
+         *
+         * @param[in] a A name
+         * @param[in] b Another name
+         * @return true if they are equal once folded
+         */
+        static bool fold_equal(const char* a, const char* b);
+
+        /**
+         * 16-bit fingerprint of a name, as stored in the fingerprint column of directories: The high bits of `fold_hash`
+         *
+         * @param[in] name The name
+         * @return The fingerprint
+         */
+        static inline uint16_t fingerprint(const char* name) {
+            return fold_hash(name) >> 16;
+        }
+
         /**
          * Opens the directory for listing files
          *
@@ -93,12 +532,13 @@ namespace blobfs {
          * @return 0 on success, or errno
          */
         inline int opendir(DirHandle* &dir, const char* path) {
+            BlobFS* blobfs;
             inode_t inode;
-            int ret = lookup(inode, path);
+            int ret = lookup(blobfs, inode, path);
             if (ret) {
                 return ret;
             }
-            return opendir(dir, inode);
+            return blobfs->opendir(dir, inode);
         }
 
         /**
@@ -121,14 +561,7 @@ namespace blobfs {
          * @param[in] path The path of the file in the filesystem
          * @return 0 on success, or errno
          */
-        inline int open(FileHandle* &file, const char* path) {
-            inode_t inode;
-            int ret = lookup(inode, path);
-            if (ret) {
-                return ret;
-            }
-            return open(file, inode);
-        }
+        int open(FileHandle* &file, const char* path);
 
         /**
          * Returns all the metadata of the specified inode
@@ -143,23 +576,246 @@ namespace blobfs {
          * Returns all the metadata of the specified inode
          *
          * @param[out] inode_data metadata of the specified inode
-         * @param[out] inode The inode number associated with the path
+         * @param[out] inode The inode number associated with the path -- Within a nested blob, if the path goes into one
          * @param[in] path The file path being queried
          * @return 0 on success, or errno
          */
         inline int stat(inode_data_t &inode_data, inode_t &inode, const char* path) {
-            int ret = lookup(inode, path);
+            BlobFS* blobfs;
+            inode_data_t parent;
+            return walk(blobfs, inode, inode_data, parent, path);
+        }
+
+        /**
+         * Returns all the metadata of the specified inode, and its number for `st_ino`
+         *
+         * @param[out] inode_data metadata of the specified inode
+         * @param[out] inode The inode number associated with the path -- Within a nested blob, if the path goes into one
+         * @param[out] number Its dense number (See `inode_number`), or the inode itself on blobs without an inode table
+         * @param[in] path The file path being queried
+         * @return 0 on success, or errno
+         */
+        inline int stat(inode_data_t &inode_data, inode_t &inode, uint32_t &number, const char* path) {
+            BlobFS* blobfs;
+            inode_data_t parent;
+            int ret = walk(blobfs, inode, inode_data, parent, path);
             if (ret) {
                 return ret;
             }
-            return stat(inode_data, inode);
+            ret = blobfs->entry_number(number, parent, inode);
+            if (ret == ENODATA) {
+                number = inode;
+                return 0;
+            }
+            return ret;
         }
 
+        /**
+         * Returns the extension record of a regular file: content hash, MIME type and precompressed variants
+         *
+         * @param[out] ext extension record of the specified inode
+         * @param[in] inode The inode number being queried
+         * @return 0 on success, ENODATA if the blob was built without extension records, or errno
+         */
+        int stat_ext(file_ext_t &ext, inode_t inode);
+
+        /**
+         * Returns the extension record of a directory: Total number of files, directories and bytes in its subtree
+         *
+         * @param[out] ext extension record of the specified inode
+         * @param[in] inode The inode number being queried
+         * @return 0 on success, ENODATA if the blob was built without directory extension records or the totals are
+         *         unknown (the subtree goes into shards), or errno
+         */
+        int stat_dir_ext(dir_ext_t &ext, inode_t inode);
+
+        /**
+         * Returns the dense number of an inode, from the inode table of the blob
+         *
+         * Inodes are numbered from 0 (the root) to `inode_count - 1`, in ascending offsets, so that caches and bitmaps
+         * of inodes can be flat arrays indexed by number, instead of hash maps keyed by offset. This is a binary search
+         * of the table: `stat`, `FileHandle::stat` and `DirHandle::readdir` number entries in O(1) instead, from the
+         * `dir_ext_t::inode_base` of their directory.
+         *
+         * Nested blobs have their own numbering.
+         *
+         * @param[out] number Dense number of the inode
+         * @param[in] inode The inode being queried
+         * @return 0 on success, ENODATA if the blob was built without an inode table, ENOENT if it isn't an inode, or errno
+         */
+        int inode_number(uint32_t &number, inode_t inode);
+
+        /**
+         * Returns the inode with a dense number, the reverse of `inode_number`
+         *
+         * @param[out] inode The inode with that number
+         * @param[in] number Dense number of the inode
+         * @return 0 on success, ENODATA if the blob was built without an inode table, ENOENT if the number is out of range, or errno
+         */
+        int inode_at(inode_t &inode, uint32_t number);
+
+        /**
+         * Returns the number of inodes of the blob, i.e. the size of arrays indexed by `inode_number`
+         *
+         * @param[out] count Number of inodes, including the root
+         * @return 0 on success, ENODATA if the blob was built without an inode table, or errno
+         */
+        int inode_count(uint32_t &count);
+
+        /**
+         * Visits every entry of a subtree, like `nftw`
+         *
+         * Each directory table is loaded at once, and the tables of its subdirectories are prefetched before its
+         * entries are visited. Directories that can't be listed (e.g. with FLAG_SHARD) are visited, but not descended
+         * into. For multi-core hosts, see `parallel_walk`.
+         *
+         * @param[in] root Path of the root of the subtree, which is visited first
+         * @param[in] visitor Called for every entry
+         * @param[in] arg Argument passed to `visitor`
+         * @return 0 on success, the error returned by `visitor`, or errno
+         */
+        int walk(const char* root, walk_visitor_t visitor, void* arg);
+
+        /**
+         * Visits the contents of a directory, descending into its subdirectories unless `state.defer` is set
+         *
+         * @param[in,out] state State of the walk, `state.path` holds the path of the directory
+         * @param[in] dir The directory
+         * @param[in] path_len Length of the directory's path, without trailing '/'
+         * @param[in] depth Depth of the directory's entries
+         * @return 0 on success, the error returned by the visitor, or errno
+         */
+        int walk_dir(walk_state_t &state, const inode_data_t &dir, uint32_t path_len, uint32_t depth);
+
+        /**
+         * Visits the entries matching a glob pattern
+         *
+         * Patterns are absolute paths, whose components can use `*` (any sequence of characters) and `?` (any character),
+         * e.g. `*.js` to match the scripts directly in "/static". A `**` component matches any number of nested
+         * directories, e.g. to find every "en.json" below "/i18n".
+         * The literal prefix of each component narrows the entries that are looked at with `DirHandle::seek_prefix`, so
+         * subtrees that can't match are never listed. A trailing `**` matches everything below.
+         *
+         * @param[in] pattern The pattern
+         * @param[in] visitor Called for every match, in order within each directory
+         * @param[in] arg Argument passed to `visitor`
+         * @return 0 on success, the error returned by `visitor`, or errno
+         */
+        int glob(const char* pattern, walk_visitor_t visitor, void* arg);
+
+        /**
+         * Matches the glob pattern of a single component (`*` and `?`), as used by `glob`
+         *
+         * @param[in] pattern The pattern
+         * @param[in] pattern_len Length of the pattern
+         * @param[in] name The name being matched
+         * @return true if it matches
+         */
+        static bool glob_match(const char* pattern, size_t pattern_len, const char* name);
+
+    protected:
+        int glob_dir(walk_state_t &state, inode_t dir, uint32_t path_len, const char* pattern, uint32_t depth);
+        int glob_visit(walk_state_t &state, inode_t inode, uint32_t path_len, const char* rest, uint32_t depth);
+
+    public:
+        /**
+         * Returns the blob's superblock
+         *
+         * It is loaded on first use and cached afterwards.
+         *
+         * @param[out] superblock The superblock
+         * @return 0 on success, ENODATA if the blob has no superblock, or errno
+         */
+        int superblock(superblock_t &superblock);
+
+        /**
+         * Validates the whole blob: Every offset and size is within the blob, every name is NULL-terminated and
+         * directory entries are sorted, so that corrupted blobs cannot cause out-of-bounds reads.
+         *
+         * Until it succeeds, backends that know the blob size check the bounds of every access. Afterwards, they
+         * switch to their unchecked fast path.
+         *
+         * It takes a single linear pass over the metadata, which can be split across threads on hosts that support them.
+         *
+         * @param[in] parallelism Number of threads used to validate the blob
+         * @return 0 on success, EINVAL if the blob is malformed, ENOSYS if the backend doesn't know the blob size, or errno
+         */
+        int validate(uint32_t parallelism = 1);
+
+        /**
+         * Returns whether `validate()` succeeded on this blob
+         */
+        inline bool validated() {
+            return _validated;
+        }
+
+        /**
+         * Returns the MIME type associated with a `file_ext_t::mime_id`
+         *
+         * @param[out] mime_type The MIME type, must be released with `free_str(mime_type)`
+         * @param[in] mime_id Index in the MIME type table
+         * @return 0 on success, or errno
+         */
+        int mime_type(const char* &mime_type, uint16_t mime_id);
+
+        /**
+         * Opens a precompressed copy of a file for reading
+         *
+         * The handle returns the encoded bytes as-is, e.g., to be served with the matching `Content-Encoding`.
+         * After use, the file handle must be released with `delete file`
+         *
+         * @param[out] file the file handle.
+         * @param[in] inode The inode of the file
+         * @param[in] encoding The encoding being requested
+         * @return 0 on success, ENODATA if that encoding is not available, or errno
+         */
+        int open_encoded(FileHandle* &file, inode_t inode, encoding_t encoding);
+
+        /**
+         * Sets the cache used for the decompressed contents of files with FLAG_DEFLATE
+         *
+         * Must be called before opening files.
+         *
+         * @param[in] cache The cache, or nullptr to disable it
+         */
+        inline void set_block_cache(BlockCache* cache) {
+            _block_cache = cache;
+        }
+
+        /**
+         * Sets the in-memory index used by `lookup_child` and `lookup_child_folded` before searching the blob
+         *
+         * @param[in] index The index, or nullptr to disable it
+         */
+        inline void set_dir_index(DirIndex* index) {
+            _dir_index = index;
+        }
+
+        /**
+         * Makes path lookups ignore the case of ASCII letters, including lookups in nested blobs
+         *
+         * @param[in] case_insensitive Whether `lookup` uses `lookup_child_folded` instead of `lookup_child`
+         */
+        inline void set_case_insensitive(bool case_insensitive) {
+            _case_insensitive = case_insensitive;
+        }
+
+        /**
+         * Frees a strings returned by load_str_chunk
+         */
+        virtual void free_str(const char* str) = 0;
+
     protected:
         friend class FileHandle;
         friend class CompressedFileHandle;
         friend class UncompressedFileHandle;
         friend class DirHandle;
+        friend class VerityBlobFS;
+        friend class ShardedBlobFS;
+        friend class SubBlobFS;
+        friend class ThreadPoolHAL;
+        friend class RamDirIndex;
+        friend class PreloadBlobFS;
 
         // ==== HAL used to access a chunks of the blob ====/
 
@@ -187,22 +843,121 @@ namespace blobfs {
         virtual int load_str(const char* &str, offset_t offset) = 0;
 
         /**
-         * Frees a strings returned by load_str_chunk
+         * Returns a pointer to a chunk of the blob without copying it
+         *
+         * Only memory-mapped implementations can support this, others return ENOSYS and callers must fall back to `load_chunk`.
+         *
+         * @param[out] ptr Will point to the chunk, valid as long as the BlobFS instance
+         * @param[in] offset Offset at the blob where the chunk starts
+         * @param[in] len Size of the chunk
+         * @return 0 on success, ENOSYS if not supported, or errno
          */
-        virtual void free_str(const char* str) = 0;
+        virtual int map_chunk(const void* &/*ptr*/, offset_t /*offset*/, uint32_t /*len*/) {
+            return ENOSYS;
+        }
+
+        /**
+         * Returns the size of the blob, used to validate it
+         *
+         * @param[out] size The size of the blob
+         * @return 0 on success, ENOSYS if unknown, or errno
+         */
+        virtual int blob_size(uint32_t &/*size*/) {
+            return ENOSYS;
+        }
+
+        /**
+         * Hints that a chunk of the blob will be loaded soon, e.g. to start reading it ahead
+         *
+         * @param[in] offset Offset at the blob where the chunk starts
+         * @param[in] len Size of the chunk
+         */
+        virtual void prefetch(offset_t /*offset*/, uint32_t /*len*/) {}
+
+        /**
+         * Whether `prefetch` actually reads ahead
+         *
+         * `lookup` only spends loads on finding the directories of a path to prefetch (path hints) if it does.
+         */
+        virtual bool supports_prefetch() {
+            return false;
+        }
+
+        /** Set once `validate()` succeeds, backends may skip bounds checks afterwards */
+        bool _validated = false;
+
+        /** Cache of decompressed blocks, or nullptr */
+        BlockCache* _block_cache = nullptr;
+
+        /** Whether `lookup` ignores case */
+        bool _case_insensitive = false;
+
+        /** In-memory directory index, or nullptr */
+        DirIndex* _dir_index = nullptr;
+
+    private:
+        int load_superblock(superblock_t &sb);
+        int validate_subtree(const inode_data_t &root, uint32_t blob_size, const superblock_t &sb, uint32_t first, uint32_t stride);
+        int validate_inode(const inode_data_t &inode_data, uint32_t blob_size, const superblock_t &sb);
+        int validate_fold_index(const inode_data_t &dir, offset_t index_offset, uint32_t blob_size, bool sorted);
+        int validate_btree(const inode_data_t &dir, const dir_ext_t &ext, uint32_t blob_size);
+        int validate_path_hints(const superblock_t &sb, uint32_t blob_size);
+        int validate_inode_table(const superblock_t &sb, uint32_t blob_size);
+        int walk(BlobFS* &blobfs, inode_t &inode, inode_data_t &inode_data, inode_data_t &parent, const char* path);
+        int entry_number(uint32_t &number, const inode_data_t &dir, inode_t inode);
+        int find_child(inode_t &child, const inode_data_t &parent, const char* name);
+        int find_child_folded(inode_t &child, const inode_data_t &parent, const char* name);
+        int load_dir_ext(dir_ext_t &ext, const inode_data_t &dir);
+        int bloom_rejects(bool &rejected, const dir_ext_t &ext, const char* name);
+        int eytzinger_find(uint32_t &index, const inode_data_t &dir, offset_t keys_offset, const char* name, bool folded);
+        int fingerprint_find(uint32_t &index, const inode_data_t &dir, offset_t fingerprint_offset, const char* name, bool folded);
+        int btree_find(uint32_t &index, const inode_data_t &dir, const dir_ext_t &ext, const char* name, bool folded);
+        int btree_search(uint32_t &index, const inode_data_t &dir, const dir_ext_t &ext, const char* name, bool folded, uint8_t* &buffer);
+        int load_btree_node(const uint8_t* &node, btree_node_t &header, uint8_t* &buffer, offset_t offset, uint32_t node_size);
+        int ext_index_find(uint32_t &index, const inode_data_t &dir, const dir_ext_t &ext, const char* name, bool folded);
+        void prefetch_path(const char* path, const inode_data_t &root);
+        void prefetch_dir(const inode_data_t &dir, const superblock_t &sb);
+        void prefetch_dir_indexes(const inode_data_t &dir, const dir_ext_t &ext);
+        int compare_entry_name(bool &equal, const inode_data_t &dir, uint32_t index, const char* name, bool folded);
+
+        /** Nested blobs mounted so far, as a linked list */
+        SubBlobFS* _nested = nullptr;
+
+        typedef enum {
+            SUPERBLOCK_UNLOADED = 0,
+            SUPERBLOCK_PUBLISHING,
+            SUPERBLOCK_LOADED,
+        } superblock_state_t;
+
+        /**
+         * Cached superblock, `_superblock_status` is the result of loading it
+         *
+         * Both are written once, by the thread that moves `_superblock_state` to SUPERBLOCK_PUBLISHING, and only read
+         * after an acquire load sees SUPERBLOCK_LOADED. Other threads load their own copy meanwhile.
+         */
+        uint8_t _superblock_state = SUPERBLOCK_UNLOADED;
+        int _superblock_status = 0;
+        superblock_t _superblock;
     };
 
     class FileHandle {
     protected:
+        friend class BlobFS;
+        friend class SwappableBlobFS;
+
         BlobFS& _blobfs;
         inode_data_t _inode_data;
         inode_t _inode;
+        /** Directory the file was found in when opened by path, numbering it in O(1) -- Otherwise its flags are 0 */
+        inode_data_t _parent;
 
     public:
         inline FileHandle(BlobFS& blobfs, inode_data_t inode_data, inode_t inode)
-        : _blobfs(blobfs), _inode_data(inode_data), _inode(inode)
+        : _blobfs(blobfs), _inode_data(inode_data), _inode(inode), _parent()
         {}
 
+        virtual ~FileHandle() {}
+
         /**
          * Returns all the metadata of the current inode
          *
@@ -216,6 +971,25 @@ namespace blobfs {
             return 0;
         }
 
+        /**
+         * Returns all the metadata of the current inode, and its number for `st_ino`
+         *
+         * @param[out] inode_data metadata of the current inode
+         * @param[out] inode The inode number of the current file
+         * @param[out] number Its dense number (See `BlobFS::inode_number`), or the inode itself on blobs without an inode table
+         * @return 0 on success, or errno
+         */
+        inline int stat(inode_data_t &inode_data, inode_t &inode, uint32_t &number) {
+            inode_data = _inode_data;
+            inode = _inode;
+            int ret = _blobfs.entry_number(number, _parent, _inode);
+            if (ret == ENODATA) {
+                number = _inode;
+                return 0;
+            }
+            return ret;
+        }
+
         /**
          * Returns the size of this file
          *
@@ -261,6 +1035,35 @@ namespace blobfs {
          * @return 0 on success, or errno
          */
         virtual int pread(void *dest, uint32_t &size, uint32_t position) = 0;
+
+        /**
+         * Reads whatever can be read within a work budget from the file's current cursor position
+         *
+         * Meant for real-time loops: Decompression is incremental, and work left unfinished resumes on the next call.
+         * Every call makes some progress, so the worst-case latency is about one chunk of work over the budget.
+         *
+         * @param[out] dest Buffer to be filled with file contents
+         * @param[in,out] size Input: Size of the `dest` buffer; Output: number of bytes actually read, 0 on EOF
+         * @param[in] budget Limits the work done by this call
+         * @return 0 on success, EAGAIN if the budget ran out before any byte was ready, or errno
+         */
+        virtual int read_some(void *dest, uint32_t &size, const read_budget_t &/*budget*/) {
+            return read(dest, size);
+        }
+
+        /**
+         * Returns a pointer to up to `size` bytes of the file contents, starting at the specified position, without copying them
+         *
+         * Only possible on uncompressed files of memory-mapped blobs, otherwise returns ENOSYS and `pread` must be used instead.
+         *
+         * @param[out] data Will point to the file contents
+         * @param[in,out] size Input: Number of bytes requested; Output: number of bytes actually available
+         * @param[in] position Position on the file being mapped
+         * @return 0 on success, ENOSYS if not supported, or errno
+         */
+        virtual int map(const void* &/*data*/, uint32_t &/*size*/, uint32_t /*position*/) {
+            return ENOSYS;
+        }
     };
 
     /**
@@ -274,12 +1077,19 @@ namespace blobfs {
         inode_data_t _inode_data;
         inode_t _inode;
         uint32_t _position;
+        /** Listing stops at this entry, see `seek_prefix` */
+        uint32_t _end;
+
+        int load_name(char* dest, uint32_t capacity, offset_t offset, uint32_t &len, bool mapped);
+        int compare_prefix(int &cmp, uint32_t index, const char* prefix, size_t prefix_len);
 
     public:
         inline DirHandle(BlobFS& blobfs, inode_data_t inode_data, inode_t inode)
-        : _blobfs(blobfs), _inode(inode), _inode_data(inode_data), _position(0)
+        : _blobfs(blobfs), _inode(inode), _inode_data(inode_data), _position(0), _end(inode_data.data_size)
         {}
 
+        virtual ~DirHandle() {}
+
         /**
          * Returns all the metadata of the current inode
          *
@@ -326,9 +1136,21 @@ namespace blobfs {
                 return EINVAL;
             }
             _position = position;
+            _end = _inode_data.data_size;
             return 0;
         }
 
+        /**
+         * Restricts the listing to the entries whose names start with a prefix
+         *
+         * Entries are sorted by name, so both ends of the range are found with a binary search. Listing starts at the
+         * first entry of the range and ends after the last one, until the next `seek`.
+         *
+         * @param[in] prefix The prefix, "" for all entries
+         * @return 0 on success, or errno
+         */
+        int seek_prefix(const char* prefix);
+
         /**
          * Reads the next entry in this directory
          *
@@ -354,6 +1176,46 @@ namespace blobfs {
             }
             return _blobfs.load_str(name, direntry.name_offset);
         }
+
+        /**
+         * Convenience method for reading the next entry in this directory and its number for `d_ino`
+         *
+         * @param[out] direntry The data associated with the entry
+         * @param[out] inode The inode associated with the entry
+         * @param[out] number Its dense number (See `BlobFS::inode_number`), or the inode itself on blobs without an inode table
+         * @return 0 on success, ENOENT if it reached the end of the list of entries, or errno
+         */
+        int readdir(dir_entry_t& direntry, inode_t &inode, uint32_t &number) {
+            int ret = readdir(direntry, inode);
+            if (ret) {
+                return ret;
+            }
+            ret = _blobfs.entry_number(number, _inode_data, inode);
+            if (ret == ENODATA) {
+                number = inode;
+                return 0;
+            }
+            return ret;
+        }
+
+        /**
+         * Reads as many entries as fit in a buffer, together with their names -- Like `getdents`
+         *
+         * The directory table is loaded in a few large chunks (a single one on memory-mapped blobs), and names are
+         * copied straight into the buffer, without allocations.
+         *
+         *     for (uint32_t i = 0, offset = 0; i < count; i++) {
+         *         const bulk_dirent_t* entry = (const bulk_dirent_t*)(buffer + offset);
+         *         ... entry->name() ...
+         *         offset += entry->record_size;
+         *     }
+         *
+         * @param[out] buffer Filled with `count` bulk_dirent_t records
+         * @param[in] capacity Size of `buffer`
+         * @param[out] count Number of records written, 0 if it reached the end of the list of entries
+         * @return 0 on success, EINVAL if the buffer is too small for the next entry, or errno
+         */
+        int readdir_bulk(void* buffer, uint32_t capacity, uint32_t &count);
     };
 
     /**
@@ -362,10 +1224,62 @@ namespace blobfs {
     class MemoryBlobFS : public BlobFS {
     protected:
         const void* _blob;
+        /** Size of the blob, or 0 if unknown */
+        uint32_t _size;
     public:
+        /**
+         * Creates a BlobFS from a trusted blob of unknown size, e.g., one built into the firmware
+         *
+         * Accesses are not bounds-checked.
+         */
         MemoryBlobFS(const void* blob);
+
+        /**
+         * Creates a BlobFS from a blob of known size
+         *
+         * Accesses are bounds-checked until `validate()` succeeds.
+         */
+        MemoryBlobFS(const void* blob, uint32_t size);
+
         virtual int load_chunk(void* dest, uint32_t offset, uint32_t len);
         virtual int load_str(const char* &str, offset_t offset);
         virtual void free_str(const char* str);
+        virtual int map_chunk(const void* &ptr, offset_t offset, uint32_t len);
+        virtual int blob_size(uint32_t &size);
+        virtual void prefetch(offset_t offset, uint32_t len);
+    };
+
+    /**
+     * A blob stored in a chunk of another blob, e.g. a file with FLAG_NESTED
+     *
+     * Accesses are bounds-checked against the chunk, rebased and forwarded to the outer blob, so memory-mapped outer
+     * blobs are still accessed without copies.
+     */
+    class SubBlobFS : public BlobFS {
+    protected:
+        friend class BlobFS;
+
+        BlobFS& _outer;
+        offset_t _base;
+        uint32_t _size;
+        /** Inode of the outer blob it was mounted from, and the next blob mounted on the same outer blob */
+        inode_t _mount_inode;
+        SubBlobFS* _next;
+
+    public:
+        /**
+         * @param[in] outer The blob that contains this one
+         * @param[in] base Offset of this blob within `outer`
+         * @param[in] size Size of this blob
+         */
+        SubBlobFS(BlobFS& outer, offset_t base, uint32_t size);
+
+        virtual int load_chunk(void* dest, offset_t offset, uint32_t len);
+        virtual int load_str(const char* &str, offset_t offset);
+        virtual void free_str(const char* str);
+        virtual int map_chunk(const void* &ptr, offset_t offset, uint32_t len);
+        virtual int blob_size(uint32_t &size);
+        virtual void prefetch(offset_t offset, uint32_t len);
+        virtual bool supports_prefetch();
     };
 }
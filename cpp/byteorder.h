@@ -0,0 +1,100 @@
+# pragma once
+#include "blobfs.h"
+
+// Internal helpers shared by the BlobFS implementation files -- Not part of the public API
+
+namespace blobfs {
+    // ================= Fix byte-order on data structures loaded from the blob =================
+
+    static inline uint32_t ntohl(uint32_t n) {
+#if ((__BYTE_ORDER__) == (__ORDER_LITTLE_ENDIAN__))
+        return n;
+#else
+        return ((n & 0xff) << 24) | ((n & 0xff00) << 8) | ((n >> 8)  & 0xff00) | ((n >> 24) & 0xff);
+#endif
+    }
+
+    static inline void fix_endianess(uint32_t &data) {
+        data = ntohl(data);
+    }
+    static inline void fix_endianess(inode_data_t &data) {
+        data.data_size = ntohl(data.data_size);
+        data.data_offset = ntohl(data.data_offset);
+    }
+    static inline void fix_endianess(dir_entry_t &data) {
+        data.name_offset = ntohl(data.name_offset);
+        data.inode_data.data_size = ntohl(data.inode_data.data_size);
+        data.inode_data.data_offset = ntohl(data.inode_data.data_offset);
+    }
+    static inline uint16_t ntohs(uint16_t n) {
+#if ((__BYTE_ORDER__) == (__ORDER_LITTLE_ENDIAN__))
+        return n;
+#else
+        return ((n & 0xff) << 8) | ((n >> 8) & 0xff);
+#endif
+    }
+    static inline uint64_t ntohll(uint64_t n) {
+#if ((__BYTE_ORDER__) == (__ORDER_LITTLE_ENDIAN__))
+        return n;
+#else
+        return ((uint64_t)ntohl(n & 0xffffffff) << 32) | ntohl(n >> 32);
+#endif
+    }
+    static inline void fix_endianess(superblock_t &data) {
+        data.magic = ntohl(data.magic);
+        data.superblock_size = ntohl(data.superblock_size);
+        data.file_ext_size = ntohl(data.file_ext_size);
+        data.mime_count = ntohl(data.mime_count);
+        data.mime_table_offset = ntohl(data.mime_table_offset);
+        data.verity_block_size = ntohl(data.verity_block_size);
+        data.verity_data_size = ntohl(data.verity_data_size);
+        data.verity_tree_offset = ntohl(data.verity_tree_offset);
+        data.shard_count = ntohl(data.shard_count);
+        data.dir_ext_size = ntohl(data.dir_ext_size);
+        data.path_hint_offset = ntohl(data.path_hint_offset);
+        data.path_hint_capacity = ntohl(data.path_hint_capacity);
+        data.inode_table_offset = ntohl(data.inode_table_offset);
+        data.inode_count = ntohl(data.inode_count);
+    }
+    static inline void fix_endianess(encoded_data_t &data) {
+        data.data_size = ntohl(data.data_size);
+        data.data_offset = ntohl(data.data_offset);
+    }
+    static inline void fix_endianess(file_ext_t &data) {
+        data.mime_id = ntohs(data.mime_id);
+        fix_endianess(data.gzip);
+        fix_endianess(data.brotli);
+        data.stored_size = ntohl(data.stored_size);
+    }
+    static inline void fix_endianess(dir_ext_t &data) {
+        data.file_count = ntohl(data.file_count);
+        data.dir_count = ntohl(data.dir_count);
+        data.logical_bytes = ntohll(data.logical_bytes);
+        data.stored_bytes = ntohll(data.stored_bytes);
+        data.fold_index_offset = ntohl(data.fold_index_offset);
+        data.bloom_offset = ntohl(data.bloom_offset);
+        data.bloom_blocks = ntohl(data.bloom_blocks);
+        data.eytzinger_offset = ntohl(data.eytzinger_offset);
+        data.fingerprint_offset = ntohl(data.fingerprint_offset);
+        data.btree_offset = ntohl(data.btree_offset);
+        data.btree_node_size = ntohl(data.btree_node_size);
+        data.inode_base = ntohl(data.inode_base);
+    }
+    static inline void fix_endianess(bloom_block_t &data) {
+        for (uint32_t i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+            data.words[i] = ntohl(data.words[i]);
+        }
+    }
+    static inline void fix_endianess(btree_node_t &data) {
+        data.count = ntohs(data.count);
+        data.next = ntohl(data.next);
+    }
+    static inline void fix_endianess(path_hint_t &data) {
+        data.hash = ntohl(data.hash);
+        fix_endianess(data.dir);
+    }
+    static inline void fix_endianess(fold_entry_t &data) {
+        data.hash = ntohl(data.hash);
+        data.index = ntohl(data.index);
+    }
+}
@@ -9,8 +9,9 @@
 
 using namespace blobfs;
 
-static inline BlobFS* ctx_to_blobfs(void* ctx) {
-    return (BlobFS*)ctx;
+template <typename FS>
+static inline FS* ctx_to_blobfs(void* ctx) {
+    return (FS*)ctx;
 }
 
 //FIXME: locking
@@ -24,7 +25,7 @@ static inline FileHandle* fd_to_fh(void* fs, int fd) {
     return _file_handles[fd];
 }
 
-static inline int register_fd(BlobFS* fs, FileHandle* fh) {
+static inline int register_fd(void* fs, FileHandle* fh) {
     for (int i=0; i<_n_file_handles; i++) {
         if (_file_handles[i] == nullptr) {
             _file_handles[i] = fh;
@@ -44,18 +45,21 @@ static inline int register_fd(BlobFS* fs, FileHandle* fh) {
     return old_n;
 }
 
-static inline void release_fd(BlobFS* fs, int fd) {
+static inline void release_fd(void* fs, int fd) {
     _file_handles[fd] = nullptr;
 }
 
-static inline void translate_stat(inode_data_t &inode_data, inode_t inode, struct stat *st) {
+// `number` is the dense inode number on blobs with an inode table, so that st_ino can index arrays
+static inline void translate_stat(inode_data_t &inode_data, uint32_t number, struct stat *st) {
     memset(st, 0, sizeof(struct stat));
-    st->st_ino = inode;
+    st->st_ino = number;
     st->st_size = inode_data.data_size;
     st->st_mode = ((inode_data.flags & FLAG_DIR) ? S_IFDIR : S_IFREG) | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
 }
 
-static const esp_vfs_t vfs_blobfs_ops = []() {
+// Ops are shared by BlobFS and SwappableBlobFS, which have the same path-based API
+template <typename FS>
+static esp_vfs_t make_vfs_blobfs_ops() {
     esp_vfs_t ops{};
     ops.flags = ESP_VFS_FLAG_CONTEXT_PTR;
 
@@ -139,7 +143,7 @@ static const esp_vfs_t vfs_blobfs_ops = []() {
             return -1;
         }
 
-        BlobFS* blobfs = ctx_to_blobfs(ctx);
+        FS* blobfs = ctx_to_blobfs<FS>(ctx);
         FileHandle* fh;
         int ret = blobfs->open(fh, path);
         int open(FileHandle* &file, inode_t inode);
@@ -150,13 +154,14 @@ static const esp_vfs_t vfs_blobfs_ops = []() {
         return register_fd(blobfs, fh);
     };
     ops.close_p = [](void* ctx, int fd) {
-        BlobFS* blobfs = ctx_to_blobfs(ctx);
+        FS* blobfs = ctx_to_blobfs<FS>(ctx);
         FileHandle* fh = fd_to_fh(ctx, fd);
         if (fh == nullptr) {
             errno = EBADF;
             return -1;
         }
         release_fd(blobfs, fd);
+        delete fh;  // Also unpins the blob of a SwappableBlobFS
         return 0;
     };
     ops.fstat_p = [](void* ctx, int fd, struct stat * st) {
@@ -167,12 +172,13 @@ static const esp_vfs_t vfs_blobfs_ops = []() {
         }
         inode_data_t inode_data;
         inode_t inode;
-        int ret = fh->stat(inode_data, inode);
+        uint32_t number;
+        int ret = fh->stat(inode_data, inode, number);
         if (ret) {
             errno = ret;
             return -1;
         }
-        translate_stat(inode_data, inode, st);
+        translate_stat(inode_data, number, st);
         return 0;
     };
 
@@ -194,7 +200,7 @@ static const esp_vfs_t vfs_blobfs_ops = []() {
             return -1;
         }
         // Check if file exists
-        BlobFS* blobfs = ctx_to_blobfs(ctx);
+        FS* blobfs = ctx_to_blobfs<FS>(ctx);
         inode_t inode;
         int ret = blobfs->lookup(inode, path);
         if (ret) {
@@ -204,15 +210,16 @@ static const esp_vfs_t vfs_blobfs_ops = []() {
         return 0;
     };
     ops.stat_p = [](void* ctx, const char * path, struct stat * st) {
-        BlobFS* blobfs = ctx_to_blobfs(ctx);
+        FS* blobfs = ctx_to_blobfs<FS>(ctx);
         inode_data_t inode_data;
         inode_t inode;
-        int ret = blobfs->stat(inode_data, inode, path);
+        uint32_t number;
+        int ret = blobfs->stat(inode_data, inode, number, path);
         if (ret) {
             errno = ret;
             return -1;
         }
-        translate_stat(inode_data, inode, st);
+        translate_stat(inode_data, number, st);
         return 0;
     };
 
@@ -257,13 +264,19 @@ static const esp_vfs_t vfs_blobfs_ops = []() {
 //     };
 
   return ops;
-}();
+}
+
+static const esp_vfs_t vfs_blobfs_ops = make_vfs_blobfs_ops<BlobFS>();
+static const esp_vfs_t vfs_swappable_blobfs_ops = make_vfs_blobfs_ops<SwappableBlobFS>();
 
 
 
 esp_err_t blobfs::vfs_blobfs_register(const char* base_path, BlobFS& fs) {
     return esp_vfs_register(base_path, &vfs_blobfs_ops, &fs);
 }
+esp_err_t blobfs::vfs_blobfs_register(const char* base_path, SwappableBlobFS& fs) {
+    return esp_vfs_register(base_path, &vfs_swappable_blobfs_ops, &fs);
+}
 esp_err_t blobfs::vfs_blobfs_unregister(const char* base_path) {
     return esp_vfs_unregister(base_path);
 }
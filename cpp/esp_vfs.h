@@ -5,9 +5,11 @@
 #endif
 
 #include "blobfs.h"
+#include "swap.h"
 #include <esp_err.h>
 
 namespace blobfs {
     esp_err_t vfs_blobfs_register(const char* base_path, BlobFS& fs);
+    esp_err_t vfs_blobfs_register(const char* base_path, SwappableBlobFS& fs);
     esp_err_t vfs_blobfs_unregister(const char* base_path);
 }
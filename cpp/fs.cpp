@@ -10,11 +10,11 @@ namespace fs {
 static int num_blobs_mounted = 0;
 
 BlobFS::BlobFS()
- : FS(FSImplPtr(new VFSImpl()))
+ : FS(FSImplPtr(new VFSImpl())), _blobfs(nullptr)
 {}
 
 BlobFS::BlobFS(const void* blob, const char* basePath)
- : FS(FSImplPtr(new VFSImpl()))
+ : FS(FSImplPtr(new VFSImpl())), _blobfs(nullptr)
 {
     if (!begin(blob, basePath)) {
         log_e("Failed to initialize fs::BlobFS instance");
@@ -38,7 +38,8 @@ bool BlobFS::begin(const void* blob, const char* basePath) {
         snprintf(mountpoint, 16, "/blobfs-%d", ++num_blobs_mounted);
     }
 
-    _blobfs = new blobfs::MemoryBlobFS(blob);
+    _blobfs = new blobfs::SwappableBlobFS();
+    _blobfs->swap(*new blobfs::MemoryBlobFS(blob), blobfs::release_memory_blobfs);
     esp_err_t err = blobfs::vfs_blobfs_register(mountpoint, *_blobfs);
     if (err != ESP_OK) {
         delete _blobfs;
@@ -50,6 +51,20 @@ bool BlobFS::begin(const void* blob, const char* basePath) {
     return true;
 }
 
+bool BlobFS::swap(const void* blob) {
+    if (!_blobfs) {
+        return begin(blob);
+    }
+    blobfs::MemoryBlobFS* new_blobfs = new blobfs::MemoryBlobFS(blob);
+    int ret = _blobfs->swap(*new_blobfs, blobfs::release_memory_blobfs);
+    if (ret) {
+        log_e("Failed to swap fs::BlobFS blob: %d", ret);
+        delete new_blobfs;
+        return false;
+    }
+    return true;
+}
+
 void BlobFS::end() {
     if (_blobfs) {
         blobfs::vfs_blobfs_unregister(_impl->mountpoint());
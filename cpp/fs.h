@@ -6,17 +6,25 @@
 
 #include <FS.h>
 #include "blobfs.h"
+#include "swap.h"
 
 namespace fs {
 
     class BlobFS : public FS {
-    ::blobfs::BlobFS *_blobfs;
+    ::blobfs::SwappableBlobFS *_blobfs;
     public:
         BlobFS();
         BlobFS(const void* blob, const char* basePath=nullptr);
         ~BlobFS();
         bool begin(const void* blob, const char* basePath=nullptr);
         void end();
+
+        /**
+         * Replaces the mounted blob, e.g. after an OTA update, without unmounting it
+         *
+         * Files that are already open keep reading from the old blob until they are closed.
+         */
+        bool swap(const void* blob);
     };
 
 }
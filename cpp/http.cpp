@@ -0,0 +1,507 @@
+#include "http.h"
+#include "swap.h"
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <strings.h>
+
+namespace blobfs {
+    // ================= Helpers =================
+
+    static const char* status_reason(int status) {
+        switch (status) {
+            case 200: return "OK";
+            case 206: return "Partial Content";
+            case 304: return "Not Modified";
+            case 400: return "Bad Request";
+            case 403: return "Forbidden";
+            case 404: return "Not Found";
+            case 405: return "Method Not Allowed";
+            case 416: return "Range Not Satisfiable";
+            case 501: return "Not Implemented";
+            case 503: return "Service Unavailable";
+            default:  return "Internal Server Error";
+        }
+    }
+
+    static int status_for_errno(int err) {
+        switch (err) {
+            case ENOENT:
+            case ENOTDIR:
+                return 404;
+            case EISDIR:
+                return 403;
+            case ENOSYS:
+                return 501;
+            default:
+                return 500;
+        }
+    }
+
+    static const char* encoding_name(encoding_t encoding) {
+        switch (encoding) {
+            case ENCODING_GZIP:    return "gzip";
+            case ENCODING_BROTLI:  return "br";
+            case ENCODING_DEFLATE: return "deflate";
+            default:               return nullptr;
+        }
+    }
+
+    /** Checks whether a comma-separated header like `Accept-Encoding` lists `coding` without `q=0` */
+    static bool accepts_encoding(const char* header, const char* coding) {
+        if (header == nullptr) {
+            return false;
+        }
+        // An explicit mention of the coding takes precedence over "*", e.g. "gzip;q=0, *" rejects gzip
+        int explicit_accepted = -1;
+        int wildcard_accepted = -1;
+        size_t coding_len = strlen(coding);
+        const char* item = header;
+        while (*item) {
+            while (*item == ' ' || *item == ',') {
+                item++;
+            }
+            const char* item_end = item;
+            while (*item_end && *item_end != ',') {
+                item_end++;
+            }
+            const char* token_end = item;
+            while (token_end < item_end && *token_end != ';' && *token_end != ' ') {
+                token_end++;
+            }
+
+            size_t token_len = token_end - item;
+            bool is_coding = token_len == coding_len && strncasecmp(item, coding, coding_len) == 0;
+            bool is_wildcard = token_len == 1 && *item == '*';
+            if (is_coding || is_wildcard) {
+                // Look for an explicit "q=0" (or "q=0.0", ...) parameter
+                const char* q = token_end;
+                while (q < item_end && !(q[0] == 'q' && q[1] == '=')) {
+                    q++;
+                }
+                int accepted = q >= item_end || strtod(q + 2, nullptr) > 0;
+                if (is_coding) {
+                    explicit_accepted = accepted;
+                } else {
+                    wildcard_accepted = accepted;
+                }
+            }
+            item = item_end;
+        }
+        if (explicit_accepted >= 0) {
+            return explicit_accepted;
+        }
+        return wildcard_accepted > 0;
+    }
+
+    static bool etag_matches(const char* if_none_match, const char* etag) {
+        if (if_none_match == nullptr || etag[0] == '\0') {
+            return false;
+        }
+        // Weak comparison: `W/"..."` and lists of ETags match as well
+        return strcmp(if_none_match, "*") == 0 || strstr(if_none_match, etag) != nullptr;
+    }
+
+    /**
+     * Parses a single-range `Range` header against a representation of the specified size
+     *
+     * @return 0 if the range should be served, EINVAL if the header should be ignored, or ERANGE if it is not satisfiable
+     */
+    static int parse_range(const char* range, uint32_t size, uint32_t &first, uint32_t &last) {
+        if (strncmp(range, "bytes=", 6) != 0 || strchr(range, ',') != nullptr) {
+            return EINVAL;  // Unknown unit or multiple ranges: Serve the whole file
+        }
+        const char* spec = range + 6;
+        char* end;
+        if (*spec == '-') {
+            // Suffix range: last N bytes
+            unsigned long suffix = strtoul(spec + 1, &end, 10);
+            if (end == spec + 1 || *end != '\0') {
+                return EINVAL;
+            }
+            if (suffix == 0 || size == 0) {
+                return ERANGE;
+            }
+            first = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+            return 0;
+        }
+
+        unsigned long range_first = strtoul(spec, &end, 10);
+        if (end == spec || *end != '-') {
+            return EINVAL;
+        }
+        const char* last_spec = end + 1;
+        unsigned long range_last = size - 1;
+        if (*last_spec != '\0') {
+            range_last = strtoul(last_spec, &end, 10);
+            if (end == last_spec || *end != '\0' || range_last < range_first) {
+                return EINVAL;
+            }
+        }
+        if (range_first >= size) {
+            return ERANGE;
+        }
+        first = range_first;
+        last = range_last >= size ? size - 1 : range_last;
+        return 0;
+    }
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    /** Decodes %XX escapes in-place */
+    static int url_decode(char* str) {
+        char* out = str;
+        for (char* in = str; *in; in++) {
+            if (*in == '%') {
+                int hi = hex_value(in[1]);
+                int lo = hi < 0 ? -1 : hex_value(in[2]);
+                if (lo < 0 || (hi == 0 && lo == 0)) {
+                    return EINVAL;
+                }
+                *out++ = (char)(hi << 4 | lo);
+                in += 2;
+            } else {
+                *out++ = *in;
+            }
+        }
+        *out = '\0';
+        return 0;
+    }
+
+    static int append_header(char* dest, uint32_t size, uint32_t &used, const char* format, ...) __attribute__((format(printf, 4, 5)));
+    static int append_header(char* dest, uint32_t size, uint32_t &used, const char* format, ...) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(dest + used, size - used, format, args);
+        va_end(args);
+        if (n < 0 || (uint32_t)n >= size - used) {
+            return ENOBUFS;
+        }
+        used += n;
+        return 0;
+    }
+
+    static char* trim(char* str) {
+        while (*str == ' ' || *str == '\t') {
+            str++;
+        }
+        char* end = str + strlen(str);
+        while (end > str && (end[-1] == ' ' || end[-1] == '\t')) {
+            *--end = '\0';
+        }
+        return str;
+    }
+
+
+
+
+    // ================= HTTP Server =================
+
+    HttpServer::HttpServer(BlobFS& blobfs, const char* index)
+    : _blobfs(&blobfs), _swappable(nullptr), _index(index)
+    {}
+
+    HttpServer::HttpServer(SwappableBlobFS& blobfs, const char* index)
+    : _blobfs(nullptr), _swappable(&blobfs), _index(index)
+    {}
+
+    int HttpServer::send_status(HttpSink &sink, const http_request_t &request, int status) {
+        http_response_t response;
+        memset(&response, 0, sizeof(http_response_t));
+        response.status = status;
+        response.keep_alive = request.keep_alive;
+        return sink.send_headers(response);
+    }
+
+    int HttpServer::send_contents(HttpSink &sink, FileHandle* file, uint32_t position, uint32_t size) {
+        // Zero-copy if the blob is memory-mapped
+        while (size > 0) {
+            const void* data;
+            uint32_t n = size;
+            int ret = file->map(data, n, position);
+            if (ret == ENOSYS) {
+                break;
+            }
+            if (ret) {
+                return ret;
+            }
+            if (n == 0) {
+                return EIO;  // Unexpected EOF
+            }
+            ret = sink.send_body(data, n);
+            if (ret) {
+                return ret;
+            }
+            position += n;
+            size -= n;
+        }
+
+        // Otherwise, copy it in chunks
+        uint8_t buffer[HTTP_CHUNK_SIZE];
+        while (size > 0) {
+            uint32_t n = size < HTTP_CHUNK_SIZE ? size : HTTP_CHUNK_SIZE;
+            int ret = file->pread(buffer, n, position);
+            if (ret) {
+                return ret;
+            }
+            if (n == 0) {
+                return EIO;  // Unexpected EOF
+            }
+            ret = sink.send_body(buffer, n);
+            if (ret) {
+                return ret;
+            }
+            position += n;
+            size -= n;
+        }
+        return 0;
+    }
+
+    int HttpServer::handle(const http_request_t &request, HttpSink &sink) {
+        if (_swappable == nullptr) {
+            return handle(*_blobfs, request, sink);
+        }
+
+        // Keep the blob alive until the response has been sent
+        BlobFS* blobfs;
+        uint32_t slot;
+        int ret = _swappable->pin(blobfs, slot);
+        if (ret) {
+            return send_status(sink, request, 503);
+        }
+        ret = handle(*blobfs, request, sink);
+        _swappable->unpin(slot);
+        return ret;
+    }
+
+    int HttpServer::handle(BlobFS& root, const http_request_t &request, HttpSink &sink) {
+        bool is_head = strcmp(request.method, "HEAD") == 0;
+        if (!is_head && strcmp(request.method, "GET") != 0) {
+            return send_status(sink, request, 405);
+        }
+
+        // Path -> inode, possibly within a nested blob
+        BlobFS* nested;
+        inode_t inode;
+        inode_data_t inode_data;
+        int ret = root.lookup(nested, inode, request.path);
+        if (ret == 0) {
+            ret = nested->stat(inode_data, inode);
+        }
+        BlobFS& blobfs = ret == 0 ? *nested : root;
+        if (ret == 0 && (inode_data.flags & FLAG_DIR) != 0) {
+            if (_index == nullptr) {
+                return send_status(sink, request, 403);
+            }
+            ret = blobfs.lookup_child(inode, inode, _index);
+            if (ret == 0) {
+                ret = blobfs.stat(inode_data, inode);
+            }
+            if (ret == 0 && (inode_data.flags & FLAG_DIR) != 0) {
+                ret = EISDIR;
+            }
+        }
+        if (ret) {
+            return send_status(sink, request, status_for_errno(ret));
+        }
+
+        http_response_t response;
+        memset(&response, 0, sizeof(http_response_t));
+        response.keep_alive = request.keep_alive;
+
+        file_ext_t ext;
+        ret = blobfs.stat_ext(ext, inode);
+        bool has_ext = ret == 0;
+        if (ret && ret != ENODATA) {
+            return send_status(sink, request, status_for_errno(ret));
+        }
+
+        // Conditional GET
+        if (has_ext) {
+            char* etag = response.etag;
+            *etag++ = '"';
+            for (uint32_t i = 0; i < CONTENT_HASH_SIZE; i++) {
+                etag += sprintf(etag, "%02x", ext.content_hash[i]);
+            }
+            *etag++ = '"';
+            *etag = '\0';
+        }
+        if (etag_matches(request.if_none_match, response.etag)) {
+            response.status = 304;
+            return sink.send_headers(response);
+        }
+
+        // Content negotiation: Pick the smallest representation the client accepts
+        encoding_t encoding = ENCODING_IDENTITY;
+        uint32_t size = inode_data.data_size;
+        if (has_ext) {
+            const struct {
+                encoding_t encoding;
+                uint32_t size;
+            } variants[] = {
+                { ENCODING_BROTLI, ext.brotli.data_size },
+                { ENCODING_GZIP, ext.gzip.data_size },
+                { ENCODING_DEFLATE, (inode_data.flags & FLAG_DEFLATE) ? ext.stored_size : 0 },
+            };
+            for (const auto &variant : variants) {
+                if (variant.size == 0) {
+                    continue;
+                }
+                response.vary_encoding = true;
+                // Ranges are only served from the identity encoding, unless it needs to be decompressed
+                if ((request.range == nullptr || (inode_data.flags & FLAG_DEFLATE) != 0) && variant.size < size && accepts_encoding(request.accept_encoding, encoding_name(variant.encoding))) {
+                    encoding = variant.encoding;
+                    size = variant.size;
+                }
+            }
+        }
+
+        FileHandle* file;
+        ret = blobfs.open_encoded(file, inode, encoding);
+        if (ret) {
+            return send_status(sink, request, status_for_errno(ret));
+        }
+
+        response.status = 200;
+        response.content_encoding = encoding_name(encoding);
+        response.content_length = size;
+        response.total_size = size;
+        uint32_t position = 0;
+        if (encoding == ENCODING_IDENTITY && request.range != nullptr) {
+            ret = parse_range(request.range, size, response.range_first, response.range_last);
+            if (ret == 0) {
+                response.status = 206;
+                position = response.range_first;
+                response.content_length = response.range_last - response.range_first + 1;
+            } else if (ret == ERANGE) {
+                response.status = 416;
+                response.content_length = 0;
+            }
+        }
+
+        const char* mime_type = nullptr;
+        if (has_ext && blobfs.mime_type(mime_type, ext.mime_id) != 0) {
+            mime_type = nullptr;
+        }
+        response.content_type = mime_type;
+        ret = sink.send_headers(response);
+        if (mime_type) {
+            blobfs.free_str(mime_type);
+        }
+
+        if (ret == 0 && !is_head) {
+            ret = send_contents(sink, file, position, response.content_length);
+        }
+        delete file;
+        return ret;
+    }
+
+    int HttpServer::parse_request(http_request_t &request, char* buffer) {
+        memset(&request, 0, sizeof(http_request_t));
+
+        // Request line: METHOD TARGET VERSION
+        char* line_end = strstr(buffer, "\r\n");
+        if (line_end == nullptr) {
+            return EINVAL;
+        }
+        *line_end = '\0';
+        char* target = strchr(buffer, ' ');
+        if (target == nullptr) {
+            return EINVAL;
+        }
+        *target++ = '\0';
+        char* version = strchr(target, ' ');
+        if (version == nullptr) {
+            return EINVAL;
+        }
+        *version++ = '\0';
+
+        request.method = buffer;
+        char* query = strchr(target, '?');
+        if (query) {
+            *query = '\0';
+        }
+        int ret = url_decode(target);
+        if (ret) {
+            return ret;
+        }
+        request.path = target;
+        request.keep_alive = strcmp(version, "HTTP/1.1") == 0;
+
+        // Headers, until an empty line
+        char* line = line_end + 2;
+        while (true) {
+            line_end = strstr(line, "\r\n");
+            if (line_end == nullptr) {
+                return EINVAL;
+            }
+            if (line_end == line) {
+                break;
+            }
+            *line_end = '\0';
+
+            char* value = strchr(line, ':');
+            if (value == nullptr) {
+                return EINVAL;
+            }
+            *value++ = '\0';
+            value = trim(value);
+
+            if (strcasecmp(line, "If-None-Match") == 0) {
+                request.if_none_match = value;
+            } else if (strcasecmp(line, "Range") == 0) {
+                request.range = value;
+            } else if (strcasecmp(line, "Accept-Encoding") == 0) {
+                request.accept_encoding = value;
+            } else if (strcasecmp(line, "Connection") == 0) {
+                if (strcasecmp(value, "close") == 0) {
+                    request.keep_alive = false;
+                } else if (strcasecmp(value, "keep-alive") == 0) {
+                    request.keep_alive = true;
+                }
+            }
+            line = line_end + 2;
+        }
+        return 0;
+    }
+
+    int HttpServer::format_headers(char* dest, uint32_t &size, const http_response_t &response) {
+        uint32_t used = 0;
+        int ret = append_header(dest, size, used, "HTTP/1.1 %d %s\r\nContent-Length: %u\r\nAccept-Ranges: bytes\r\nConnection: %s\r\n",
+            response.status, status_reason(response.status), (unsigned)response.content_length, response.keep_alive ? "keep-alive" : "close");
+        if (ret == 0 && response.content_type) {
+            ret = append_header(dest, size, used, "Content-Type: %s\r\n", response.content_type);
+        }
+        if (ret == 0 && response.content_encoding) {
+            ret = append_header(dest, size, used, "Content-Encoding: %s\r\n", response.content_encoding);
+        }
+        if (ret == 0 && response.etag[0]) {
+            ret = append_header(dest, size, used, "ETag: %s\r\n", response.etag);
+        }
+        if (ret == 0 && response.vary_encoding) {
+            ret = append_header(dest, size, used, "Vary: Accept-Encoding\r\n");
+        }
+        if (ret == 0 && response.status == 206) {
+            ret = append_header(dest, size, used, "Content-Range: bytes %u-%u/%u\r\n",
+                (unsigned)response.range_first, (unsigned)response.range_last, (unsigned)response.total_size);
+        }
+        if (ret == 0 && response.status == 416) {
+            ret = append_header(dest, size, used, "Content-Range: bytes */%u\r\n", (unsigned)response.total_size);
+        }
+        if (ret == 0) {
+            ret = append_header(dest, size, used, "\r\n");
+        }
+        if (ret) {
+            return ret;
+        }
+        size = used;
+        return 0;
+    }
+}
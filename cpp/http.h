@@ -0,0 +1,166 @@
+# pragma once
+#include "blobfs.h"
+
+namespace blobfs {
+    /** Size of the buffer used to stream file contents when the blob cannot be mapped in memory */
+    constexpr uint32_t HTTP_CHUNK_SIZE = 512;
+
+    /** Maximum size of the header block produced by `HttpServer::format_headers` */
+    constexpr uint32_t HTTP_MAX_HEADERS_SIZE = 512;
+
+    class SwappableBlobFS;
+
+    /** Fields of an HTTP request used by HttpServer -- Missing headers are nullptr */
+    typedef struct {
+        /** Request method, e.g., "GET" */
+        const char* method;
+        /** URL-decoded path, without the query string */
+        const char* path;
+        /** Value of `If-None-Match` */
+        const char* if_none_match;
+        /** Value of `Range` */
+        const char* range;
+        /** Value of `Accept-Encoding` */
+        const char* accept_encoding;
+        /** Whether the connection should be kept open after the response */
+        bool keep_alive;
+    } http_request_t;
+
+    /** An HTTP response header, as passed to `HttpSink::send_headers` */
+    typedef struct {
+        /** Status code, e.g., 200 */
+        int status;
+        /** Value of `Content-Type`, or nullptr */
+        const char* content_type;
+        /** Value of `Content-Encoding`, or nullptr for the identity encoding */
+        const char* content_encoding;
+        /** Value of `ETag`, or an empty string */
+        char etag[2 * CONTENT_HASH_SIZE + 3];
+        /** Number of body bytes that will follow */
+        uint32_t content_length;
+        /** For 206 responses, the first and last byte of the range being sent. For 416 responses, only `total_size` is used */
+        uint32_t range_first;
+        uint32_t range_last;
+        /** Size of the whole representation, used by `Content-Range` */
+        uint32_t total_size;
+        /** Whether precompressed variants are available, i.e., the response depends on `Accept-Encoding` */
+        bool vary_encoding;
+        /** Whether the connection will be kept open after the response */
+        bool keep_alive;
+    } http_response_t;
+
+    /**
+     * Transport used by HttpServer to send a response
+     *
+     * Body chunks are passed straight from the blob whenever possible, so implementations should send them
+     * without copying (e.g., `writev`, `esp_http_server`'s `httpd_send`) instead of buffering them.
+     */
+    class HttpSink {
+    public:
+        virtual ~HttpSink() {}
+
+        /**
+         * Sends the status line and the headers
+         *
+         * `HttpServer::format_headers` can be used to serialize them
+         *
+         * @param[in] response The response being sent
+         * @return 0 on success, or errno
+         */
+        virtual int send_headers(const http_response_t &response) = 0;
+
+        /**
+         * Sends a chunk of the body
+         *
+         * @param[in] data The chunk of the body, only valid during this call
+         * @param[in] size Size of the chunk
+         * @return 0 on success, or errno
+         */
+        virtual int send_body(const void* data, uint32_t size) = 0;
+    };
+
+    /**
+     * Serves the contents of a BlobFS over HTTP
+     *
+     * It is transport-agnostic: requests are parsed by the caller (possibly with `parse_request`) and responses
+     * are sent to an HttpSink.
+     *
+     * It supports:
+     * - Conditional GETs using the content hashes stored in the blob as ETags (`--http-metadata`)
+     * - Single-range requests
+     * - Content negotiation of precompressed variants (`--precompress`) and of the compressed files themselves (`deflate`)
+     * - Zero-copy streaming from memory-mapped blobs
+     * - Swapping the blob being served without downtime, with SwappableBlobFS
+     */
+    class HttpServer {
+    protected:
+        BlobFS* _blobfs;
+        SwappableBlobFS* _swappable;
+        const char* _index;
+
+    public:
+        /**
+         * @param[in] blobfs The filesystem being served
+         * @param[in] index Name of the file served when a directory is requested, or nullptr
+         */
+        HttpServer(BlobFS& blobfs, const char* index="index.html");
+
+        /**
+         * Serves whichever blob is current at the time of each request
+         *
+         * Each request is served entirely from the same blob, even if it is swapped in the middle of the response.
+         *
+         * @param[in] blobfs The filesystem being served
+         * @param[in] index Name of the file served when a directory is requested, or nullptr
+         */
+        HttpServer(SwappableBlobFS& blobfs, const char* index="index.html");
+
+        /**
+         * Handles a GET or HEAD request
+         *
+         * Errors of the filesystem are reported to the client with the appropriate status code.
+         *
+         * @param[in] request The request
+         * @param[in] sink Where the response is sent
+         * @return 0 on success, or the errno returned by the sink -- The connection should be dropped in that case
+         */
+        int handle(const http_request_t &request, HttpSink &sink);
+
+        /**
+         * Parses the request line and headers of an HTTP request, in-place
+         *
+         * The fields of `request` will point inside `buffer`
+         *
+         * @param[out] request The parsed request
+         * @param[in,out] buffer NULL-terminated header block, including the final empty line
+         * @return 0 on success, or EINVAL if the request is malformed
+         */
+        static int parse_request(http_request_t &request, char* buffer);
+
+        /**
+         * Serializes the status line and headers of a response, including the final empty line
+         *
+         * @param[out] dest Buffer where the headers will be written
+         * @param[in,out] size Input: Size of `dest` buffer; Output: size of the headers
+         * @param[in] response The response
+         * @return 0 on success, or ENOBUFS if `dest` is too small
+         */
+        static int format_headers(char* dest, uint32_t &size, const http_response_t &response);
+
+    protected:
+        /**
+         * Handles a request from a specific blob
+         */
+        int handle(BlobFS& blobfs, const http_request_t &request, HttpSink &sink);
+
+        /**
+         * Sends a response without body
+         */
+        int send_status(HttpSink &sink, const http_request_t &request, int status);
+
+        /**
+         * Sends a chunk of the file to the sink, without copying it if possible
+         */
+        int send_contents(HttpSink &sink, FileHandle* file, uint32_t position, uint32_t size);
+    };
+}
@@ -0,0 +1,165 @@
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "http_posix.h"
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // macOS: Use SO_NOSIGPIPE instead
+#endif
+
+namespace blobfs {
+    // ================= Socket sink =================
+
+    int SocketHttpSink::send_all(const void* headers, uint32_t headers_size, const void* body, uint32_t body_size) {
+        struct iovec iov[2];
+        iov[0].iov_base = (void*)headers;
+        iov[0].iov_len = headers_size;
+        iov[1].iov_base = (void*)body;
+        iov[1].iov_len = body_size;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        while (iov[0].iov_len + iov[1].iov_len > 0) {
+            // Skip iovecs that were already sent
+            msg.msg_iov = iov[0].iov_len ? iov : iov + 1;
+            msg.msg_iovlen = iov[0].iov_len ? 2 : 1;
+
+            ssize_t n = sendmsg(_fd, &msg, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno;
+            }
+            for (int i = 0; i < 2; i++) {
+                size_t consumed = (size_t)n < iov[i].iov_len ? n : iov[i].iov_len;
+                iov[i].iov_base = (char*)iov[i].iov_base + consumed;
+                iov[i].iov_len -= consumed;
+                n -= consumed;
+            }
+        }
+        return 0;
+    }
+
+    int SocketHttpSink::send_headers(const http_response_t &response) {
+        _headers_size = sizeof(_headers);
+        int ret = HttpServer::format_headers(_headers, _headers_size, response);
+        if (ret) {
+            _headers_size = 0;
+            return ret;
+        }
+        if (response.content_length == 0) {
+            return flush();  // No body will follow
+        }
+        return 0;
+    }
+
+    int SocketHttpSink::send_body(const void* data, uint32_t size) {
+        int ret = send_all(_headers, _headers_size, data, size);
+        _headers_size = 0;
+        return ret;
+    }
+
+    int SocketHttpSink::flush() {
+        if (_headers_size == 0) {
+            return 0;
+        }
+        return send_body(nullptr, 0);
+    }
+
+
+
+
+    // ================= Connection handling =================
+
+    int http_serve_connection(HttpServer &server, int fd) {
+        char buffer[HTTP_MAX_REQUEST_SIZE + 1];
+        uint32_t buffered = 0;
+        SocketHttpSink sink(fd);
+
+        while (true) {
+            // Read until the end of the headers
+            char* headers_end;
+            while (true) {
+                buffer[buffered] = '\0';
+                headers_end = strstr(buffer, "\r\n\r\n");
+                if (headers_end) {
+                    break;
+                }
+                if (buffered == HTTP_MAX_REQUEST_SIZE) {
+                    return E2BIG;
+                }
+                ssize_t n = recv(fd, buffer + buffered, HTTP_MAX_REQUEST_SIZE - buffered, 0);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    return errno;
+                }
+                if (n == 0) {
+                    return 0;  // Closed by the client
+                }
+                buffered += n;
+            }
+
+            // Requests might be pipelined: Keep whatever comes after the headers
+            char* next_request = headers_end + 4;
+            char saved = *next_request;
+            *next_request = '\0';
+
+            http_request_t request;
+            int ret = HttpServer::parse_request(request, buffer);
+            if (ret) {
+                http_response_t response;
+                memset(&response, 0, sizeof(http_response_t));
+                response.status = 400;
+                sink.send_headers(response);
+                return ret;
+            }
+            ret = server.handle(request, sink);
+            if (ret == 0) {
+                ret = sink.flush();
+            }
+            if (ret) {
+                return ret;
+            }
+            if (!request.keep_alive) {
+                return 0;
+            }
+
+            *next_request = saved;
+            buffered -= next_request - buffer;
+            memmove(buffer, next_request, buffered);
+        }
+    }
+
+    int http_serve(HttpServer &server, int listen_fd) {
+        while (true) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                return errno;
+            }
+#ifdef SO_NOSIGPIPE
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+            std::thread([&server, fd]() {
+                http_serve_connection(server, fd);
+                close(fd);
+            }).detach();
+        }
+    }
+}
+
+#endif // POSIX
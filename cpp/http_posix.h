@@ -0,0 +1,63 @@
+# pragma once
+
+#if !defined(__unix__) && !defined(__APPLE__)
+#error <blobfs/http_posix.h> is only enabled on POSIX systems
+#endif
+
+#include "http.h"
+
+namespace blobfs {
+    /** Size of the buffer holding the headers of a request */
+    constexpr uint32_t HTTP_MAX_REQUEST_SIZE = 4096;
+
+    /**
+     * HttpSink that writes to a connected socket
+     *
+     * Headers are held back and sent together with the first chunk of the body, in a single `sendmsg`.
+     */
+    class SocketHttpSink : public HttpSink {
+    protected:
+        int _fd;
+        char _headers[HTTP_MAX_HEADERS_SIZE];
+        uint32_t _headers_size;
+
+        int send_all(const void* headers, uint32_t headers_size, const void* body, uint32_t body_size);
+
+    public:
+        inline SocketHttpSink(int fd)
+        : _fd(fd), _headers_size(0)
+        {}
+
+        virtual int send_headers(const http_response_t &response);
+        virtual int send_body(const void* data, uint32_t size);
+
+        /**
+         * Sends the headers if they are still pending, i.e., on responses without body
+         *
+         * @return 0 on success, or errno
+         */
+        int flush();
+    };
+
+    /**
+     * Serves HTTP/1.1 requests from a connected socket until the client closes it
+     *
+     * The socket is not closed.
+     *
+     * @param[in] server The server handling the requests
+     * @param[in] fd The connected socket
+     * @return 0 if the connection was closed normally, or errno
+     */
+    int http_serve_connection(HttpServer &server, int fd);
+
+    /**
+     * Accepts connections from a listening socket and serves each one on its own thread
+     *
+     * Only returns if `accept` fails
+     *
+     * @param[in] server The server handling the requests
+     * @param[in] listen_fd The listening socket
+     * @return errno
+     */
+    int http_serve(HttpServer &server, int listen_fd);
+}
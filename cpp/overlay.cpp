@@ -0,0 +1,343 @@
+#include "overlay.h"
+#include <cstring>
+#include <cstdlib>
+
+namespace blobfs {
+    // ================= Path cache =================
+
+    /** FNV-1a hash of a path prefix */
+    static inline uint32_t path_hash(const char* path, size_t path_len) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < path_len; i++) {
+            hash = (hash ^ (uint8_t)path[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    OverlayBlobFS::cache_entry_t* OverlayBlobFS::cache_slot(const char* path, size_t path_len) {
+        if (_cache == nullptr) {
+            return nullptr;
+        }
+        return &_cache[path_hash(path, path_len) & (_cache_size - 1)];
+    }
+
+    void OverlayBlobFS::cache_put(const char* path, size_t path_len, int result, const overlay_inode_t &inode) {
+        cache_entry_t* slot = cache_slot(path, path_len);
+        if (slot == nullptr) {
+            return;
+        }
+        char* cached_path = (char*)malloc(path_len + 1);
+        if (cached_path == nullptr) {
+            return;  // Not worth failing the lookup
+        }
+        memcpy(cached_path, path, path_len);
+        cached_path[path_len] = '\0';
+
+        free(slot->path);
+        slot->path = cached_path;
+        slot->result = result;
+        slot->inode = inode;
+    }
+
+    void OverlayBlobFS::cache_clear() {
+        for (uint32_t i = 0; _cache != nullptr && i < _cache_size; i++) {
+            free(_cache[i].path);
+            _cache[i].path = nullptr;
+        }
+    }
+
+
+
+
+    // ================= Overlay FS =================
+
+    OverlayBlobFS::OverlayBlobFS(uint32_t cache_size)
+    : _num_layers(0), _cache(nullptr), _cache_size(0)
+    {
+        _root.layers = 0;
+        if (cache_size) {
+            _cache_size = 1;
+            while (_cache_size < cache_size) {
+                _cache_size *= 2;
+            }
+            _cache = (cache_entry_t*)calloc(_cache_size, sizeof(cache_entry_t));
+        }
+    }
+
+    OverlayBlobFS::~OverlayBlobFS() {
+        cache_clear();
+        free(_cache);
+    }
+
+    int OverlayBlobFS::add_layer(BlobFS& layer) {
+        if (_num_layers == OVERLAY_MAX_LAYERS) {
+            return ENOSPC;
+        }
+        inode_data_t root;
+        int ret = layer.stat(root, 0);
+        if (ret) {
+            return ret;
+        }
+
+        uint32_t index = _num_layers++;
+        _layers[index] = &layer;
+
+        // The new root hides the old one if it is a file or an opaque directory
+        if ((root.flags & FLAG_DIR) == 0 || (root.flags & FLAG_WHITEOUT) != 0) {
+            _root.layers = 0;
+        }
+        _root.layers |= 1u << index;
+        _root.inodes[index] = 0;
+
+        cache_clear();
+        return 0;
+    }
+
+    int OverlayBlobFS::lookup_child(overlay_inode_t &child, const overlay_inode_t &parent, const char* name) {
+        child.layers = 0;
+        for (uint32_t layer = _num_layers; layer-- > 0; ) {
+            if ((parent.layers & (1u << layer)) == 0) {
+                continue;
+            }
+            inode_t inode;
+            int ret = _layers[layer]->lookup_child(inode, parent.inodes[layer], name);
+            if (ret == ENOENT) {
+                continue;
+            }
+            if (ret) {
+                return ret;
+            }
+            inode_data_t inode_data;
+            ret = _layers[layer]->stat(inode_data, inode);
+            if (ret) {
+                return ret;
+            }
+
+            if ((inode_data.flags & FLAG_DIR) == 0) {
+                // Whiteouts and files hide everything below them, and are hidden by directories above them
+                if (child.layers == 0 && (inode_data.flags & FLAG_WHITEOUT) == 0) {
+                    child.layers = 1u << layer;
+                    child.inodes[layer] = inode;
+                }
+                break;
+            }
+
+            child.layers |= 1u << layer;
+            child.inodes[layer] = inode;
+            if (inode_data.flags & FLAG_WHITEOUT) {
+                break;  // Opaque directory
+            }
+        }
+        return child.layers ? 0 : ENOENT;
+    }
+
+    int OverlayBlobFS::lookup(overlay_inode_t &inode, const char* path) {
+        // Path must start with "/"
+        if (path == nullptr || path[0] != '/' || _num_layers == 0) {
+            return ENOENT;
+        }
+
+        // Start from the longest cached prefix -- Prefixes ending at each "/", from the longest to the shortest
+        size_t path_len = strlen(path);
+        size_t start = 0;
+        inode = _root;
+        for (size_t prefix_len = path_len; prefix_len > 0; ) {
+            cache_entry_t* entry = cache_slot(path, prefix_len);
+            if (entry != nullptr && entry->path != nullptr && strncmp(entry->path, path, prefix_len) == 0 && entry->path[prefix_len] == '\0') {
+                if (entry->result) {
+                    return entry->result;  // If the prefix doesn't exist, neither does the path
+                }
+                inode = entry->inode;
+                start = prefix_len;
+                break;
+            }
+            while (prefix_len > 0 && path[--prefix_len] != '/') {}
+        }
+
+        if (start == path_len) {
+            return 0;
+        }
+
+        // Resolve the remaining components, caching every prefix
+        const char* chunk_start = path + start + 1;
+        for (const char* chunk_end=chunk_start; ; chunk_end++) {
+            char endchar = *chunk_end;
+            if ((endchar == '/') || (endchar == '\0')) {
+                if (chunk_end != chunk_start) { // Ignore empty chunks -- .e.g "/foo//bar/" == "/foo/bar"
+                    size_t chunk_size = chunk_end - chunk_start;
+                    char* chunk_name = (char*)malloc(chunk_size + 1);
+                    if (chunk_name == nullptr) {
+                        return ENOMEM;
+                    }
+                    memcpy(chunk_name, chunk_start, chunk_size);
+                    chunk_name[chunk_size] = '\0';
+
+                    overlay_inode_t child;
+                    int ret = lookup_child(child, inode, chunk_name);
+                    free(chunk_name);
+
+                    if (ret == 0 || ret == ENOENT || ret == ENOTDIR) {
+                        cache_put(path, chunk_end - path, ret, child);
+                    }
+                    if (ret) {
+                        return ret;
+                    }
+                    inode = child;
+                }
+                chunk_start = chunk_end + 1;
+            }
+            if (endchar == '\0') {
+                break;
+            }
+        }
+
+        return 0;
+    }
+
+    int OverlayBlobFS::stat(inode_data_t &inode_data, uint32_t &layer, const overlay_inode_t &inode) {
+        for (layer = _num_layers; layer-- > 0; ) {
+            if (inode.layers & (1u << layer)) {
+                return _layers[layer]->stat(inode_data, inode.inodes[layer]);
+            }
+        }
+        return ENOENT;
+    }
+
+    int OverlayBlobFS::open(FileHandle* &file, const char* path) {
+        overlay_inode_t inode;
+        int ret = lookup(inode, path);
+        if (ret) {
+            return ret;
+        }
+        inode_data_t inode_data;
+        uint32_t layer;
+        ret = stat(inode_data, layer, inode);
+        if (ret) {
+            return ret;
+        }
+        return _layers[layer]->open(file, inode.inodes[layer]);
+    }
+
+    int OverlayBlobFS::opendir(OverlayDirHandle* &dir, const char* path) {
+        overlay_inode_t inode;
+        int ret = lookup(inode, path);
+        if (ret) {
+            return ret;
+        }
+        inode_data_t inode_data;
+        uint32_t top;
+        ret = stat(inode_data, top, inode);
+        if (ret) {
+            return ret;
+        }
+        if ((inode_data.flags & FLAG_DIR) == 0) {
+            // opendir only takes directories
+            return ENOTDIR;
+        }
+
+        OverlayDirHandle* handle = new OverlayDirHandle(*this);
+        for (uint32_t layer = 0; layer < _num_layers && ret == 0; layer++) {
+            if (inode.layers & (1u << layer)) {
+                ret = _layers[layer]->opendir(handle->_cursors[layer].dir, inode.inodes[layer]);
+                if (ret == 0) {
+                    ret = handle->advance(layer);
+                }
+            }
+        }
+        if (ret) {
+            delete handle;
+            return ret;
+        }
+        dir = handle;
+        return 0;
+    }
+
+
+
+
+    // ================= Merged Directory Handle =================
+
+    OverlayDirHandle::OverlayDirHandle(OverlayBlobFS& overlay)
+    : _overlay(overlay), _last_name(nullptr), _last_layer(0)
+    {
+        for (uint32_t layer = 0; layer < OVERLAY_MAX_LAYERS; layer++) {
+            _cursors[layer].dir = nullptr;
+            _cursors[layer].name = nullptr;
+        }
+    }
+
+    OverlayDirHandle::~OverlayDirHandle() {
+        if (_last_name != nullptr) {
+            _overlay.layer(_last_layer)->free_str(_last_name);
+        }
+        for (uint32_t layer = 0; layer < OVERLAY_MAX_LAYERS; layer++) {
+            if (_cursors[layer].name != nullptr) {
+                _overlay.layer(layer)->free_str(_cursors[layer].name);
+            }
+            delete _cursors[layer].dir;
+        }
+    }
+
+    int OverlayDirHandle::advance(uint32_t layer) {
+        layer_cursor_t &cursor = _cursors[layer];
+        cursor.name = nullptr;
+        const char* name;
+        int ret = cursor.dir->readdir(cursor.entry, cursor.inode, name);
+        if (ret == ENOENT) {
+            return 0;  // This layer is exhausted
+        }
+        if (ret) {
+            return ret;
+        }
+        cursor.name = name;
+        return 0;
+    }
+
+    int OverlayDirHandle::readdir(dir_entry_t &direntry, uint32_t &layer, inode_t &inode, const char* &name) {
+        while (true) {
+            if (_last_name != nullptr) {
+                _overlay.layer(_last_layer)->free_str(_last_name);
+                _last_name = nullptr;
+            }
+
+            // Smallest name across all layers -- The top-most one wins ties
+            int best = -1;
+            for (uint32_t i = OVERLAY_MAX_LAYERS; i-- > 0; ) {
+                if (_cursors[i].name != nullptr && (best < 0 || strcmp(_cursors[i].name, _cursors[best].name) < 0)) {
+                    best = i;
+                }
+            }
+            if (best < 0) {
+                return ENOENT;
+            }
+
+            // Entries with the same name in lower layers are hidden
+            for (int i = best - 1; i >= 0; i--) {
+                if (_cursors[i].name != nullptr && strcmp(_cursors[i].name, _cursors[best].name) == 0) {
+                    _overlay.layer(i)->free_str(_cursors[i].name);
+                    int ret = advance(i);
+                    if (ret) {
+                        return ret;
+                    }
+                }
+            }
+
+            layer_cursor_t &cursor = _cursors[best];
+            _last_name = cursor.name;
+            _last_layer = best;
+            direntry = cursor.entry;
+            inode = cursor.inode;
+            int ret = advance(best);
+            if (ret) {
+                return ret;
+            }
+
+            if ((direntry.inode_data.flags & (FLAG_DIR | FLAG_WHITEOUT)) == FLAG_WHITEOUT) {
+                continue;  // Whiteouts are not listed
+            }
+            layer = best;
+            name = _last_name;
+            return 0;
+        }
+    }
+}
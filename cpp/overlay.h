@@ -0,0 +1,164 @@
+# pragma once
+#include "blobfs.h"
+#include <cstddef>
+
+namespace blobfs {
+    /** Maximum number of layers of an OverlayBlobFS */
+    constexpr uint32_t OVERLAY_MAX_LAYERS = 16;
+
+    /**
+     * A path resolved on an OverlayBlobFS
+     *
+     * Regular files come from a single layer. Directories might be merged from several layers.
+     */
+    typedef struct {
+        /** Bitmask of the layers where the path was found -- Bit `i` is set if `inodes[i]` is valid */
+        uint32_t layers;
+        /** Inode of the path on each of the layers in `layers` */
+        inode_t inodes[OVERLAY_MAX_LAYERS];
+    } overlay_inode_t;
+
+    class OverlayDirHandle;
+
+    /**
+     * Union of several BlobFS layers
+     *
+     * Layers on top hide files with the same path on layers below them, and directories are merged.
+     * Upper layers can also remove entries of the lower ones with whiteouts (FLAG_WHITEOUT), or replace the contents
+     * of whole directories with opaque directories (FLAG_DIR | FLAG_WHITEOUT).
+     *
+     * Resolved paths are kept in a small cache, so that looking up a path over many layers usually costs a single
+     * hash probe, or a probe plus a lookup on each layer of the parent directory.
+     *
+     * It is not thread-safe.
+     */
+    class OverlayBlobFS {
+    protected:
+        typedef struct {
+            /** Cached path, or nullptr if the slot is empty */
+            char* path;
+            /** Result of looking it up */
+            int result;
+            overlay_inode_t inode;
+        } cache_entry_t;
+
+        BlobFS* _layers[OVERLAY_MAX_LAYERS];
+        uint32_t _num_layers;
+        /** Root directory, merged from all layers */
+        overlay_inode_t _root;
+        cache_entry_t* _cache;
+        uint32_t _cache_size;
+
+        cache_entry_t* cache_slot(const char* path, size_t path_len);
+        void cache_put(const char* path, size_t path_len, int result, const overlay_inode_t &inode);
+        void cache_clear();
+        int lookup_child(overlay_inode_t &child, const overlay_inode_t &parent, const char* name);
+
+    public:
+        /**
+         * @param[in] cache_size Number of resolved paths kept in cache, rounded up to a power of 2 -- 0 disables the cache
+         */
+        OverlayBlobFS(uint32_t cache_size = 64);
+        ~OverlayBlobFS();
+
+        /**
+         * Adds a layer on top of the existing ones
+         *
+         * @param[in] layer The new top layer, must outlive the OverlayBlobFS
+         * @return 0 on success, ENOSPC if there are already OVERLAY_MAX_LAYERS layers
+         */
+        int add_layer(BlobFS& layer);
+
+        /**
+         * Returns one of the layers
+         *
+         * @param[in] index Index of the layer, 0 is the bottom one
+         * @return The layer, or nullptr
+         */
+        inline BlobFS* layer(uint32_t index) {
+            return index < _num_layers ? _layers[index] : nullptr;
+        }
+
+        /**
+         * Lookup an inode from an absolute path
+         *
+         * @param[out] inode The inode on each of the layers, if found
+         * @param[in] path Full path to the inode being looked up
+         * @return 0 on success, or errno
+         */
+        int lookup(overlay_inode_t &inode, const char* path);
+
+        /**
+         * Returns the metadata of the top-most layer of an inode
+         *
+         * @param[out] inode_data metadata of the inode
+         * @param[out] layer The layer it comes from
+         * @param[in] inode The inode
+         * @return 0 on success, or errno
+         */
+        int stat(inode_data_t &inode_data, uint32_t &layer, const overlay_inode_t &inode);
+
+        /**
+         * Opens a file for reading
+         *
+         * After use, the file handle must be released with `delete file`
+         *
+         * @param[out] file the file handle.
+         * @param[in] path The path of the file in the filesystem
+         * @return 0 on success, or errno
+         */
+        int open(FileHandle* &file, const char* path);
+
+        /**
+         * Opens the directory for listing files, merging its contents from all layers
+         *
+         * After use, the directory handle must be released with `delete dir`
+         *
+         * @param[out] dir the directory handle.
+         * @param[in] path The path of the directory in the filesystem
+         * @return 0 on success, or errno
+         */
+        int opendir(OverlayDirHandle* &dir, const char* path);
+    };
+
+    /**
+     * Lists a directory merged from several layers
+     *
+     * Since the entries of each layer are sorted by name, it is a k-way merge of the layers' listings.
+     */
+    class OverlayDirHandle {
+    protected:
+        friend class OverlayBlobFS;
+
+        typedef struct {
+            DirHandle* dir;
+            /** Next entry of this layer, or nullptr once the layer is exhausted */
+            const char* name;
+            dir_entry_t entry;
+            inode_t inode;
+        } layer_cursor_t;
+
+        OverlayBlobFS& _overlay;
+        layer_cursor_t _cursors[OVERLAY_MAX_LAYERS];
+        /** Name returned by the last readdir, released on the next one */
+        const char* _last_name;
+        uint32_t _last_layer;
+
+        OverlayDirHandle(OverlayBlobFS& overlay);
+        int advance(uint32_t layer);
+
+    public:
+        ~OverlayDirHandle();
+
+        /**
+         * Reads the next entry in this directory
+         *
+         * @param[out] direntry The data associated with the entry, from the top-most layer where it exists
+         * @param[out] layer The layer the entry comes from
+         * @param[out] inode The inode associated with the entry on that layer
+         * @param[out] name Name of the entry, valid until the next call to readdir
+         * @return 0 on success, ENOENT if it reached the end of the list of entries, or errno
+         */
+        int readdir(dir_entry_t &direntry, uint32_t &layer, inode_t &inode, const char* &name);
+    };
+}
@@ -0,0 +1,236 @@
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "parallel_walk.h"
+#include <cstring>
+#include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace blobfs {
+    namespace {
+        /** A subtree waiting to be walked */
+        typedef struct {
+            inode_data_t inode_data;
+            /** Path of the directory, malloc'ed */
+            char* path;
+            uint32_t path_len;
+            uint32_t depth;
+        } walk_task_t;
+
+        /** Tasks of a thread -- The owner works on the back, thieves take from the front */
+        typedef struct {
+            std::mutex mutex;
+            std::deque<walk_task_t> tasks;
+        } walk_queue_t;
+
+        class WalkPool {
+            BlobFS& _blobfs;
+            walk_visitor_t _visitor;
+            void* _arg;
+            uint32_t _threads;
+            walk_queue_t* _queues;
+            /** Tasks queued or being walked */
+            uint32_t _outstanding;
+            /** Tasks queued, waiting for a thread */
+            uint32_t _queued;
+            /** First error, stops every thread */
+            int _error;
+
+            /** Idle threads sleep here until a task is queued or the walk is over */
+            std::mutex _idle_mutex;
+            std::condition_variable _idle_cv;
+            uint32_t _waiting;
+
+            typedef struct {
+                WalkPool* pool;
+                uint32_t index;
+            } defer_arg_t;
+
+            static int defer(void* arg, inode_t /*inode*/, const inode_data_t &inode_data, const char* path, uint32_t depth) {
+                defer_arg_t* defer_arg = (defer_arg_t*)arg;
+                return defer_arg->pool->push(defer_arg->index, inode_data, path, depth);
+            }
+
+            bool pop(uint32_t index, walk_task_t &task) {
+                {
+                    walk_queue_t &own = _queues[index];
+                    std::lock_guard<std::mutex> lock(own.mutex);
+                    if (!own.tasks.empty()) {
+                        task = own.tasks.back();
+                        own.tasks.pop_back();
+                        __atomic_sub_fetch(&_queued, 1, __ATOMIC_SEQ_CST);
+                        return true;
+                    }
+                }
+                for (uint32_t i = 1; i < _threads; i++) {
+                    walk_queue_t &victim = _queues[(index + i) % _threads];
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    if (!victim.tasks.empty()) {
+                        task = victim.tasks.front();
+                        victim.tasks.pop_front();
+                        __atomic_sub_fetch(&_queued, 1, __ATOMIC_SEQ_CST);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            /** Wakes the idle threads, if any */
+            void wake(bool all) {
+                // Pairs with the increment in `idle`: Either the sleeper sees the new state or we see the sleeper
+                if (__atomic_load_n(&_waiting, __ATOMIC_SEQ_CST) == 0) {
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(_idle_mutex);
+                if (all) {
+                    _idle_cv.notify_all();
+                } else {
+                    _idle_cv.notify_one();
+                }
+            }
+
+            /** Sleeps until there are tasks to steal or the walk is over */
+            void idle() {
+                std::unique_lock<std::mutex> lock(_idle_mutex);
+                __atomic_add_fetch(&_waiting, 1, __ATOMIC_SEQ_CST);
+                _idle_cv.wait(lock, [this] {
+                    return __atomic_load_n(&_queued, __ATOMIC_SEQ_CST) != 0
+                        || __atomic_load_n(&_outstanding, __ATOMIC_SEQ_CST) == 0;
+                });
+                __atomic_sub_fetch(&_waiting, 1, __ATOMIC_SEQ_CST);
+            }
+
+            void fail(int error) {
+                int expected = 0;
+                __atomic_compare_exchange_n(&_error, &expected, error, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            }
+
+            void worker(uint32_t index) {
+                walk_state_t state = {_visitor, _arg, nullptr, 0, nullptr, nullptr};
+                defer_arg_t defer_arg = {this, index};
+                state.defer = &defer;
+                state.defer_arg = &defer_arg;
+
+                while (__atomic_load_n(&_outstanding, __ATOMIC_SEQ_CST) != 0) {
+                    walk_task_t task;
+                    if (!pop(index, task)) {
+                        idle();
+                        continue;
+                    }
+                    if (__atomic_load_n(&_error, __ATOMIC_SEQ_CST) == 0) {
+                        // The task's path becomes the buffer of the walk
+                        free(state.path);
+                        state.path = task.path;
+                        state.path_capacity = task.path_len + 1;
+                        int ret = _blobfs.walk_dir(state, task.inode_data, task.path_len, task.depth);
+                        if (ret) {
+                            fail(ret);
+                        }
+                    } else {
+                        free(task.path);
+                    }
+                    if (__atomic_sub_fetch(&_outstanding, 1, __ATOMIC_SEQ_CST) == 0) {
+                        wake(true);
+                    }
+                }
+                free(state.path);
+            }
+
+        public:
+            WalkPool(BlobFS& blobfs, walk_visitor_t visitor, void* arg, uint32_t threads)
+            : _blobfs(blobfs), _visitor(visitor), _arg(arg), _threads(threads), _queues(new walk_queue_t[threads]),
+              _outstanding(0), _queued(0), _error(0), _waiting(0)
+            {}
+
+            ~WalkPool() {
+                for (uint32_t i = 0; i < _threads; i++) {
+                    for (walk_task_t &task : _queues[i].tasks) {
+                        free(task.path);
+                    }
+                }
+                delete[] _queues;
+            }
+
+            int push(uint32_t index, const inode_data_t &inode_data, const char* path, uint32_t depth) {
+                uint32_t path_len = strlen(path);
+                char* path_copy = (char*)malloc(path_len + 1);
+                if (path_copy == nullptr) {
+                    return ENOMEM;
+                }
+                memcpy(path_copy, path, path_len + 1);
+
+                __atomic_add_fetch(&_outstanding, 1, __ATOMIC_SEQ_CST);
+                {
+                    walk_queue_t &queue = _queues[index];
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    queue.tasks.push_back(walk_task_t{inode_data, path_copy, path_len, depth});
+                    __atomic_add_fetch(&_queued, 1, __ATOMIC_SEQ_CST);
+                }
+                wake(false);
+                return 0;
+            }
+
+            int run() {
+                std::vector<std::thread> threads;
+                for (uint32_t i = 1; i < _threads; i++) {
+                    threads.emplace_back(&WalkPool::worker, this, i);
+                }
+                worker(0);
+                for (std::thread &thread : threads) {
+                    thread.join();
+                }
+                return _error;
+            }
+        };
+    }
+
+    int parallel_walk(BlobFS& blobfs, const char* root, walk_visitor_t visitor, void* arg, uint32_t threads) {
+        if (threads == 0) {
+            threads = std::thread::hardware_concurrency();
+            if (threads == 0) {
+                threads = 1;
+            }
+        }
+
+        inode_t inode;
+        inode_data_t inode_data;
+        int ret = blobfs.lookup(inode, root);
+        if (ret == 0) {
+            ret = blobfs.stat(inode_data, inode);
+        }
+        if (ret) {
+            return ret;
+        }
+
+        // Paths of the entries are appended to the root, without its trailing '/'
+        uint32_t root_len = strlen(root);
+        while (root_len > 0 && root[root_len - 1] == '/') {
+            root_len--;
+        }
+        char* path = (char*)malloc(root_len + 1);
+        if (path == nullptr) {
+            return ENOMEM;
+        }
+        memcpy(path, root, root_len);
+        path[root_len] = '\0';
+
+        ret = visitor(arg, root_len ? path : "/", inode, inode_data, 0);
+        if (ret != 0 || (inode_data.flags & FLAG_DIR) == 0) {
+            free(path);
+            return ret == WALK_SKIP_SUBTREE ? 0 : ret;
+        }
+
+        WalkPool pool(blobfs, visitor, arg, threads);
+        ret = pool.push(0, inode_data, path, 1);
+        free(path);
+        if (ret) {
+            return ret;
+        }
+        return pool.run();
+    }
+}
+
+#endif // POSIX
@@ -0,0 +1,26 @@
+# pragma once
+
+#if !defined(__unix__) && !defined(__APPLE__)
+#error <blobfs/parallel_walk.h> is only enabled on POSIX systems
+#endif
+
+#include "blobfs.h"
+
+namespace blobfs {
+    /**
+     * Visits every entry of a subtree like `BlobFS::walk`, fanning the subdirectories out across a pool of threads
+     *
+     * Each thread walks its own subtrees depth-first, and idle threads steal the subtrees closest to the root from the
+     * others. Parents are still visited before their children, but there is no order between siblings.
+     *
+     * The visitor is called concurrently from all threads, and the blob must support concurrent loads.
+     *
+     * @param[in] blobfs The blob
+     * @param[in] root Path of the root of the subtree, which is visited first
+     * @param[in] visitor Called for every entry
+     * @param[in] arg Argument passed to `visitor`
+     * @param[in] threads Number of threads, or 0 for one per core
+     * @return 0 on success, the first error returned by `visitor`, or errno
+     */
+    int parallel_walk(BlobFS& blobfs, const char* root, walk_visitor_t visitor, void* arg, uint32_t threads = 0);
+}
@@ -0,0 +1,491 @@
+#include "preload.h"
+#include "byteorder.h"
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <unordered_set>
+#include <vector>
+
+namespace blobfs {
+    struct PreloadBlobFS::scan_state {
+        std::vector<range_t> ranges;
+        /** Offsets of the directory tables and nested blobs already scanned, which the builder deduplicates */
+        std::unordered_set<uint64_t> scanned;
+        /** Budget of B+-tree nodes of the directory being scanned, so that corrupted trees can't loop */
+        uint32_t btree_nodes;
+
+        void add(uint64_t offset, uint64_t size) {
+            if (size != 0) {
+                ranges.push_back({offset, size});
+            }
+        }
+    };
+
+    /**
+     * The backend as seen by `scan_blob`: Small reads are served from a few aligned windows, loaded whole on first use
+     *
+     * Backends that can be memory-mapped are read in place, and reads that don't fit a window go to the backend as-is.
+     * Near the end of a blob of unknown size, windows are cut to the read. Names are returned as copies, so evicting
+     * a window never invalidates them.
+     */
+    class PreloadBlobFS::ScanWindowBlobFS : public BlobFS {
+        typedef struct {
+            offset_t offset;
+            uint32_t size;
+            /** Value of `_clock` when it was last used, the least recently used one is replaced */
+            uint64_t used;
+            uint8_t* data;
+        } window_t;
+
+        BlobFS& _backend;
+        window_t _windows[PRELOAD_SCAN_WINDOWS];
+        uint64_t _clock;
+
+        /** Returns the window containing `[offset, offset + len)`, or at least its start, loading it if needed, or nullptr */
+        const window_t* window(offset_t offset, uint32_t len) {
+            _clock++;
+            window_t* victim = &_windows[0];
+            for (uint32_t i = 0; i < PRELOAD_SCAN_WINDOWS; i++) {
+                window_t &w = _windows[i];
+                if (w.size != 0 && offset >= w.offset && offset - w.offset < w.size) {
+                    w.used = _clock;
+                    return &w;
+                }
+                if (w.used < victim->used) {
+                    victim = &w;
+                }
+            }
+
+            if (victim->data == nullptr) {
+                victim->data = (uint8_t*)malloc(PRELOAD_SCAN_WINDOW_SIZE);
+                if (victim->data == nullptr) {
+                    return nullptr;
+                }
+            }
+            offset_t start = offset - offset % PRELOAD_SCAN_WINDOW_SIZE;
+            uint32_t size = PRELOAD_SCAN_WINDOW_SIZE;
+            uint32_t blob_size;
+            if (_backend.blob_size(blob_size) == 0) {
+                if (start >= blob_size) {
+                    return nullptr;
+                }
+                size = std::min(size, blob_size - start);
+            }
+            victim->size = 0;
+            if (_backend.load_chunk(victim->data, start, size) != 0) {
+                // Possibly past the end of the blob
+                size = std::min(offset - start + len, PRELOAD_SCAN_WINDOW_SIZE);
+                if (_backend.load_chunk(victim->data, start, size) != 0) {
+                    return nullptr;
+                }
+            }
+            victim->offset = start;
+            victim->size = size;
+            victim->used = _clock;
+            return offset - start < size ? victim : nullptr;
+        }
+
+    public:
+        ScanWindowBlobFS(BlobFS& backend)
+        : _backend(backend), _windows(), _clock(0)
+        {}
+
+        ~ScanWindowBlobFS() {
+            for (uint32_t i = 0; i < PRELOAD_SCAN_WINDOWS; i++) {
+                free(_windows[i].data);
+            }
+        }
+
+        virtual int load_chunk(void* dest, offset_t offset, uint32_t len) {
+            const void* mapped;
+            if (len > PRELOAD_SCAN_WINDOW_SIZE || _backend.map_chunk(mapped, offset, len) == 0) {
+                return _backend.load_chunk(dest, offset, len);
+            }
+            // At most two windows
+            uint8_t* out = (uint8_t*)dest;
+            offset_t position = offset;
+            uint32_t remaining = len;
+            while (remaining > 0) {
+                const window_t* w = window(position, remaining);
+                if (w == nullptr) {
+                    return _backend.load_chunk(dest, offset, len);
+                }
+                uint32_t n = std::min(remaining, w->size - (position - w->offset));
+                memcpy(out, w->data + (position - w->offset), n);
+                out += n;
+                position += n;
+                remaining -= n;
+            }
+            return 0;
+        }
+
+        virtual int load_str(const char* &str, offset_t offset) {
+            const void* mapped;
+            const window_t* w = _backend.map_chunk(mapped, offset, 1) == 0 ? nullptr : window(offset, 1);
+            if (w != nullptr) {
+                const uint8_t* start = w->data + (offset - w->offset);
+                const uint8_t* end = (const uint8_t*)memchr(start, '\0', w->size - (offset - w->offset));
+                if (end != nullptr) {
+                    char* copy = (char*)malloc(end - start + 1);
+                    if (copy == nullptr) {
+                        return ENOMEM;
+                    }
+                    memcpy(copy, start, end - start + 1);
+                    str = copy;
+                    return 0;
+                }
+            }
+
+            // In place, or across windows
+            const char* name;
+            int ret = _backend.load_str(name, offset);
+            if (ret) {
+                return ret;
+            }
+            char* copy = strdup(name);
+            _backend.free_str(name);
+            if (copy == nullptr) {
+                return ENOMEM;
+            }
+            str = copy;
+            return 0;
+        }
+
+        virtual void free_str(const char* str) {
+            free((void*)str);
+        }
+
+        virtual int map_chunk(const void* &ptr, offset_t offset, uint32_t len) {
+            return _backend.map_chunk(ptr, offset, len);
+        }
+
+        virtual int blob_size(uint32_t &size) {
+            return _backend.blob_size(size);
+        }
+    };
+
+    PreloadBlobFS::PreloadBlobFS(BlobFS& backend)
+    : _backend(backend), _regions(nullptr), _region_count(0), _arena(nullptr), _arena_size(0)
+    {}
+
+    PreloadBlobFS::~PreloadBlobFS() {
+        free(_regions);
+        free(_arena);
+    }
+
+    int PreloadBlobFS::scan_btree(scan_state_t &state, BlobFS &fs, offset_t base, offset_t offset, uint32_t node_size, uint32_t depth) {
+        if (depth == BTREE_MAX_DEPTH || state.btree_nodes == 0) {
+            return EINVAL;
+        }
+        state.btree_nodes--;
+        state.add(base + offset, node_size);
+
+        // Each level has its own buffer, the parent's values are still being read
+        uint8_t* buffer = nullptr;
+        const uint8_t* node;
+        btree_node_t header;
+        int ret = fs.load_btree_node(node, header, buffer, offset, node_size);
+        for (uint32_t i = 0; ret == 0 && !header.leaf && i < header.count; i++) {
+            offset_t child;
+            memcpy(&child, node + sizeof(btree_node_t) + (header.count + i) * sizeof(uint32_t), sizeof(uint32_t));
+            fix_endianess(child);
+            ret = scan_btree(state, fs, base, child, node_size, depth + 1);
+        }
+        free(buffer);
+        return ret;
+    }
+
+    int PreloadBlobFS::scan_dir(scan_state_t &state, BlobFS &fs, offset_t base, const inode_data_t &dir, const superblock_t &sb) {
+        if (dir.flags & FLAG_SHARD) {
+            // Table of shard numbers, the shards are other blobs
+            state.add(base + dir.data_offset, (uint64_t)dir.data_size * sizeof(uint32_t));
+            return 0;
+        }
+        if ((dir.flags & FLAG_DEFLATE) != 0 || !state.scanned.insert(base + dir.data_offset).second) {
+            return 0;
+        }
+
+        // Corrupted sizes would wrap around
+        if ((uint64_t)dir.data_size * sizeof(dir_entry_t) > UINT32_MAX) {
+            return EINVAL;
+        }
+        uint32_t table_size = dir.data_size * sizeof(dir_entry_t);
+        state.add(base + dir.data_offset, table_size);
+        dir_ext_t ext;
+        if (fs.load_dir_ext(ext, dir) == 0 && dir.data_offset >= sb.dir_ext_size) {
+            state.add(base + dir.data_offset - sb.dir_ext_size, sb.dir_ext_size);
+            if (ext.fold_index_offset != 0) {
+                state.add(base + ext.fold_index_offset, (uint64_t)dir.data_size * sizeof(fold_entry_t));
+            }
+            if (ext.bloom_offset != 0) {
+                state.add(base + ext.bloom_offset, (uint64_t)ext.bloom_blocks * sizeof(bloom_block_t));
+            }
+            if (ext.eytzinger_offset != 0) {
+                state.add(base + ext.eytzinger_offset, (uint64_t)dir.data_size * sizeof(fold_entry_t));
+            }
+            if (ext.fingerprint_offset != 0) {
+                state.add(base + ext.fingerprint_offset, (uint64_t)dir.data_size * sizeof(uint16_t));
+            }
+            if (ext.btree_offset != 0) {
+                state.btree_nodes = 2 * dir.data_size + BTREE_MAX_DEPTH;
+                int ret = scan_btree(state, fs, base, ext.btree_offset, ext.btree_node_size, 0);
+                if (ret) {
+                    return ret;
+                }
+            }
+        }
+        if (dir.data_size == 0) {
+            return 0;
+        }
+
+        dir_entry_t* table = (dir_entry_t*)malloc(table_size);
+        if (table == nullptr) {
+            return ENOMEM;
+        }
+        int ret = fs.load_chunk(table, dir.data_offset, table_size);
+        for (uint32_t i = 0; i < dir.data_size && ret == 0; i++) {
+            dir_entry_t entry = table[i];
+            fix_endianess(entry);
+
+            const char* name;
+            ret = fs.load_str(name, entry.name_offset);
+            if (ret) {
+                break;
+            }
+            state.add(base + entry.name_offset, strlen(name) + 1);
+            fs.free_str(name);
+
+            const inode_data_t &child = entry.inode_data;
+            if (child.flags & FLAG_DIR) {
+                ret = scan_dir(state, fs, base, child, sb);
+            } else if (child.flags & FLAG_NESTED) {
+                // Lookups go through it as a SubBlobFS of this one, at the same offsets
+                if (state.scanned.insert(base + child.data_offset).second) {
+                    SubBlobFS nested(fs, child.data_offset, child.data_size);
+                    ret = scan_blob(state, nested, base + child.data_offset);
+                }
+            } else if ((child.flags & FLAG_EXT) != 0 && sb.file_ext_size != 0 && child.data_offset >= sb.file_ext_size) {
+                state.add(base + child.data_offset - sb.file_ext_size, sb.file_ext_size);
+            }
+        }
+        free(table);
+        return ret;
+    }
+
+    int PreloadBlobFS::scan_blob(scan_state_t &state, BlobFS &fs, offset_t base) {
+        inode_data_t root;
+        int ret = fs.load_chunk(&root, 0, sizeof(inode_data_t));
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(root);
+        state.add(base, sizeof(inode_data_t));
+
+        superblock_t sb;
+        memset(&sb, 0, sizeof(superblock_t));
+        if (root.flags & FLAG_SUPERBLOCK) {
+            ret = fs.superblock(sb);
+            if (ret) {
+                return ret;
+            }
+            state.add(base + sizeof(inode_data_t), sb.superblock_size);
+            state.add(base + sb.mime_table_offset, (uint64_t)sb.mime_count * sizeof(offset_t));
+            for (uint32_t mime_id = 0; mime_id < sb.mime_count; mime_id++) {
+                offset_t mime_offset;
+                ret = fs.load_chunk(&mime_offset, sb.mime_table_offset + mime_id * sizeof(offset_t), sizeof(offset_t));
+                if (ret) {
+                    return ret;
+                }
+                fix_endianess(mime_offset);
+                const char* mime_type;
+                ret = fs.load_str(mime_type, mime_offset);
+                if (ret) {
+                    return ret;
+                }
+                state.add(base + mime_offset, strlen(mime_type) + 1);
+                fs.free_str(mime_type);
+            }
+            if (sb.path_hint_offset != 0) {
+                state.add(base + sb.path_hint_offset, (uint64_t)sb.path_hint_capacity * sizeof(path_hint_t));
+            }
+            if (sb.inode_table_offset != 0) {
+                state.add(base + sb.inode_table_offset, (uint64_t)sb.inode_count * sizeof(offset_t));
+            }
+        }
+
+        if ((root.flags & FLAG_DIR) == 0) {
+            return 0;
+        }
+        root.flags &= ~FLAG_SUPERBLOCK;
+        return scan_dir(state, fs, base, root, sb);
+    }
+
+    int PreloadBlobFS::scan(scan_state_t &state) {
+        ScanWindowBlobFS windows(_backend);
+        int ret = scan_blob(state, windows, 0);
+        if (ret) {
+            return ret;
+        }
+
+        // Sorted, and merged with the ones overlapping or close enough
+        std::sort(state.ranges.begin(), state.ranges.end(), [](const range_t &a, const range_t &b) {
+            return a.offset < b.offset;
+        });
+        size_t merged = 0;
+        for (size_t i = 0; i < state.ranges.size(); i++) {
+            const range_t &range = state.ranges[i];
+            if (merged > 0) {
+                range_t &last = state.ranges[merged - 1];
+                if (range.offset <= last.offset + last.size + PRELOAD_MAX_GAP) {
+                    last.size = std::max(last.size, range.offset + range.size - last.offset);
+                    continue;
+                }
+            }
+            state.ranges[merged++] = range;
+        }
+        state.ranges.resize(merged);
+
+        for (const range_t &range : state.ranges) {
+            if (range.offset + range.size > UINT32_MAX) {
+                return EINVAL;
+            }
+        }
+        return 0;
+    }
+
+    int PreloadBlobFS::estimate(size_t &bytes) {
+        scan_state_t state;
+        int ret = scan(state);
+        if (ret) {
+            return ret;
+        }
+        bytes = state.ranges.size() * sizeof(region_t);
+        for (const range_t &range : state.ranges) {
+            bytes += range.size;
+        }
+        return 0;
+    }
+
+    int PreloadBlobFS::begin() {
+        if (_regions != nullptr) {
+            return 0;
+        }
+        scan_state_t state;
+        int ret = scan(state);
+        if (ret) {
+            return ret;
+        }
+
+        size_t arena_size = 0;
+        for (const range_t &range : state.ranges) {
+            arena_size += range.size;
+        }
+        region_t* regions = (region_t*)malloc(state.ranges.size() * sizeof(region_t) + 1);
+        uint8_t* arena = (uint8_t*)malloc(arena_size + 1);
+        if (regions == nullptr || arena == nullptr) {
+            free(regions);
+            free(arena);
+            return ENOMEM;
+        }
+
+        // A single sweep of the backend, in ascending offsets
+        size_t position = 0;
+        for (size_t i = 0; i < state.ranges.size(); i++) {
+            regions[i].offset = state.ranges[i].offset;
+            regions[i].size = state.ranges[i].size;
+            regions[i].position = position;
+            ret = _backend.load_chunk(arena + position, regions[i].offset, regions[i].size);
+            if (ret) {
+                free(regions);
+                free(arena);
+                return ret;
+            }
+            position += regions[i].size;
+        }
+
+        _regions = regions;
+        _region_count = state.ranges.size();
+        _arena = arena;
+        _arena_size = arena_size;
+        return 0;
+    }
+
+    size_t PreloadBlobFS::memory_used() {
+        return _regions == nullptr ? 0 : _arena_size + _region_count * sizeof(region_t);
+    }
+
+    int PreloadBlobFS::find_region(const region_t* &region, offset_t offset, uint32_t len) {
+        // Last region starting at or before the offset
+        uint32_t first = 0;
+        uint32_t last = _region_count;
+        while (first < last) {
+            uint32_t mid = first + (last - first) / 2;
+            if (_regions[mid].offset <= offset) {
+                first = mid + 1;
+            } else {
+                last = mid;
+            }
+        }
+        if (first == 0) {
+            return ENOENT;
+        }
+        region = &_regions[first - 1];
+        if ((uint64_t)offset + len > (uint64_t)region->offset + region->size) {
+            return ENOENT;
+        }
+        return 0;
+    }
+
+    int PreloadBlobFS::load_chunk(void* dest, offset_t offset, uint32_t len) {
+        const region_t* region;
+        if (find_region(region, offset, len) == 0) {
+            memcpy(dest, _arena + region->position + (offset - region->offset), len);
+            return 0;
+        }
+        return _backend.load_chunk(dest, offset, len);
+    }
+
+    int PreloadBlobFS::load_str(const char* &str, offset_t offset) {
+        const region_t* region;
+        if (find_region(region, offset, 1) == 0) {
+            // Names are preloaded with their terminator
+            const char* start = (const char*)_arena + region->position + (offset - region->offset);
+            if (memchr(start, '\0', region->offset + region->size - offset) != nullptr) {
+                str = start;
+                return 0;
+            }
+        }
+        return _backend.load_str(str, offset);
+    }
+
+    void PreloadBlobFS::free_str(const char* str) {
+        if ((const uint8_t*)str >= _arena && (const uint8_t*)str < _arena + _arena_size) {
+            return;
+        }
+        _backend.free_str(str);
+    }
+
+    int PreloadBlobFS::map_chunk(const void* &ptr, offset_t offset, uint32_t len) {
+        const region_t* region;
+        if (find_region(region, offset, len) == 0) {
+            ptr = _arena + region->position + (offset - region->offset);
+            return 0;
+        }
+        return _backend.map_chunk(ptr, offset, len);
+    }
+
+    int PreloadBlobFS::blob_size(uint32_t &size) {
+        return _backend.blob_size(size);
+    }
+
+    void PreloadBlobFS::prefetch(offset_t offset, uint32_t len) {
+        const region_t* region;
+        if (find_region(region, offset, len) != 0) {
+            _backend.prefetch(offset, len);
+        }
+    }
+
+    bool PreloadBlobFS::supports_prefetch() {
+        return _backend.supports_prefetch();
+    }
+}
@@ -0,0 +1,108 @@
+# pragma once
+#include "blobfs.h"
+#include <cstddef>
+
+namespace blobfs {
+    /** Regions of metadata closer than this are preloaded together, with the bytes between them */
+    constexpr uint32_t PRELOAD_MAX_GAP = 64;
+
+    /** `begin` discovers the metadata by reading the backend in aligned windows of this size, instead of entry by entry */
+    constexpr uint32_t PRELOAD_SCAN_WINDOW_SIZE = 16 * 1024;
+
+    /** Number of windows kept while discovering the metadata, e.g. for the names, the entries and the indexes */
+    constexpr uint32_t PRELOAD_SCAN_WINDOWS = 4;
+
+    /**
+     * Preloads all the metadata of a blob in RAM at mount time, for slow backends (SPI flash, network, ...)
+     *
+     * `begin` finds the metadata of the blob: the superblock, the MIME table, the path hints, the inode table, the
+     * entries and extension records of every directory, their indexes, the names, and the extension records of files,
+     * also in nested blobs.
+     * Discovery reads the backend through a few large windows (`PRELOAD_SCAN_WINDOW_SIZE`), so the many small reads of
+     * entries and names cost a load per window rather than one each.
+     * It then copies them with a single sweep of the backend, in ascending offsets, merging nearby regions. Afterwards,
+     * `lookup`, `stat`, `readdir` and the directory indexes are served from RAM, and only file contents are read from
+     * the backend.
+     *
+     * Names and directory tables are kept as stored, where they are already deduplicated and densely packed, so every
+     * lookup path of BlobFS works unchanged, and memory-mapped reads point to the copies. A `RamDirIndex` can still be
+     * set to hash the names of directories without indexes.
+     *
+     * It wraps another BlobFS, which is used as the backend:
+     *
+     *     SpiFlashBlobFS backend(...);
+     *     PreloadBlobFS fs(backend);
+     *     size_t bytes;
+     *     if (fs.estimate(bytes) == 0 && bytes < budget) {
+     *         fs.begin();
+     *     }
+     *
+     * Until `begin` succeeds, everything is read from the backend.
+     */
+    class PreloadBlobFS : public BlobFS {
+    protected:
+        /** A chunk of the blob copied in RAM */
+        typedef struct {
+            offset_t offset;
+            uint32_t size;
+            /** Position of the copy in `_arena` */
+            size_t position;
+        } region_t;
+
+        BlobFS& _backend;
+        /** Sorted by offset, never overlapping */
+        region_t* _regions;
+        uint32_t _region_count;
+        uint8_t* _arena;
+        size_t _arena_size;
+
+        /** A chunk of metadata found by `scan_blob`, before they are merged in regions */
+        typedef struct {
+            uint64_t offset;
+            uint64_t size;
+        } range_t;
+        struct scan_state;
+        typedef struct scan_state scan_state_t;
+        class ScanWindowBlobFS;
+
+        int find_region(const region_t* &region, offset_t offset, uint32_t len);
+        int scan(scan_state_t &state);
+        static int scan_blob(scan_state_t &state, BlobFS &fs, offset_t base);
+        static int scan_dir(scan_state_t &state, BlobFS &fs, offset_t base, const inode_data_t &dir, const superblock_t &sb);
+        static int scan_btree(scan_state_t &state, BlobFS &fs, offset_t base, offset_t offset, uint32_t node_size, uint32_t depth);
+
+    public:
+        PreloadBlobFS(BlobFS& backend);
+        ~PreloadBlobFS();
+
+        /**
+         * Returns the number of bytes of RAM `begin` would use, without copying anything
+         *
+         * It has to read the directories and names of the whole blob to find them, so it costs about as much as `begin`.
+         *
+         * @param[out] bytes Size of the preloaded metadata, and of the table of regions
+         * @return 0 on success, or errno
+         */
+        int estimate(size_t &bytes);
+
+        /**
+         * Finds and preloads the metadata of the blob
+         *
+         * @return 0 on success, or errno -- The backend keeps being used for everything on failure
+         */
+        int begin();
+
+        /**
+         * Returns the number of bytes used by the preloaded metadata, 0 before `begin`
+         */
+        size_t memory_used();
+
+        virtual int load_chunk(void* dest, offset_t offset, uint32_t len);
+        virtual int load_str(const char* &str, offset_t offset);
+        virtual void free_str(const char* str);
+        virtual int map_chunk(const void* &ptr, offset_t offset, uint32_t len);
+        virtual int blob_size(uint32_t &size);
+        virtual void prefetch(offset_t offset, uint32_t len);
+        virtual bool supports_prefetch();
+    };
+}
@@ -0,0 +1,164 @@
+#include "ram_dir_index.h"
+#include "byteorder.h"
+#include <cstring>
+#include <cstdlib>
+
+namespace blobfs {
+    namespace {
+        typedef struct {
+            RamDirIndex* index;
+            BlobFS* blobfs;
+        } build_arg_t;
+    }
+
+    RamDirIndex::RamDirIndex(uint32_t min_entries, size_t memory_budget)
+    : _min_entries(min_entries), _memory_budget(memory_budget), _memory_used(0)
+    {
+        memset(_buckets, 0, sizeof(_buckets));
+    }
+
+    RamDirIndex::~RamDirIndex() {
+        for (uint32_t i = 0; i < RAM_DIR_INDEX_BUCKETS; i++) {
+            table_t* table = _buckets[i];
+            while (table != nullptr) {
+                table_t* next = table->next;
+                free(table);
+                table = next;
+            }
+        }
+    }
+
+    uint32_t RamDirIndex::bucket_for(offset_t dir_offset) {
+        return (dir_offset * 2654435761u) % RAM_DIR_INDEX_BUCKETS;
+    }
+
+    RamDirIndex::table_t* RamDirIndex::table_for(offset_t dir_offset) {
+        for (table_t* table = __atomic_load_n(&_buckets[bucket_for(dir_offset)], __ATOMIC_ACQUIRE); table != nullptr; table = table->next) {
+            if (table->dir_offset == dir_offset) {
+                return table;
+            }
+        }
+        return nullptr;
+    }
+
+    int RamDirIndex::build_table(BlobFS &blobfs, const inode_data_t &dir) {
+        // At most half full, so that probes stay short and always reach an empty slot
+        uint64_t capacity = 1;
+        while (capacity < 2 * (uint64_t)dir.data_size) {
+            capacity <<= 1;
+        }
+        uint64_t size = sizeof(table_t) + capacity * sizeof(slot_t);
+        if (size > _memory_budget || capacity > 0x80000000u) {
+            return ENOSYS;
+        }
+        if (__atomic_add_fetch(&_memory_used, (size_t)size, __ATOMIC_SEQ_CST) > _memory_budget) {
+            __atomic_sub_fetch(&_memory_used, (size_t)size, __ATOMIC_SEQ_CST);
+            return ENOSYS;
+        }
+        table_t* table = (table_t*)malloc(size);
+        if (table == nullptr) {
+            // Lookups can still scan the directory
+            __atomic_sub_fetch(&_memory_used, (size_t)size, __ATOMIC_SEQ_CST);
+            return ENOSYS;
+        }
+        table->dir_offset = dir.data_offset;
+        table->capacity = capacity;
+        table->slots = (slot_t*)(table + 1);
+        memset(table->slots, 0, capacity * sizeof(slot_t));
+
+        uint32_t mask = capacity - 1;
+        for (uint32_t index = 0; index < dir.data_size; index++) {
+            offset_t name_offset;
+            int ret = blobfs.load_chunk(&name_offset, dir.data_offset + index * sizeof(dir_entry_t) + offsetof(dir_entry_t, name_offset), sizeof(offset_t));
+            const char* name;
+            if (ret == 0) {
+                fix_endianess(name_offset);
+                ret = blobfs.load_str(name, name_offset);
+            }
+            if (ret) {
+                free(table);
+                __atomic_sub_fetch(&_memory_used, (size_t)size, __ATOMIC_SEQ_CST);
+                return ret;
+            }
+            uint32_t hash = BlobFS::fold_hash(name);
+            blobfs.free_str(name);
+
+            uint32_t slot = hash & mask;
+            while (table->slots[slot].index != 0) {
+                slot = (slot + 1) & mask;
+            }
+            table->slots[slot].hash = hash;
+            table->slots[slot].index = index + 1;
+        }
+
+        // Racing threads might both index it, which only wastes memory until the index is destroyed
+        table_t** bucket = &_buckets[bucket_for(dir.data_offset)];
+        table->next = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(bucket, &table->next, table, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {}
+        return 0;
+    }
+
+    int RamDirIndex::find(uint32_t &index, BlobFS &blobfs, const inode_data_t &dir, const char* name, bool folded) {
+        if (dir.data_size < _min_entries) {
+            return ENOSYS;
+        }
+        table_t* table = table_for(dir.data_offset);
+        if (table == nullptr) {
+            int ret = build_table(blobfs, dir);
+            if (ret) {
+                return ret;
+            }
+            table = table_for(dir.data_offset);
+        }
+
+        uint32_t hash = BlobFS::fold_hash(name);
+        uint32_t mask = table->capacity - 1;
+        for (uint32_t slot = hash & mask; table->slots[slot].index != 0; slot = (slot + 1) & mask) {
+            if (table->slots[slot].hash != hash) {
+                continue;
+            }
+            uint32_t entry_index = table->slots[slot].index - 1;
+            offset_t name_offset;
+            int ret = blobfs.load_chunk(&name_offset, dir.data_offset + entry_index * sizeof(dir_entry_t) + offsetof(dir_entry_t, name_offset), sizeof(offset_t));
+            if (ret) {
+                return ret;
+            }
+            fix_endianess(name_offset);
+            const char* entry_name;
+            ret = blobfs.load_str(entry_name, name_offset);
+            if (ret) {
+                return ret;
+            }
+            bool equal = folded ? BlobFS::fold_equal(name, entry_name) : strcmp(name, entry_name) == 0;
+            blobfs.free_str(entry_name);
+            if (equal) {
+                index = entry_index;
+                return 0;
+            }
+        }
+        return ENOENT;
+    }
+
+    int RamDirIndex::build_visitor(void* arg, const char* /*path*/, inode_t /*inode*/, const inode_data_t &inode_data, uint32_t /*depth*/) {
+        build_arg_t* build_arg = (build_arg_t*)arg;
+        RamDirIndex* index = build_arg->index;
+        if ((inode_data.flags & FLAG_DIR) == 0 || (inode_data.flags & (FLAG_DEFLATE | FLAG_SHARD)) != 0) {
+            return 0;
+        }
+        if (inode_data.data_size < index->_min_entries || index->table_for(inode_data.data_offset) != nullptr) {
+            return 0;
+        }
+        int ret = index->build_table(*build_arg->blobfs, inode_data);
+        // Out of budget: Smaller directories might still fit
+        return ret == ENOSYS ? 0 : ret;
+    }
+
+    int RamDirIndex::build(BlobFS &blobfs) {
+        build_arg_t arg = {this, &blobfs};
+        return blobfs.walk("/", build_visitor, &arg);
+    }
+
+    size_t RamDirIndex::memory_used() {
+        return __atomic_load_n(&_memory_used, __ATOMIC_SEQ_CST);
+    }
+}
@@ -0,0 +1,75 @@
+# pragma once
+
+#include "blobfs.h"
+#include <cstddef>
+
+namespace blobfs {
+    /** Number of lists the indexed directories are spread across */
+    constexpr uint32_t RAM_DIR_INDEX_BUCKETS = 64;
+
+    /**
+     * A DirIndex building hash tables of the entries of big directories in RAM, for blobs whose lookups scan directories
+     *
+     * Each table maps `BlobFS::fold_hash` of the names to their position, with open addressing, so the same table serves
+     * exact and case-insensitive lookups. Tables are built the first time a directory is looked up, or all at once by
+     * `build`, as long as they fit in the memory budget. Nothing changes in the blob format.
+     *
+     * Lookups are thread-safe, and never take a lock.
+     *
+     *     RamDirIndex index(64, 256 * 1024);
+     *     blobfs.set_dir_index(&index);
+     */
+    class RamDirIndex : public DirIndex {
+    protected:
+        typedef struct {
+            /** `fold_hash` of the entry's name */
+            uint32_t hash;
+            /** Position of the entry in the directory plus one, or 0 if the slot is empty */
+            uint32_t index;
+        } slot_t;
+
+        typedef struct table {
+            /** Offset of the entries of the directory */
+            offset_t dir_offset;
+            /** Number of slots, a power of 2 */
+            uint32_t capacity;
+            struct table* next;
+            slot_t* slots;
+        } table_t;
+
+        uint32_t _min_entries;
+        size_t _memory_budget;
+        size_t _memory_used;
+        table_t* _buckets[RAM_DIR_INDEX_BUCKETS];
+
+        static uint32_t bucket_for(offset_t dir_offset);
+        table_t* table_for(offset_t dir_offset);
+        int build_table(BlobFS &blobfs, const inode_data_t &dir);
+        static int build_visitor(void* arg, const char* path, inode_t inode, const inode_data_t &inode_data, uint32_t depth);
+
+    public:
+        /**
+         * @param[in] min_entries Smaller directories are not indexed, scanning them is cheap enough
+         * @param[in] memory_budget Maximum number of bytes used by the tables
+         */
+        RamDirIndex(uint32_t min_entries = 64, size_t memory_budget = 64 * 1024);
+        virtual ~RamDirIndex();
+
+        /**
+         * Indexes every directory of the blob with at least `min_entries` entries, e.g. at mount time
+         *
+         * Directories are indexed in walk order until the memory budget runs out, the others keep being scanned.
+         *
+         * @param[in] blobfs The blob
+         * @return 0 on success, or errno
+         */
+        int build(BlobFS &blobfs);
+
+        /**
+         * Returns the number of bytes used by the tables
+         */
+        size_t memory_used();
+
+        virtual int find(uint32_t &index, BlobFS &blobfs, const inode_data_t &dir, const char* name, bool folded);
+    };
+}
@@ -0,0 +1,101 @@
+#include "sha256.h"
+#include <cstring>
+
+namespace blobfs {
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+
+    static inline uint32_t rotr(uint32_t x, uint32_t n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    Sha256::Sha256()
+    : _state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+      _length(0), _buffered(0)
+    {}
+
+    void Sha256::process_block(const uint8_t* block) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i + 1] << 16 | (uint32_t)block[4*i + 2] << 8 | block[4*i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+        uint32_t e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        _state[0] += a; _state[1] += b; _state[2] += c; _state[3] += d;
+        _state[4] += e; _state[5] += f; _state[6] += g; _state[7] += h;
+    }
+
+    void Sha256::update(const void* data, uint32_t size) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        _length += size;
+
+        if (_buffered) {
+            uint32_t n = 64 - _buffered < size ? 64 - _buffered : size;
+            memcpy(_buffer + _buffered, bytes, n);
+            _buffered += n;
+            bytes += n;
+            size -= n;
+            if (_buffered < 64) {
+                return;
+            }
+            process_block(_buffer);
+            _buffered = 0;
+        }
+        while (size >= 64) {
+            process_block(bytes);
+            bytes += 64;
+            size -= 64;
+        }
+        memcpy(_buffer, bytes, size);
+        _buffered = size;
+    }
+
+    void Sha256::finish(uint8_t* digest) {
+        uint64_t bit_length = _length * 8;
+        uint8_t padding[128] = {0x80};
+        uint32_t padding_size = (_buffered < 56 ? 56 : 120) - _buffered;
+        for (int i = 0; i < 8; i++) {
+            padding[padding_size + i] = (uint8_t)(bit_length >> (56 - 8 * i));
+        }
+        update(padding, padding_size + 8);
+
+        for (int i = 0; i < 8; i++) {
+            digest[4*i] = _state[i] >> 24;
+            digest[4*i + 1] = _state[i] >> 16;
+            digest[4*i + 2] = _state[i] >> 8;
+            digest[4*i + 3] = _state[i];
+        }
+    }
+
+    void Sha256::hash(uint8_t* digest, const void* data, uint32_t size) {
+        Sha256 sha;
+        sha.update(data, size);
+        sha.finish(digest);
+    }
+}
@@ -0,0 +1,46 @@
+# pragma once
+#include <cinttypes>
+
+namespace blobfs {
+    /** Size of a SHA-256 digest */
+    constexpr uint32_t SHA256_SIZE = 32;
+
+    /**
+     * Minimal SHA-256 implementation, so that integrity checks don't depend on a crypto library
+     */
+    class Sha256 {
+        uint32_t _state[8];
+        uint64_t _length;
+        uint8_t _buffer[64];
+        uint32_t _buffered;
+
+        void process_block(const uint8_t* block);
+
+    public:
+        Sha256();
+
+        /**
+         * Appends data to the hashed message
+         *
+         * @param[in] data Data being hashed
+         * @param[in] size Size of `data`
+         */
+        void update(const void* data, uint32_t size);
+
+        /**
+         * Returns the digest of all the data passed to `update`
+         *
+         * @param[out] digest Buffer of SHA256_SIZE bytes
+         */
+        void finish(uint8_t* digest);
+
+        /**
+         * Computes the digest of a buffer
+         *
+         * @param[out] digest Buffer of SHA256_SIZE bytes
+         * @param[in] data Data being hashed
+         * @param[in] size Size of `data`
+         */
+        static void hash(uint8_t* digest, const void* data, uint32_t size);
+    };
+}
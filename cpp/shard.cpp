@@ -0,0 +1,305 @@
+#include "shard.h"
+#include "byteorder.h"
+#include <cstring>
+#include <cstdlib>
+
+namespace blobfs {
+    uint32_t shard_for_name(const char* name) {
+        return BlobFS::fold_hash(name);
+    }
+
+
+
+
+    // ================= Sharded FS =================
+
+    ShardedBlobFS::ShardedBlobFS(BlobFS& index, ShardSource& source)
+    : _index(index), _source(source), _shard_count(0), _shards(nullptr), _case_insensitive(false)
+    {}
+
+    ShardedBlobFS::~ShardedBlobFS() {
+        for (uint32_t shard = 0; shard < _shard_count; shard++) {
+            if (_shards[shard] != nullptr) {
+                _source.close_shard(_shards[shard], shard);
+            }
+        }
+        free(_shards);
+    }
+
+    int ShardedBlobFS::begin() {
+        superblock_t sb;
+        int ret = _index.superblock(sb);
+        if (ret) {
+            return ret;
+        }
+        if (sb.shard_count == 0) {
+            return ENODATA;  // Not a root index
+        }
+        _shards = (BlobFS**)calloc(sb.shard_count, sizeof(BlobFS*));
+        if (_shards == nullptr) {
+            return ENOMEM;
+        }
+        _shard_count = sb.shard_count;
+        return 0;
+    }
+
+    int ShardedBlobFS::shard(BlobFS* &blobfs, uint32_t shard) {
+        if (shard == SHARD_INDEX) {
+            blobfs = &_index;
+            return 0;
+        }
+        if (shard >= _shard_count) {
+            return EINVAL;
+        }
+        blobfs = __atomic_load_n(&_shards[shard], __ATOMIC_ACQUIRE);
+        if (blobfs != nullptr) {
+            return 0;
+        }
+
+        BlobFS* opened;
+        int ret = _source.open_shard(opened, shard);
+        if (ret) {
+            return ret;
+        }
+        BlobFS* expected = nullptr;
+        if (!__atomic_compare_exchange_n(&_shards[shard], &expected, opened, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // Opened concurrently by someone else
+            _source.close_shard(opened, shard);
+            opened = expected;
+        }
+        blobfs = opened;
+        return 0;
+    }
+
+    uint32_t ShardedBlobFS::opened_shards() {
+        uint32_t opened = 0;
+        for (uint32_t shard = 0; shard < _shard_count; shard++) {
+            opened += __atomic_load_n(&_shards[shard], __ATOMIC_ACQUIRE) != nullptr;
+        }
+        return opened;
+    }
+
+    int ShardedBlobFS::shard_table(uint32_t &shard, const inode_data_t &inode_data, uint32_t index) {
+        int ret = _index.load_chunk(&shard, inode_data.data_offset + index * sizeof(uint32_t), sizeof(uint32_t));
+        if (ret) {
+            return ret;
+        }
+        fix_endianess(shard);
+        return 0;
+    }
+
+    int ShardedBlobFS::resolve(shard_inode_t &inode, inode_data_t &inode_data) {
+        BlobFS* blobfs;
+        int ret = shard(blobfs, inode.shard);
+        if (ret) {
+            return ret;
+        }
+        ret = blobfs->stat(inode_data, inode.inode);
+        if (ret) {
+            return ret;
+        }
+
+        // A subtree stored entirely in a shard is the root of that shard
+        if (inode.shard == SHARD_INDEX && (inode_data.flags & FLAG_SHARD) != 0 && inode_data.data_size == 1) {
+            ret = shard_table(inode.shard, inode_data, 0);
+            if (ret) {
+                return ret;
+            }
+            inode.inode = 0;
+            ret = shard(blobfs, inode.shard);
+            if (ret) {
+                return ret;
+            }
+            return blobfs->stat(inode_data, 0);
+        }
+        return 0;
+    }
+
+    int ShardedBlobFS::lookup_child(shard_inode_t &child, const shard_inode_t &parent, const char* name) {
+        BlobFS* blobfs;
+        int ret = shard(blobfs, parent.shard);
+        if (ret) {
+            return ret;
+        }
+        inode_data_t parent_data;
+        ret = blobfs->stat(parent_data, parent.inode);
+        if (ret) {
+            return ret;
+        }
+
+        child = parent;
+        if (parent.shard == SHARD_INDEX && (parent_data.flags & FLAG_SHARD) != 0) {
+            // Partitioned directory: Only the shard its name hashes to is opened
+            ret = shard_table(child.shard, parent_data, shard_for_name(name) % parent_data.data_size);
+            if (ret) {
+                return ret;
+            }
+            child.inode = 0;
+            ret = shard(blobfs, child.shard);
+            if (ret) {
+                return ret;
+            }
+        }
+        if (_case_insensitive) {
+            ret = blobfs->lookup_child_folded(child.inode, child.inode, name);
+        } else {
+            ret = blobfs->lookup_child(child.inode, child.inode, name);
+        }
+        if (ret) {
+            return ret;
+        }
+        inode_data_t child_data;
+        return resolve(child, child_data);
+    }
+
+    int ShardedBlobFS::lookup(shard_inode_t &inode, const char* path) {
+        // Path must start with "/"
+        if (path == nullptr || path[0] != '/') {
+            return ENOENT;
+        }
+        inode.shard = SHARD_INDEX;
+        inode.inode = 0;
+        inode_data_t inode_data;
+        int ret = resolve(inode, inode_data);
+        if (ret) {
+            return ret;
+        }
+
+        const char* chunk_start = path + 1;
+        for (const char* chunk_end=chunk_start; ; chunk_end++) {
+            char endchar = *chunk_end;
+            if ((endchar == '/') || (endchar == '\0')) {
+                if (chunk_end != chunk_start) { // Ignore empty chunks -- .e.g "/foo//bar/" == "/foo/bar"
+                    size_t chunk_size = chunk_end - chunk_start;
+                    char* chunk_name = (char*)malloc(chunk_size + 1);
+                    if (chunk_name == nullptr) {
+                        return ENOMEM;
+                    }
+                    memcpy(chunk_name, chunk_start, chunk_size);
+                    chunk_name[chunk_size] = '\0';
+
+                    ret = lookup_child(inode, inode, chunk_name);
+                    free(chunk_name);
+
+                    if (ret) {
+                        return ret;
+                    }
+                }
+                chunk_start = chunk_end + 1;
+            }
+            if (endchar == '\0') {
+                break;
+            }
+        }
+
+        return 0;
+    }
+
+    int ShardedBlobFS::stat(inode_data_t &inode_data, const shard_inode_t &inode) {
+        BlobFS* blobfs;
+        int ret = shard(blobfs, inode.shard);
+        if (ret) {
+            return ret;
+        }
+        return blobfs->stat(inode_data, inode.inode);
+    }
+
+    int ShardedBlobFS::open(FileHandle* &file, const char* path) {
+        shard_inode_t inode;
+        int ret = lookup(inode, path);
+        if (ret) {
+            return ret;
+        }
+        BlobFS* blobfs;
+        ret = shard(blobfs, inode.shard);
+        if (ret) {
+            return ret;
+        }
+        return blobfs->open(file, inode.inode);
+    }
+
+    int ShardedBlobFS::opendir(ShardedDirHandle* &dir, const char* path) {
+        shard_inode_t inode;
+        int ret = lookup(inode, path);
+        if (ret) {
+            return ret;
+        }
+        BlobFS* blobfs;
+        ret = shard(blobfs, inode.shard);
+        if (ret) {
+            return ret;
+        }
+        inode_data_t inode_data;
+        ret = blobfs->stat(inode_data, inode.inode);
+        if (ret) {
+            return ret;
+        }
+
+        ShardedDirHandle* handle = new ShardedDirHandle(*this);
+        if (inode.shard == SHARD_INDEX && (inode_data.flags & FLAG_SHARD) != 0) {
+            // Shards are opened one after the other, as the listing reaches them
+            handle->_inode_data = inode_data;
+            handle->_ways = inode_data.data_size;
+        } else {
+            handle->_shard = inode.shard;
+            ret = blobfs->opendir(handle->_dir, inode.inode);
+            if (ret) {
+                delete handle;
+                return ret;
+            }
+        }
+        dir = handle;
+        return 0;
+    }
+
+
+
+
+    // ================= Sharded Directory Handle =================
+
+    ShardedDirHandle::ShardedDirHandle(ShardedBlobFS& fs)
+    : _fs(fs), _ways(0), _way(0), _shard(SHARD_INDEX), _dir(nullptr)
+    {}
+
+    ShardedDirHandle::~ShardedDirHandle() {
+        delete _dir;
+    }
+
+    int ShardedDirHandle::readdir(dir_entry_t &direntry, shard_inode_t &inode, const char* &name) {
+        while (true) {
+            if (_dir == nullptr) {
+                if (_way >= _ways) {
+                    return ENOENT;
+                }
+                int ret = _fs.shard_table(_shard, _inode_data, _way++);
+                BlobFS* blobfs;
+                if (ret == 0) {
+                    ret = _fs.shard(blobfs, _shard);
+                }
+                if (ret == 0) {
+                    ret = blobfs->opendir(_dir, (inode_t)0);
+                }
+                if (ret) {
+                    return ret;
+                }
+            }
+
+            int ret = _dir->readdir(direntry, inode.inode, name);
+            if (ret == ENOENT && _ways > 0) {
+                // Next shard
+                delete _dir;
+                _dir = nullptr;
+                continue;
+            }
+            inode.shard = _shard;
+            return ret;
+        }
+    }
+
+    void ShardedDirHandle::free_str(const shard_inode_t &inode, const char* name) {
+        BlobFS* blobfs;
+        if (_fs.shard(blobfs, inode.shard) == 0) {
+            blobfs->free_str(name);
+        }
+    }
+}
@@ -0,0 +1,195 @@
+# pragma once
+#include "blobfs.h"
+
+namespace blobfs {
+    /** Value of `shard_inode_t::shard` for inodes of the root index */
+    constexpr uint32_t SHARD_INDEX = 0xffffffff;
+
+    /**
+     * Hash used to route the entries of a directory with FLAG_SHARD to a shard: `BlobFS::fold_hash`
+     *
+     * Names only differing by case go to the same shard, so that case-insensitive lookups find them.
+     *
+     * @param[in] name Name of the entry
+     * @return The hash, to be taken modulo the number of shards of the directory
+     */
+    uint32_t shard_for_name(const char* name);
+
+    /** An inode on a sharded filesystem */
+    typedef struct {
+        /** Shard where the inode is stored, or SHARD_INDEX */
+        uint32_t shard;
+        /** The inode on that shard */
+        inode_t inode;
+    } shard_inode_t;
+
+    /**
+     * Opens the shards of a ShardedBlobFS on demand
+     *
+     * Shards can live on different backends, e.g., some in flash and others in files or over the network.
+     */
+    class ShardSource {
+    public:
+        virtual ~ShardSource() {}
+
+        /**
+         * Opens a shard
+         *
+         * Might be called concurrently for the same shard, the extra copies are closed with `close_shard`.
+         *
+         * @param[out] blobfs The shard
+         * @param[in] shard Number of the shard
+         * @return 0 on success, or errno
+         */
+        virtual int open_shard(BlobFS* &blobfs, uint32_t shard) = 0;
+
+        /**
+         * Closes a shard opened by `open_shard`
+         *
+         * @param[in] blobfs The shard
+         * @param[in] shard Number of the shard
+         */
+        virtual void close_shard(BlobFS* /*blobfs*/, uint32_t /*shard*/) {}
+    };
+
+    class ShardedDirHandle;
+
+    /**
+     * A filesystem split across several blobs
+     *
+     * A small root index (a regular blob) has the top of the tree, and directories with FLAG_SHARD route their contents
+     * to other blobs: A whole subtree can be stored in the root of a shard, or the entries of a big directory can be
+     * partitioned across several shards by the hash of their names.
+     *
+     * Shards are only opened when a lookup reaches them.
+     */
+    class ShardedBlobFS {
+    protected:
+        friend class ShardedDirHandle;
+
+        BlobFS& _index;
+        ShardSource& _source;
+        uint32_t _shard_count;
+        /** Shards opened so far, or nullptr */
+        BlobFS** _shards;
+        bool _case_insensitive;
+
+        int resolve(shard_inode_t &inode, inode_data_t &inode_data);
+        int lookup_child(shard_inode_t &child, const shard_inode_t &parent, const char* name);
+        int shard_table(uint32_t &shard, const inode_data_t &inode_data, uint32_t index);
+
+    public:
+        ShardedBlobFS(BlobFS& index, ShardSource& source);
+        ~ShardedBlobFS();
+
+        /**
+         * Reads the number of shards from the root index
+         *
+         * @return 0 on success, or errno
+         */
+        int begin();
+
+        /**
+         * Returns a shard, opening it if needed
+         *
+         * @param[out] blobfs The shard
+         * @param[in] shard Number of the shard, or SHARD_INDEX for the root index
+         * @return 0 on success, or errno
+         */
+        int shard(BlobFS* &blobfs, uint32_t shard);
+
+        /**
+         * Makes path lookups ignore the case of ASCII letters, as `BlobFS::set_case_insensitive` does
+         *
+         * The index and the shards must have been built with case-folded name indexes.
+         *
+         * @param[in] case_insensitive Whether `lookup` uses `lookup_child_folded` instead of `lookup_child`
+         */
+        inline void set_case_insensitive(bool case_insensitive) {
+            _case_insensitive = case_insensitive;
+        }
+
+        /**
+         * Returns how many shards were opened so far
+         */
+        uint32_t opened_shards();
+
+        /**
+         * Lookup an inode from an absolute path
+         *
+         * @param[out] inode The inode, if found
+         * @param[in] path Full path to the inode being looked up
+         * @return 0 on success, or errno
+         */
+        int lookup(shard_inode_t &inode, const char* path);
+
+        /**
+         * Returns all the metadata of the specified inode
+         *
+         * @param[out] inode_data metadata of the specified inode
+         * @param[in] inode The inode being queried
+         * @return 0 on success, or errno
+         */
+        int stat(inode_data_t &inode_data, const shard_inode_t &inode);
+
+        /**
+         * Opens a file for reading
+         *
+         * After use, the file handle must be released with `delete file`
+         *
+         * @param[out] file the file handle.
+         * @param[in] path The path of the file in the filesystem
+         * @return 0 on success, or errno
+         */
+        int open(FileHandle* &file, const char* path);
+
+        /**
+         * Opens the directory for listing files
+         *
+         * Directories partitioned across shards are listed one shard after the other, so they are not sorted by name.
+         * After use, the directory handle must be released with `delete dir`
+         *
+         * @param[out] dir the directory handle.
+         * @param[in] path The path of the directory in the filesystem
+         * @return 0 on success, or errno
+         */
+        int opendir(ShardedDirHandle* &dir, const char* path);
+    };
+
+    /**
+     * Lists a directory of a ShardedBlobFS
+     */
+    class ShardedDirHandle {
+    protected:
+        friend class ShardedBlobFS;
+
+        ShardedBlobFS& _fs;
+        /** Directory with FLAG_SHARD being listed, or a regular directory if `_ways` is 0 */
+        inode_data_t _inode_data;
+        uint32_t _ways;
+        /** Index in the shard table of the shard being listed */
+        uint32_t _way;
+        uint32_t _shard;
+        DirHandle* _dir;
+
+        ShardedDirHandle(ShardedBlobFS& fs);
+
+    public:
+        ~ShardedDirHandle();
+
+        /**
+         * Reads the next entry in this directory
+         *
+         * @param[out] direntry The data associated with the entry
+         * @param[out] inode The inode associated with the entry
+         * @param[out] name Name of the entry, must be released with `free_str(inode, name)`
+         * @return 0 on success, ENOENT if it reached the end of the list of entries, or errno
+         */
+        int readdir(dir_entry_t &direntry, shard_inode_t &inode, const char* &name);
+
+        /**
+         * Releases a name returned by readdir
+         */
+        void free_str(const shard_inode_t &inode, const char* name);
+    };
+}
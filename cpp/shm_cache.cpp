@@ -0,0 +1,259 @@
+#if defined(__linux__)
+
+#include "shm_cache.h"
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace blobfs {
+    /** Set once a segment is fully initialized */
+    constexpr uint32_t SHM_CACHE_MAGIC = 0x43534642;  // "BFSC"
+
+    /** How long to wait for another process to initialize a segment, in milliseconds */
+    constexpr uint32_t SHM_CACHE_INIT_TIMEOUT = 1000;
+
+    static inline uint32_t set_for_key(uint64_t key, uint32_t sets) {
+        return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) % sets;
+    }
+
+    ShmBlockCache::ShmBlockCache()
+    : _fd(-1), _mem(nullptr), _mem_size(0), _header(nullptr), _slots(nullptr), _data(nullptr)
+    {}
+
+    ShmBlockCache::~ShmBlockCache() {
+        close();
+    }
+
+    void ShmBlockCache::close() {
+        if (_mem != nullptr) {
+            munmap(_mem, _mem_size);
+            _mem = nullptr;
+        }
+        if (_fd >= 0) {
+            ::close(_fd);
+            _fd = -1;
+        }
+        _header = nullptr;
+        _slots = nullptr;
+        _data = nullptr;
+    }
+
+    size_t ShmBlockCache::segment_size(uint32_t slot_count, uint32_t block_size) {
+        size_t data_offset = (64 + (size_t)slot_count * sizeof(slot_t) + 4095) & ~(size_t)4095;
+        return data_offset + (size_t)slot_count * block_size;
+    }
+
+    void ShmBlockCache::map_layout() {
+        _header = (header_t*)_mem;
+        _slots = (slot_t*)((uint8_t*)_mem + 64);
+        _data = (uint8_t*)_mem + segment_size(_header->slot_count, 0);
+    }
+
+    int ShmBlockCache::open(const char* name, uint64_t blob_id, uint32_t slot_count, uint32_t block_size) {
+        close();
+        if (slot_count == 0 || block_size == 0) {
+            return EINVAL;
+        }
+        slot_count = (slot_count + SHM_CACHE_WAYS - 1) / SHM_CACHE_WAYS * SHM_CACHE_WAYS;
+
+        if (name == nullptr) {
+            _fd = memfd_create("blobfs-cache", MFD_CLOEXEC);
+            if (_fd < 0) {
+                return errno;
+            }
+            return create(blob_id, slot_count, block_size);
+        }
+
+        // Whoever creates the object initializes it, everyone else waits for it
+        _fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (_fd >= 0) {
+            return create(blob_id, slot_count, block_size);
+        }
+        if (errno != EEXIST) {
+            return errno;
+        }
+        _fd = shm_open(name, O_RDWR, 0);
+        if (_fd < 0) {
+            return errno;
+        }
+        return attach(blob_id);
+    }
+
+    int ShmBlockCache::open(int fd, uint64_t blob_id) {
+        close();
+        _fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (_fd < 0) {
+            return errno;
+        }
+        return attach(blob_id);
+    }
+
+    int ShmBlockCache::create(uint64_t blob_id, uint32_t slot_count, uint32_t block_size) {
+        size_t size = segment_size(slot_count, block_size);
+        if (ftruncate(_fd, size) != 0) {
+            int ret = errno;
+            close();
+            return ret;
+        }
+        _mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (_mem == MAP_FAILED) {
+            int ret = errno;
+            _mem = nullptr;
+            close();
+            return ret;
+        }
+        _mem_size = size;
+
+        // The segment starts zeroed, i.e., with all slots empty
+        header_t* header = (header_t*)_mem;
+        header->slot_count = slot_count;
+        header->block_size = block_size;
+        header->blob_id = blob_id;
+        __atomic_store_n(&header->magic, SHM_CACHE_MAGIC, __ATOMIC_RELEASE);
+        map_layout();
+        return 0;
+    }
+
+    int ShmBlockCache::attach(uint64_t blob_id) {
+        struct stat st;
+        uint32_t waited = 0;
+        while (true) {
+            if (fstat(_fd, &st) != 0) {
+                int ret = errno;
+                close();
+                return ret;
+            }
+            if ((size_t)st.st_size >= sizeof(header_t)) {
+                break;
+            }
+            if (waited++ >= SHM_CACHE_INIT_TIMEOUT) {
+                close();
+                return ETIMEDOUT;
+            }
+            usleep(1000);
+        }
+
+        _mem = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (_mem == MAP_FAILED) {
+            int ret = errno;
+            _mem = nullptr;
+            close();
+            return ret;
+        }
+        _mem_size = st.st_size;
+
+        header_t* header = (header_t*)_mem;
+        while (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_CACHE_MAGIC) {
+            if (waited++ >= SHM_CACHE_INIT_TIMEOUT) {
+                close();
+                return ETIMEDOUT;
+            }
+            usleep(1000);
+        }
+        if (header->slot_count == 0 || header->slot_count % SHM_CACHE_WAYS != 0 || header->block_size == 0
+                || segment_size(header->slot_count, header->block_size) > _mem_size) {
+            close();
+            return EINVAL;
+        }
+        if (header->blob_id != blob_id) {
+            close();
+            return ESTALE;
+        }
+        map_layout();
+        return 0;
+    }
+
+    int ShmBlockCache::unlink(const char* name) {
+        if (shm_unlink(name) != 0) {
+            return errno;
+        }
+        return 0;
+    }
+
+    void ShmBlockCache::stats(uint64_t &hits, uint64_t &misses) {
+        if (_header == nullptr) {
+            hits = misses = 0;
+            return;
+        }
+        hits = __atomic_load_n(&_header->hits, __ATOMIC_RELAXED);
+        misses = __atomic_load_n(&_header->misses, __ATOMIC_RELAXED);
+    }
+
+    uint32_t ShmBlockCache::block_size() {
+        return _header ? _header->block_size : 0;
+    }
+
+    int ShmBlockCache::get(void* dest, uint32_t &size, uint64_t key) {
+        if (_header == nullptr) {
+            return ENXIO;
+        }
+        uint32_t block_size = _header->block_size;
+        uint32_t first = set_for_key(key, _header->slot_count / SHM_CACHE_WAYS) * SHM_CACHE_WAYS;
+        for (uint32_t index = first; index < first + SHM_CACHE_WAYS; index++) {
+            slot_t &slot = _slots[index];
+            uint32_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+            if (seq == 0 || (seq & 1) != 0) {
+                continue;  // Empty, or being written
+            }
+            if (__atomic_load_n(&slot.key, __ATOMIC_RELAXED) != key) {
+                continue;
+            }
+            uint32_t slot_size = __atomic_load_n(&slot.size, __ATOMIC_RELAXED);
+            if (slot_size > block_size) {
+                continue;
+            }
+            memcpy(dest, _data + (size_t)index * block_size, slot_size);
+
+            // If a writer claimed the slot meanwhile, the copy might be torn
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot.seq, __ATOMIC_RELAXED) != seq) {
+                continue;
+            }
+            size = slot_size;
+            __atomic_fetch_add(&_header->hits, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        __atomic_fetch_add(&_header->misses, 1, __ATOMIC_RELAXED);
+        return ENOENT;
+    }
+
+    void ShmBlockCache::put(uint64_t key, const void* data, uint32_t size) {
+        if (_header == nullptr || size > _header->block_size) {
+            return;
+        }
+        uint32_t block_size = _header->block_size;
+        uint32_t first = set_for_key(key, _header->slot_count / SHM_CACHE_WAYS) * SHM_CACHE_WAYS;
+
+        // Prefer an empty slot, otherwise evict round-robin
+        uint32_t target = SHM_CACHE_WAYS;
+        for (uint32_t way = 0; way < SHM_CACHE_WAYS; way++) {
+            slot_t &slot = _slots[first + way];
+            uint32_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+            if (seq != 0 && (seq & 1) == 0 && __atomic_load_n(&slot.key, __ATOMIC_RELAXED) == key) {
+                return;  // Another process already cached it
+            }
+            if (seq == 0 && target == SHM_CACHE_WAYS) {
+                target = way;
+            }
+        }
+        if (target == SHM_CACHE_WAYS) {
+            target = __atomic_fetch_add(&_header->victim, 1, __ATOMIC_RELAXED) % SHM_CACHE_WAYS;
+        }
+
+        uint32_t index = first + target;
+        slot_t &slot = _slots[index];
+        uint32_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) != 0 || !__atomic_compare_exchange_n(&slot.seq, &seq, seq + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return;  // Someone else is writing it, this is just a cache
+        }
+        __atomic_store_n(&slot.key, key, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot.size, size, __ATOMIC_RELAXED);
+        memcpy(_data + (size_t)index * block_size, data, size);
+        __atomic_store_n(&slot.seq, seq + 2, __ATOMIC_RELEASE);
+    }
+}
+
+#endif // __linux__
@@ -0,0 +1,112 @@
+# pragma once
+#if defined(__linux__)
+
+#include "blobfs.h"
+#include <cstddef>
+
+namespace blobfs {
+    /** Number of slots a block can be stored in */
+    constexpr uint32_t SHM_CACHE_WAYS = 4;
+
+    /**
+     * A BlockCache in shared memory, so that processes reading the same blob decompress each block only once
+     *
+     * The segment is either a named POSIX shared memory object (`shm_open`), which any process can attach to, or an
+     * anonymous `memfd`, which is shared with child processes or by passing `fd()` around.
+     *
+     * Writers claim a slot by flipping its sequence number to odd with a compare-and-swap, and give up if another writer
+     * got there first. Readers never write to the segment: they copy the block out, and retry if the sequence number
+     * changed meanwhile (seqlock). A process that dies while writing leaves its slot unusable, which only costs capacity.
+     *
+     *     ShmBlockCache cache;
+     *     cache.open("/my-blob-cache", blob_id);
+     *     blobfs.set_block_cache(&cache);
+     */
+    class ShmBlockCache : public BlockCache {
+    protected:
+        typedef struct {
+            uint32_t magic;
+            uint32_t slot_count;
+            uint32_t block_size;
+            uint32_t victim;
+            uint64_t blob_id;
+            uint64_t hits;
+            uint64_t misses;
+        } header_t;
+
+        typedef struct {
+            /** Odd while being written, 0 if never written */
+            uint32_t seq;
+            uint32_t size;
+            uint64_t key;
+        } slot_t;
+
+        int _fd;
+        void* _mem;
+        size_t _mem_size;
+        header_t* _header;
+        slot_t* _slots;
+        uint8_t* _data;
+
+        static size_t segment_size(uint32_t slot_count, uint32_t block_size);
+        int create(uint64_t blob_id, uint32_t slot_count, uint32_t block_size);
+        int attach(uint64_t blob_id);
+        void map_layout();
+        void close();
+
+    public:
+        ShmBlockCache();
+        virtual ~ShmBlockCache();
+
+        /**
+         * Creates the cache segment, or attaches to an existing one
+         *
+         * When attaching, the geometry of the existing segment is used.
+         *
+         * @param[in] name Name of the POSIX shared memory object (e.g. "/blobfs-cache"), or nullptr for an anonymous memfd
+         * @param[in] blob_id Identifies the blob being cached, e.g. a hash of it. Attaching to a segment of another blob fails
+         * @param[in] slot_count Number of blocks it can hold, rounded up to a multiple of SHM_CACHE_WAYS
+         * @param[in] block_size Size of each block
+         * @return 0 on success, ESTALE if the segment caches a different blob, or errno
+         */
+        int open(const char* name, uint64_t blob_id, uint32_t slot_count = 1024, uint32_t block_size = 4096);
+
+        /**
+         * Attaches to a segment received from another process, e.g. the `fd()` of an anonymous cache passed over a socket
+         *
+         * @param[in] fd The segment, it is duplicated
+         * @param[in] blob_id Identifies the blob being cached, must match the segment's
+         * @return 0 on success, ESTALE if the segment caches a different blob, or errno
+         */
+        int open(int fd, uint64_t blob_id);
+
+        /**
+         * Removes a named segment, processes attached to it keep using it
+         *
+         * @param[in] name Name of the POSIX shared memory object
+         * @return 0 on success, or errno
+         */
+        static int unlink(const char* name);
+
+        /**
+         * Returns the file descriptor of the segment, or -1 if not open
+         */
+        inline int fd() {
+            return _fd;
+        }
+
+        /**
+         * Returns the hit and miss counters, shared by all processes using the segment
+         */
+        void stats(uint64_t &hits, uint64_t &misses);
+
+        /**
+         * Returns the size of the cached blocks, or 0 until `open` succeeds
+         */
+        virtual uint32_t block_size();
+        virtual int get(void* dest, uint32_t &size, uint64_t key);
+        virtual void put(uint64_t key, const void* data, uint32_t size);
+    };
+}
+
+#endif // __linux__
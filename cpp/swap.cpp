@@ -0,0 +1,232 @@
+#include "swap.h"
+
+namespace blobfs {
+    // ================= Pinned handles =================
+
+    /** Wraps a file handle, keeping its blob alive until it is closed */
+    class PinnedFileHandle : public FileHandle {
+        SwappableBlobFS& _owner;
+        uint32_t _slot;
+        FileHandle* _file;
+    public:
+        inline PinnedFileHandle(SwappableBlobFS& owner, uint32_t slot, BlobFS& blobfs, FileHandle* file, inode_data_t inode_data, inode_t inode)
+        : FileHandle(blobfs, inode_data, inode), _owner(owner), _slot(slot), _file(file)
+        {}
+
+        virtual ~PinnedFileHandle() {
+            delete _file;
+            _owner.unpin(_slot);
+        }
+
+        virtual int tell(uint32_t& position) {
+            return _file->tell(position);
+        }
+
+        virtual int seek(uint32_t position) {
+            return _file->seek(position);
+        }
+
+        virtual int read(void *dest, uint32_t &size) {
+            return _file->read(dest, size);
+        }
+
+        virtual int pread(void *dest, uint32_t &size, uint32_t position) {
+            return _file->pread(dest, size, position);
+        }
+
+        virtual int read_some(void *dest, uint32_t &size, const read_budget_t &budget) {
+            return _file->read_some(dest, size, budget);
+        }
+
+        virtual int map(const void* &data, uint32_t &size, uint32_t position) {
+            return _file->map(data, size, position);
+        }
+    };
+
+    /** A directory handle that keeps its blob alive until it is closed */
+    class PinnedDirHandle : public DirHandle {
+        SwappableBlobFS& _owner;
+        uint32_t _slot;
+    public:
+        inline PinnedDirHandle(SwappableBlobFS& owner, uint32_t slot, BlobFS& blobfs, inode_data_t inode_data, inode_t inode)
+        : DirHandle(blobfs, inode_data, inode), _owner(owner), _slot(slot)
+        {}
+
+        virtual ~PinnedDirHandle() {
+            _owner.unpin(_slot);
+        }
+    };
+
+    void release_memory_blobfs(BlobFS& blobfs, void* /*arg*/) {
+        delete &blobfs;
+    }
+
+
+
+
+    // ================= Swappable BlobFS =================
+
+    SwappableBlobFS::SwappableBlobFS()
+    : _current(SWAP_MAX_BLOBS)
+    {
+        for (uint32_t slot = 0; slot < SWAP_MAX_BLOBS; slot++) {
+            _slots[slot].blobfs = nullptr;
+            _slots[slot].refs = 0;
+            _slots[slot].state = SLOT_FREE;
+        }
+    }
+
+    SwappableBlobFS::~SwappableBlobFS() {
+        clear();
+    }
+
+    int SwappableBlobFS::swap(BlobFS& blobfs, blob_release_t release, void* arg) {
+        uint32_t slot = 0;
+        while (slot < SWAP_MAX_BLOBS && __atomic_load_n(&_slots[slot].state, __ATOMIC_ACQUIRE) != SLOT_FREE) {
+            slot++;
+        }
+        if (slot == SWAP_MAX_BLOBS) {
+            return EBUSY;
+        }
+
+        slot_t &new_slot = _slots[slot];
+        new_slot.blobfs = &blobfs;
+        new_slot.release = release;
+        new_slot.arg = arg;
+        // Readers that are late to notice the swap might be touching the counter of a free slot, so it is incremented instead of set
+        __atomic_fetch_add(&new_slot.refs, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&new_slot.state, SLOT_IN_USE, __ATOMIC_RELEASE);
+
+        uint32_t old_slot = __atomic_exchange_n(&_current, slot, __ATOMIC_SEQ_CST);
+        if (old_slot != SWAP_MAX_BLOBS) {
+            retire(old_slot);
+        }
+        return 0;
+    }
+
+    void SwappableBlobFS::clear() {
+        uint32_t old_slot = __atomic_exchange_n(&_current, SWAP_MAX_BLOBS, __ATOMIC_SEQ_CST);
+        if (old_slot != SWAP_MAX_BLOBS) {
+            retire(old_slot);
+        }
+    }
+
+    void SwappableBlobFS::retire(uint32_t slot) {
+        __atomic_store_n(&_slots[slot].state, SLOT_RETIRED, __ATOMIC_SEQ_CST);
+        unpin(slot);  // The reference held while it was the current blob
+    }
+
+    int SwappableBlobFS::pin(BlobFS* &blobfs, uint32_t &slot) {
+        while (true) {
+            slot = __atomic_load_n(&_current, __ATOMIC_SEQ_CST);
+            if (slot == SWAP_MAX_BLOBS) {
+                return ENXIO;
+            }
+            __atomic_fetch_add(&_slots[slot].refs, 1, __ATOMIC_SEQ_CST);
+
+            // If it is still the current blob, it can't be released until we unpin it
+            if (__atomic_load_n(&_current, __ATOMIC_SEQ_CST) == slot) {
+                blobfs = _slots[slot].blobfs;
+                return 0;
+            }
+            unpin(slot);  // Swapped in the meantime, try again
+        }
+    }
+
+    void SwappableBlobFS::unpin(uint32_t slot) {
+        slot_t &s = _slots[slot];
+        if (__atomic_sub_fetch(&s.refs, 1, __ATOMIC_SEQ_CST) != 0) {
+            return;
+        }
+
+        // Last reference to a retired blob -- Racing readers that failed to pin it might also see 0, only one of them releases it
+        uint32_t expected = SLOT_RETIRED;
+        if (!__atomic_compare_exchange_n(&s.state, &expected, SLOT_RELEASING, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+        if (s.release) {
+            s.release(*s.blobfs, s.arg);
+        }
+        s.blobfs = nullptr;
+        __atomic_store_n(&s.state, SLOT_FREE, __ATOMIC_RELEASE);
+    }
+
+    int SwappableBlobFS::lookup(inode_t &inode, const char* path) {
+        BlobFS* blobfs;
+        uint32_t slot;
+        int ret = pin(blobfs, slot);
+        if (ret) {
+            return ret;
+        }
+        ret = blobfs->lookup(inode, path);
+        unpin(slot);
+        return ret;
+    }
+
+    int SwappableBlobFS::stat(inode_data_t &inode_data, inode_t &inode, const char* path) {
+        BlobFS* blobfs;
+        uint32_t slot;
+        int ret = pin(blobfs, slot);
+        if (ret) {
+            return ret;
+        }
+        ret = blobfs->stat(inode_data, inode, path);
+        unpin(slot);
+        return ret;
+    }
+
+    int SwappableBlobFS::stat(inode_data_t &inode_data, inode_t &inode, uint32_t &number, const char* path) {
+        BlobFS* blobfs;
+        uint32_t slot;
+        int ret = pin(blobfs, slot);
+        if (ret) {
+            return ret;
+        }
+        ret = blobfs->stat(inode_data, inode, number, path);
+        unpin(slot);
+        return ret;
+    }
+
+    int SwappableBlobFS::open(FileHandle* &file, const char* path) {
+        BlobFS* blobfs;
+        uint32_t slot;
+        int ret = pin(blobfs, slot);
+        if (ret) {
+            return ret;
+        }
+        FileHandle* inner;
+        ret = blobfs->open(inner, path);
+        if (ret) {
+            unpin(slot);
+            return ret;
+        }
+        inode_data_t inode_data;
+        inode_t inode;
+        inner->stat(inode_data, inode);
+        // The inner handle's blob, which is a nested one if the path goes into one
+        file = new PinnedFileHandle(*this, slot, inner->_blobfs, inner, inode_data, inode);
+        file->_parent = inner->_parent;
+        return 0;
+    }
+
+    int SwappableBlobFS::opendir(DirHandle* &dir, const char* path) {
+        BlobFS* blobfs;
+        uint32_t slot;
+        int ret = pin(blobfs, slot);
+        if (ret) {
+            return ret;
+        }
+        DirHandle* inner;
+        ret = blobfs->opendir(inner, path);
+        if (ret) {
+            unpin(slot);
+            return ret;
+        }
+        inode_data_t inode_data;
+        inode_t inode;
+        inner->stat(inode_data, inode);
+        delete inner;
+        dir = new PinnedDirHandle(*this, slot, *blobfs, inode_data, inode);
+        return 0;
+    }
+}
@@ -0,0 +1,157 @@
+# pragma once
+#include "blobfs.h"
+
+namespace blobfs {
+    /** Maximum number of blobs that can be alive at the same time in a SwappableBlobFS: the current one, plus old ones still in use */
+    constexpr uint32_t SWAP_MAX_BLOBS = 4;
+
+    /**
+     * Called once a blob swapped out of a SwappableBlobFS is no longer in use
+     *
+     * @param[in] blobfs The blob being released
+     * @param[in] arg The argument passed to `SwappableBlobFS::swap`
+     */
+    typedef void (*blob_release_t)(BlobFS& blobfs, void* arg);
+
+    /** A blob_release_t that deletes a BlobFS allocated with `new`, e.g. a MemoryBlobFS */
+    void release_memory_blobfs(BlobFS& blobfs, void* arg);
+
+    /**
+     * Holds the currently mounted blob, and replaces it atomically with a new one
+     *
+     * Lookups always go to the latest blob, while handles that are already open keep reading from the blob they were
+     * opened on. Each blob is reference-counted, and released by whoever drops its last reference once it has been
+     * swapped out -- Readers never take a lock, they only increment and decrement a counter.
+     *
+     *     SwappableBlobFS fs;
+     *     fs.swap(*new MemoryBlobFS(blob), release_memory_blobfs);
+     *     ...
+     *     fs.swap(*new MemoryBlobFS(new_blob), release_memory_blobfs);  // Zero-downtime update
+     *
+     * Calls to `swap` must be serialized by the caller, everything else can be called concurrently.
+     */
+    class SwappableBlobFS {
+    protected:
+        typedef enum {
+            SLOT_FREE = 0,
+            SLOT_IN_USE,
+            SLOT_RETIRED,
+            SLOT_RELEASING,
+        } slot_state_t;
+
+        typedef struct {
+            BlobFS* blobfs;
+            blob_release_t release;
+            void* arg;
+            /** References held by readers, plus one while it is the current blob */
+            uint32_t refs;
+            /** slot_state_t */
+            uint32_t state;
+        } slot_t;
+
+        slot_t _slots[SWAP_MAX_BLOBS];
+        /** Index of the slot with the current blob, or SWAP_MAX_BLOBS if none */
+        uint32_t _current;
+
+        void retire(uint32_t slot);
+
+    public:
+        SwappableBlobFS();
+
+        /**
+         * Releases the current blob
+         *
+         * All handles must have been closed already.
+         */
+        ~SwappableBlobFS();
+
+        /**
+         * Replaces the current blob
+         *
+         * New lookups immediately go to the new blob. The old one is released once the last handle using it is closed.
+         *
+         * @param[in] blobfs The new blob
+         * @param[in] release Called once `blobfs` is no longer used, or nullptr
+         * @param[in] arg Argument passed to `release`
+         * @return 0 on success, EBUSY if SWAP_MAX_BLOBS blobs are still in use
+         */
+        int swap(BlobFS& blobfs, blob_release_t release = nullptr, void* arg = nullptr);
+
+        /**
+         * Unmounts the current blob
+         *
+         * It is released once the last handle using it is closed.
+         */
+        void clear();
+
+        /**
+         * Takes a reference to the current blob, which stays valid until `unpin` is called, even if it is swapped out
+         *
+         * @param[out] blobfs The current blob
+         * @param[out] slot Must be passed to `unpin`
+         * @return 0 on success, ENXIO if no blob is mounted
+         */
+        int pin(BlobFS* &blobfs, uint32_t &slot);
+
+        /**
+         * Drops a reference taken by `pin`
+         *
+         * @param[in] slot The slot returned by `pin`
+         */
+        void unpin(uint32_t slot);
+
+        /**
+         * Lookup an inode from an absolute path on the current blob
+         *
+         * The inode is only meaningful for the blob that was current at the time.
+         *
+         * @param[out] inode Address of the inode, if found
+         * @param[in] path Full path to the inode being looked up
+         * @return 0 on success, or errno
+         */
+        int lookup(inode_t &inode, const char* path);
+
+        /**
+         * Returns all the metadata of a path on the current blob
+         *
+         * @param[out] inode_data metadata of the specified inode
+         * @param[out] inode The inode number associated with the path
+         * @param[in] path The file path being queried
+         * @return 0 on success, or errno
+         */
+        int stat(inode_data_t &inode_data, inode_t &inode, const char* path);
+
+        /**
+         * Returns all the metadata of a path on the current blob, and its number for `st_ino`
+         *
+         * @param[out] inode_data metadata of the specified inode
+         * @param[out] inode The inode number associated with the path
+         * @param[out] number Its dense number (See `BlobFS::inode_number`), or the inode itself on blobs without an inode table
+         * @param[in] path The file path being queried
+         * @return 0 on success, or errno
+         */
+        int stat(inode_data_t &inode_data, inode_t &inode, uint32_t &number, const char* path);
+
+        /**
+         * Opens a file of the current blob for reading
+         *
+         * The handle keeps the blob alive until it is released with `delete file`
+         *
+         * @param[out] file the file handle.
+         * @param[in] path The path of the file in the filesystem
+         * @return 0 on success, or errno
+         */
+        int open(FileHandle* &file, const char* path);
+
+        /**
+         * Opens a directory of the current blob for listing files
+         *
+         * The handle keeps the blob alive until it is released with `delete dir`
+         *
+         * @param[out] dir the directory handle.
+         * @param[in] path The path of the directory in the filesystem
+         * @return 0 on success, or errno
+         */
+        int opendir(DirHandle* &dir, const char* path);
+    };
+}
@@ -0,0 +1,619 @@
+#include "blobfs.h"
+#include "byteorder.h"
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+
+#if defined(__unix__) || defined(__APPLE__) || defined(ESP32)
+#define BLOBFS_VALIDATE_THREADS 1
+#include <thread>
+#include <vector>
+#endif
+
+namespace blobfs {
+    /** Checks that [offset, offset + size) is within the blob, without overflowing */
+    static inline bool in_bounds(uint64_t offset, uint64_t size, uint32_t blob_size) {
+        return offset <= blob_size && size <= blob_size - offset;
+    }
+
+    /** A directory being validated, and the position of the next entry to validate */
+    typedef struct {
+        inode_data_t dir;
+        uint32_t index;
+    } validate_frame_t;
+
+    /** A directory table reached by `validate_subtree`, empty slots have a zero size */
+    typedef struct {
+        offset_t offset;
+        /** Number of entries validated, or being validated */
+        uint32_t size;
+        /** Whether its subtree was fully validated, otherwise it is being validated by an ancestor */
+        bool done;
+    } visited_dir_t;
+
+    /**
+     * Open-addressing hash table of the directory tables reached so far, by offset
+     *
+     * Builders deduplicate identical subtrees, so even valid blobs are DAGs, and a directory reached through several
+     * paths is validated only once.
+     */
+    typedef struct {
+        visited_dir_t* slots;
+        uint32_t capacity;
+        uint32_t count;
+    } visited_set_t;
+
+    static inline uint32_t visited_slot(const visited_set_t &visited, offset_t offset) {
+        uint32_t mask = visited.capacity - 1;
+        uint32_t slot = (offset * 2654435761u) & mask;
+        while (visited.slots[slot].size != 0 && visited.slots[slot].offset != offset) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    /** Returns the slot of a directory table, adding it if missing, or nullptr if out of memory */
+    static visited_dir_t* visited_insert(visited_set_t &visited, offset_t offset) {
+        // At most half full
+        if (2 * (visited.count + 1) > visited.capacity) {
+            uint32_t capacity = visited.capacity ? 2 * visited.capacity : 64;
+            visited_dir_t* slots = (visited_dir_t*)calloc(capacity, sizeof(visited_dir_t));
+            if (slots == nullptr) {
+                return nullptr;
+            }
+            visited_set_t grown = {slots, capacity, visited.count};
+            for (uint32_t i = 0; i < visited.capacity; i++) {
+                if (visited.slots[i].size != 0) {
+                    grown.slots[visited_slot(grown, visited.slots[i].offset)] = visited.slots[i];
+                }
+            }
+            free(visited.slots);
+            visited = grown;
+        }
+        return &visited.slots[visited_slot(visited, offset)];
+    }
+
+    int BlobFS::validate_fold_index(const inode_data_t &dir, offset_t index_offset, uint32_t blob_size, bool sorted) {
+        if (index_offset == 0) {
+            return 0;
+        }
+        if (!in_bounds(index_offset, (uint64_t)dir.data_size * sizeof(fold_entry_t), blob_size)) {
+            return EINVAL;
+        }
+
+        // Pointing to existing entries, and sorted by hash unless stored in Eytzinger order
+        uint32_t prev_hash = 0;
+        for (uint32_t i = 0; i < dir.data_size; i++) {
+            fold_entry_t entry;
+            int ret = load_chunk(&entry, index_offset + i * sizeof(fold_entry_t), sizeof(fold_entry_t));
+            if (ret) {
+                return ret;
+            }
+            fix_endianess(entry);
+            if (entry.index >= dir.data_size || (sorted && entry.hash < prev_hash)) {
+                return EINVAL;
+            }
+            prev_hash = entry.hash;
+        }
+        return 0;
+    }
+
+    int BlobFS::validate_path_hints(const superblock_t &sb, uint32_t blob_size) {
+        if (sb.path_hint_capacity == 0 || (sb.path_hint_capacity & (sb.path_hint_capacity - 1)) != 0) {
+            return EINVAL;
+        }
+        if (!in_bounds(sb.path_hint_offset, (uint64_t)sb.path_hint_capacity * sizeof(path_hint_t), blob_size)) {
+            return EINVAL;
+        }
+
+        // The directories are only prefetched, but their extension records are loaded to prefetch their indexes
+        for (uint32_t slot = 0; slot < sb.path_hint_capacity; slot++) {
+            path_hint_t hint;
+            int ret = load_chunk(&hint, sb.path_hint_offset + slot * sizeof(path_hint_t), sizeof(path_hint_t));
+            if (ret) {
+                return ret;
+            }
+            fix_endianess(hint);
+            const inode_data_t &dir = hint.dir;
+            if (dir.data_offset == 0) {
+                continue;
+            }
+            if ((dir.flags & FLAG_DIR) == 0 || !in_bounds(dir.data_offset, (uint64_t)dir.data_size * sizeof(dir_entry_t), blob_size)) {
+                return EINVAL;
+            }
+            if ((dir.flags & FLAG_EXT) != 0 && sb.dir_ext_size != 0
+                    && (dir.data_offset < sb.dir_ext_size || !in_bounds(dir.data_offset - sb.dir_ext_size, sb.dir_ext_size, blob_size))) {
+                return EINVAL;
+            }
+        }
+        return 0;
+    }
+
+    int BlobFS::validate_inode_table(const superblock_t &sb, uint32_t blob_size) {
+        if (sb.inode_count == 0 || !in_bounds(sb.inode_table_offset, (uint64_t)sb.inode_count * sizeof(offset_t), blob_size)) {
+            return EINVAL;
+        }
+
+        // Strictly ascending from the root, so that numbers are unique and can be binary searched
+        offset_t prev_offset = 0;
+        for (uint32_t i = 0; i < sb.inode_count; i++) {
+            offset_t offset;
+            int ret = load_chunk(&offset, sb.inode_table_offset + i * sizeof(offset_t), sizeof(offset_t));
+            if (ret) {
+                return ret;
+            }
+            fix_endianess(offset);
+            if ((i == 0 && offset != 0) || (i > 0 && offset <= prev_offset) || !in_bounds(offset, sizeof(inode_data_t), blob_size)) {
+                return EINVAL;
+            }
+            prev_offset = offset;
+        }
+        return 0;
+    }
+
+    /** A B+-tree node being validated, and the position of the next child to validate */
+    typedef struct {
+        offset_t offset;
+        uint32_t position;
+    } btree_frame_t;
+
+    int BlobFS::validate_btree(const inode_data_t &dir, const dir_ext_t &ext, uint32_t blob_size) {
+        if (ext.btree_offset == 0) {
+            return 0;
+        }
+
+        // Depth-first, so that leaves are visited in order: They must be linked in that order, sorted, and point to
+        // every entry exactly once
+        btree_frame_t stack[BTREE_MAX_DEPTH];
+        uint32_t depth = 1;
+        stack[0].offset = ext.btree_offset;
+        stack[0].position = 0;
+        uint8_t* buffer = nullptr;
+        uint32_t entries = 0;
+        uint32_t prev_hash = 0;
+        offset_t next_leaf = 0;
+        bool first_leaf = true;
+        int ret = 0;
+        while (depth > 0 && ret == 0) {
+            btree_frame_t &frame = stack[depth - 1];
+            if (!in_bounds(frame.offset, ext.btree_node_size, blob_size)) {
+                ret = EINVAL;
+                break;
+            }
+            const uint8_t* node;
+            btree_node_t header;
+            ret = load_btree_node(node, header, buffer, frame.offset, ext.btree_node_size);
+            if (ret) {
+                break;
+            }
+            if (header.count == 0) {
+                ret = EINVAL;
+                break;
+            }
+
+            if (header.leaf) {
+                if ((!first_leaf && frame.offset != next_leaf) || (header.next != 0 && header.next <= frame.offset)) {
+                    ret = EINVAL;
+                    break;
+                }
+                first_leaf = false;
+                next_leaf = header.next;
+                entries += header.count;
+                if (entries > dir.data_size) {
+                    ret = EINVAL;
+                    break;
+                }
+                for (uint32_t i = 0; i < header.count; i++) {
+                    uint32_t key;
+                    uint32_t value;
+                    memcpy(&key, node + sizeof(btree_node_t) + i * sizeof(uint32_t), sizeof(uint32_t));
+                    memcpy(&value, node + sizeof(btree_node_t) + (header.count + i) * sizeof(uint32_t), sizeof(uint32_t));
+                    fix_endianess(key);
+                    fix_endianess(value);
+                    if (key < prev_hash || value >= dir.data_size) {
+                        ret = EINVAL;
+                        break;
+                    }
+                    prev_hash = key;
+                }
+                depth--;
+                continue;
+            }
+
+            if (frame.position == header.count) {
+                depth--;
+                continue;
+            }
+            offset_t child;
+            memcpy(&child, node + sizeof(btree_node_t) + (header.count + frame.position) * sizeof(uint32_t), sizeof(uint32_t));
+            fix_endianess(child);
+            // Children before their parents, like lookups expect
+            if (child >= frame.offset || depth == BTREE_MAX_DEPTH) {
+                ret = EINVAL;
+                break;
+            }
+            frame.position++;
+            stack[depth].offset = child;
+            stack[depth].position = 0;
+            depth++;
+        }
+        free(buffer);
+        if (ret == 0 && (entries != dir.data_size || next_leaf != 0)) {
+            ret = EINVAL;
+        }
+        return ret;
+    }
+
+    int BlobFS::validate_inode(const inode_data_t &inode_data, uint32_t blob_size, const superblock_t &sb) {
+        if (inode_data.flags & FLAG_SUPERBLOCK) {
+            return EINVAL;  // Only valid on the root inode, which is validated separately
+        }
+
+        if (inode_data.flags & FLAG_DIR) {
+            if (inode_data.flags & ~(FLAG_DIR | FLAG_WHITEOUT | FLAG_SHARD | FLAG_EXT)) {
+                return EINVAL;
+            }
+            if (inode_data.flags & FLAG_EXT) {
+                // Only the position of the record matters, its totals are informative
+                if ((inode_data.flags & FLAG_SHARD) || sb.magic != SUPERBLOCK_MAGIC || sb.dir_ext_size == 0 || inode_data.data_offset < sb.dir_ext_size) {
+                    return EINVAL;
+                }
+                if (!in_bounds(inode_data.data_offset - sb.dir_ext_size, sb.dir_ext_size, blob_size)) {
+                    return EINVAL;
+                }
+                // Indexes referenced by the record, fields missing from older blobs read as zero
+                dir_ext_t ext;
+                int ret = load_dir_ext(ext, inode_data);
+                if (ret == 0) {
+                    ret = validate_fold_index(inode_data, ext.fold_index_offset, blob_size, true);
+                }
+                if (ret == 0) {
+                    ret = validate_fold_index(inode_data, ext.eytzinger_offset, blob_size, false);
+                }
+                if (ret == 0) {
+                    ret = validate_btree(inode_data, ext, blob_size);
+                }
+                if (ret) {
+                    return ret;
+                }
+                if (ext.bloom_offset != 0 && !in_bounds(ext.bloom_offset, (uint64_t)ext.bloom_blocks * sizeof(bloom_block_t), blob_size)) {
+                    return EINVAL;
+                }
+                if (ext.fingerprint_offset != 0 && !in_bounds(ext.fingerprint_offset, (uint64_t)inode_data.data_size * sizeof(uint16_t), blob_size)) {
+                    return EINVAL;
+                }
+                if (ext.inode_base != 0 && inode_data.data_size != 0) {
+                    // Numbers stay within the inode table, starting at the first entry
+                    if (sb.inode_table_offset == 0 || (uint64_t)ext.inode_base + inode_data.data_size > sb.inode_count) {
+                        return EINVAL;
+                    }
+                    inode_t first;
+                    ret = inode_at(first, ext.inode_base);
+                    if (ret) {
+                        return ret;
+                    }
+                    if (first != inode_data.data_offset + offsetof(dir_entry_t, inode_data)) {
+                        return EINVAL;
+                    }
+                }
+            }
+            if (inode_data.flags & FLAG_SHARD) {
+                // Table of shard numbers
+                if (inode_data.data_size == 0 || !in_bounds(inode_data.data_offset, (uint64_t)inode_data.data_size * sizeof(uint32_t), blob_size)) {
+                    return EINVAL;
+                }
+                for (uint32_t i = 0; i < inode_data.data_size; i++) {
+                    uint32_t shard;
+                    int ret = load_chunk(&shard, inode_data.data_offset + i * sizeof(uint32_t), sizeof(uint32_t));
+                    if (ret) {
+                        return ret;
+                    }
+                    fix_endianess(shard);
+                    if (shard >= sb.shard_count) {
+                        return EINVAL;
+                    }
+                }
+                return 0;
+            }
+            if (!in_bounds(inode_data.data_offset, (uint64_t)inode_data.data_size * sizeof(dir_entry_t), blob_size)) {
+                return EINVAL;
+            }
+            return 0;
+        }
+
+        if (inode_data.flags & FLAG_WHITEOUT) {
+            return inode_data.flags == FLAG_WHITEOUT && inode_data.data_size == 0 ? 0 : EINVAL;
+        }
+        if (inode_data.flags & FLAG_NESTED) {
+            // Stored as-is, it is validated on its own when mounted
+            return inode_data.flags == FLAG_NESTED && in_bounds(inode_data.data_offset, inode_data.data_size, blob_size) ? 0 : EINVAL;
+        }
+        if (inode_data.flags & ~(FLAG_DEFLATE | FLAG_EXT)) {
+            return EINVAL;
+        }
+
+        uint32_t stored_size = inode_data.data_size;
+        if (inode_data.flags & FLAG_EXT) {
+            if (sb.magic != SUPERBLOCK_MAGIC || sb.file_ext_size == 0 || inode_data.data_offset < sb.file_ext_size) {
+                return EINVAL;
+            }
+            if (!in_bounds(inode_data.data_offset - sb.file_ext_size, sb.file_ext_size, blob_size)) {
+                return EINVAL;
+            }
+            file_ext_t ext;
+            memset(&ext, 0, sizeof(file_ext_t));
+            uint32_t ext_size = sb.file_ext_size < sizeof(file_ext_t) ? sb.file_ext_size : sizeof(file_ext_t);
+            int ret = load_chunk(&ext, inode_data.data_offset - sb.file_ext_size, ext_size);
+            if (ret) {
+                return ret;
+            }
+            fix_endianess(ext);
+
+            if (ext.mime_id >= sb.mime_count && sb.file_ext_size > offsetof(file_ext_t, mime_id)) {
+                return EINVAL;
+            }
+            if (!in_bounds(ext.gzip.data_offset, ext.gzip.data_size, blob_size) || !in_bounds(ext.brotli.data_offset, ext.brotli.data_size, blob_size)) {
+                return EINVAL;
+            }
+            if (sb.file_ext_size > offsetof(file_ext_t, stored_size)) {
+                stored_size = ext.stored_size;
+            } else if (inode_data.flags & FLAG_DEFLATE) {
+                stored_size = 0;  // Unknown compressed size
+            }
+        } else if (inode_data.flags & FLAG_DEFLATE) {
+            stored_size = 0;  // Unknown compressed size, decompression must stop at the end of the blob
+        }
+
+        if (!in_bounds(inode_data.data_offset, stored_size, blob_size)) {
+            return EINVAL;
+        }
+        return 0;
+    }
+
+    int BlobFS::validate_subtree(const inode_data_t &root, uint32_t blob_size, const superblock_t &sb, uint32_t first, uint32_t stride) {
+        // Depth-first traversal, with an explicit stack to keep the native stack small
+        uint32_t stack_capacity = 16;
+        validate_frame_t* stack = (validate_frame_t*)malloc(stack_capacity * sizeof(validate_frame_t));
+        if (stack == nullptr) {
+            return ENOMEM;
+        }
+        uint32_t depth = 1;
+        stack[0].dir = root;
+        stack[0].index = first;
+
+        // Tables being validated by an ancestor are loops, those already validated are skipped
+        visited_set_t visited = {nullptr, 0, 0};
+        int ret = 0;
+        visited_dir_t* root_slot = visited_insert(visited, root.data_offset);
+        if (root_slot == nullptr) {
+            ret = ENOMEM;
+        } else if (root.data_size != 0) {
+            *root_slot = {root.data_offset, root.data_size, false};
+            visited.count++;
+        }
+        while (depth > 0 && ret == 0) {
+            validate_frame_t &frame = stack[depth - 1];
+            if (frame.index >= frame.dir.data_size) {
+                visited.slots[visited_slot(visited, frame.dir.data_offset)].done = true;
+                depth--;
+                continue;
+            }
+            uint32_t index = frame.index;
+            // Subtrees of the root are split among threads, others are validated entirely
+            frame.index += depth == 1 ? stride : 1;
+
+            offset_t entry_offset = frame.dir.data_offset + index * sizeof(dir_entry_t);
+            dir_entry_t entry;
+            ret = load_chunk(&entry, entry_offset, sizeof(dir_entry_t));
+            if (ret) {
+                break;
+            }
+            fix_endianess(entry);
+
+            // Names: NULL-terminated within the blob, and sorted
+            const char* name;
+            if (entry.name_offset >= blob_size) {
+                ret = EINVAL;
+                break;
+            }
+            ret = load_str(name, entry.name_offset);
+            if (ret) {
+                break;
+            }
+            size_t name_len = strlen(name);
+            if (name_len == 0 || !in_bounds(entry.name_offset, name_len + 1, blob_size) || strchr(name, '/') != nullptr) {
+                ret = EINVAL;
+            }
+            if (ret == 0 && index > 0) {
+                offset_t prev_name_offset;
+                ret = load_chunk(&prev_name_offset, entry_offset - sizeof(dir_entry_t) + offsetof(dir_entry_t, name_offset), sizeof(offset_t));
+                fix_endianess(prev_name_offset);
+                const char* prev_name;
+                if (ret == 0 && prev_name_offset >= blob_size) {
+                    ret = EINVAL;
+                }
+                if (ret == 0) {
+                    ret = load_str(prev_name, prev_name_offset);
+                }
+                if (ret == 0) {
+                    if (strcmp(prev_name, name) >= 0) {
+                        ret = EINVAL;
+                    }
+                    free_str(prev_name);
+                }
+            }
+            free_str(name);
+            if (ret) {
+                break;
+            }
+
+            // The inode itself
+            ret = validate_inode(entry.inode_data, blob_size, sb);
+            if (ret) {
+                break;
+            }
+            if ((entry.inode_data.flags & FLAG_DIR) == 0 || (entry.inode_data.flags & FLAG_SHARD) != 0 || entry.inode_data.data_size == 0) {
+                continue;
+            }
+
+            // Corrupted blobs might have loops
+            visited_dir_t* slot = visited_insert(visited, entry.inode_data.data_offset);
+            if (slot == nullptr) {
+                ret = ENOMEM;
+                break;
+            }
+            if (slot->size != 0) {
+                if (!slot->done) {
+                    ret = EINVAL;
+                    break;
+                }
+                // Its entries were validated, unless this one has more of them
+                if (slot->size >= entry.inode_data.data_size) {
+                    continue;
+                }
+            } else {
+                visited.count++;
+            }
+            *slot = {entry.inode_data.data_offset, entry.inode_data.data_size, false};
+
+            if (depth == stack_capacity) {
+                stack_capacity *= 2;
+                validate_frame_t* new_stack = (validate_frame_t*)realloc(stack, stack_capacity * sizeof(validate_frame_t));
+                if (new_stack == nullptr) {
+                    ret = ENOMEM;
+                    break;
+                }
+                stack = new_stack;
+            }
+            stack[depth].dir = entry.inode_data;
+            stack[depth].index = 0;
+            depth++;
+        }
+
+        free(visited.slots);
+        free(stack);
+        return ret;
+    }
+
+    int BlobFS::validate(uint32_t parallelism) {
+        uint32_t size;
+        int ret = blob_size(size);
+        if (ret) {
+            return ret;
+        }
+
+        // Root inode and superblock
+        if (!in_bounds(0, sizeof(inode_data_t), size)) {
+            return EINVAL;
+        }
+        inode_data_t root;
+        ret = stat(root, 0);
+        if (ret) {
+            return ret;
+        }
+
+        superblock_t sb;
+        memset(&sb, 0, sizeof(superblock_t));
+        if (root.flags & FLAG_SUPERBLOCK) {
+            ret = superblock(sb);
+            if (ret) {
+                return ret;
+            }
+            if (!in_bounds(sizeof(inode_data_t), sb.superblock_size, size)) {
+                return EINVAL;
+            }
+            if (!in_bounds(sb.mime_table_offset, (uint64_t)sb.mime_count * sizeof(offset_t), size)) {
+                return EINVAL;
+            }
+            for (uint32_t mime_id = 0; mime_id < sb.mime_count; mime_id++) {
+                offset_t mime_offset;
+                ret = load_chunk(&mime_offset, sb.mime_table_offset + mime_id * sizeof(offset_t), sizeof(offset_t));
+                if (ret) {
+                    return ret;
+                }
+                fix_endianess(mime_offset);
+                const char* mime_type;
+                if (mime_offset >= size) {
+                    return EINVAL;
+                }
+                ret = load_str(mime_type, mime_offset);
+                if (ret) {
+                    return ret;
+                }
+                bool valid = in_bounds(mime_offset, strlen(mime_type) + 1, size);
+                free_str(mime_type);
+                if (!valid) {
+                    return EINVAL;
+                }
+            }
+            if (sb.verity_block_size) {
+                if (sb.verity_block_size % VERITY_HASH_SIZE != 0 || sb.verity_block_size < 2 * VERITY_HASH_SIZE || sb.verity_data_size > size) {
+                    return EINVAL;
+                }
+                // Size of the tree: each level has the hashes of the blocks in the level below it
+                uint32_t hashes_per_block = sb.verity_block_size / VERITY_HASH_SIZE;
+                uint64_t blocks = ((uint64_t)sb.verity_data_size + sb.verity_block_size - 1) / sb.verity_block_size;
+                uint64_t tree_size = 0;
+                do {
+                    blocks = (blocks + hashes_per_block - 1) / hashes_per_block;
+                    tree_size += blocks * sb.verity_block_size;
+                } while (blocks > 1);
+                if (!in_bounds(sb.verity_tree_offset, tree_size, size)) {
+                    return EINVAL;
+                }
+            }
+            if (sb.path_hint_offset != 0) {
+                ret = validate_path_hints(sb, size);
+                if (ret) {
+                    return ret;
+                }
+            }
+            if (sb.inode_table_offset != 0) {
+                ret = validate_inode_table(sb, size);
+                if (ret) {
+                    return ret;
+                }
+            }
+        }
+        inode_data_t plain_root = root;
+        plain_root.flags &= ~FLAG_SUPERBLOCK;
+        ret = validate_inode(plain_root, size, sb);
+        if (ret) {
+            return ret;
+        }
+        if ((root.flags & FLAG_DIR) == 0 || (root.flags & FLAG_SHARD) != 0) {
+            _validated = true;
+            return 0;
+        }
+
+        // Directory tree
+#ifdef BLOBFS_VALIDATE_THREADS
+        if (parallelism > 1) {
+            std::vector<int> results(parallelism, 0);
+            std::vector<std::thread> threads;
+            for (uint32_t i = 1; i < parallelism; i++) {
+                threads.emplace_back([this, &results, &root, size, &sb, i, parallelism]() {
+                    results[i] = validate_subtree(root, size, sb, i, parallelism);
+                });
+            }
+            results[0] = validate_subtree(root, size, sb, 0, parallelism);
+            for (auto &thread : threads) {
+                thread.join();
+            }
+            for (int result : results) {
+                if (result) {
+                    return result;
+                }
+            }
+            _validated = true;
+            return 0;
+        }
+#endif
+        ret = validate_subtree(root, size, sb, 0, 1);
+        if (ret) {
+            return ret;
+        }
+        _validated = true;
+        return 0;
+    }
+}
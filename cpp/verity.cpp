@@ -0,0 +1,210 @@
+#include "verity.h"
+#include "sha256.h"
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+
+namespace blobfs {
+    static inline bool test_bit(const uint32_t* bitmap, uint32_t bit) {
+        return (__atomic_load_n(&bitmap[bit / 32], __ATOMIC_ACQUIRE) >> (bit % 32)) & 1;
+    }
+
+    static inline void set_bit(uint32_t* bitmap, uint32_t bit) {
+        __atomic_fetch_or(&bitmap[bit / 32], 1u << (bit % 32), __ATOMIC_RELEASE);
+    }
+
+    VerityBlobFS::VerityBlobFS(BlobFS& backend)
+    : _backend(backend), _block_size(0), _data_size(0), _root_hash_offset(0), _levels(0), _verified(nullptr)
+    {}
+
+    VerityBlobFS::~VerityBlobFS() {
+        free(_verified);
+    }
+
+    int VerityBlobFS::begin(const uint8_t* root_hash) {
+        superblock_t sb;
+        int ret = _backend.superblock(sb);
+        if (ret) {
+            return ret;
+        }
+        if (sb.verity_block_size == 0) {
+            return ENODATA;
+        }
+        if (sb.verity_block_size % VERITY_HASH_SIZE != 0 || sb.verity_block_size < 2 * VERITY_HASH_SIZE || sb.verity_data_size == 0) {
+            return EINVAL;
+        }
+        if (root_hash != nullptr && memcmp(root_hash, sb.verity_root_hash, VERITY_HASH_SIZE) != 0) {
+            return EBADMSG;
+        }
+
+        _block_size = sb.verity_block_size;
+        _data_size = sb.verity_data_size;
+        memcpy(_root_hash, sb.verity_root_hash, VERITY_HASH_SIZE);
+        _root_hash_offset = sizeof(inode_data_t) + offsetof(superblock_t, verity_root_hash);
+
+        // Shape of the tree: Each level has the hashes of the blocks in the level below it
+        uint32_t hashes_per_block = _block_size / VERITY_HASH_SIZE;
+        _levels = 1;
+        _level_blocks[0] = (_data_size + _block_size - 1) / _block_size;
+        while (_levels == 1 || _level_blocks[_levels - 1] > 1) {
+            if (_levels == VERITY_MAX_LEVELS) {
+                return EINVAL;
+            }
+            _level_blocks[_levels] = (_level_blocks[_levels - 1] + hashes_per_block - 1) / hashes_per_block;
+            _levels++;
+        }
+
+        // The tree is stored top-down, and level 0 is the data itself
+        _level_offsets[0] = 0;
+        offset_t offset = sb.verity_tree_offset;
+        for (uint32_t level = _levels - 1; level > 0; level--) {
+            _level_offsets[level] = offset;
+            offset += _level_blocks[level] * _block_size;
+        }
+
+        uint32_t bits = 0;
+        for (uint32_t level = 0; level < _levels; level++) {
+            _level_bits[level] = bits;
+            bits += _level_blocks[level];
+        }
+        free(_verified);
+        _verified = (uint32_t*)calloc((bits + 31) / 32, sizeof(uint32_t));
+        if (_verified == nullptr) {
+            return ENOMEM;
+        }
+        return 0;
+    }
+
+    int VerityBlobFS::verified_blocks(uint32_t &verified, uint32_t &total) {
+        if (_verified == nullptr) {
+            return EINVAL;
+        }
+        total = _level_blocks[0];
+        verified = 0;
+        for (uint32_t block = 0; block < total; block++) {
+            verified += test_bit(_verified, block);
+        }
+        return 0;
+    }
+
+    int VerityBlobFS::verify_block(uint32_t level, uint32_t index) {
+        if (test_bit(_verified, _level_bits[level] + index)) {
+            return 0;
+        }
+
+        // Hash the block
+        uint8_t* block = (uint8_t*)malloc(_block_size);
+        if (block == nullptr) {
+            return ENOMEM;
+        }
+        offset_t block_offset = _level_offsets[level] + index * _block_size;
+        uint32_t block_size = _block_size;
+        if (level == 0 && block_offset + block_size > _data_size) {
+            block_size = _data_size - block_offset;  // The last data block is zero-padded
+        }
+        memset(block + block_size, 0, _block_size - block_size);
+        int ret = _backend.load_chunk(block, block_offset, block_size);
+        if (ret) {
+            free(block);
+            return ret;
+        }
+        if (level == 0 && block_offset < _root_hash_offset + VERITY_HASH_SIZE && _root_hash_offset < block_offset + _block_size) {
+            // The root hash can't be part of the data it hashes
+            offset_t start = _root_hash_offset > block_offset ? _root_hash_offset : block_offset;
+            offset_t end = _root_hash_offset + VERITY_HASH_SIZE < block_offset + _block_size ? _root_hash_offset + VERITY_HASH_SIZE : block_offset + _block_size;
+            memset(block + (start - block_offset), 0, end - start);
+        }
+        uint8_t hash[VERITY_HASH_SIZE];
+        Sha256::hash(hash, block, _block_size);
+        free(block);
+
+        // Compare with the hash stored in the parent block -- or with the root hash
+        uint8_t expected[VERITY_HASH_SIZE];
+        if (level == _levels - 1) {
+            memcpy(expected, _root_hash, VERITY_HASH_SIZE);
+        } else {
+            uint32_t hashes_per_block = _block_size / VERITY_HASH_SIZE;
+            ret = verify_block(level + 1, index / hashes_per_block);
+            if (ret) {
+                return ret;
+            }
+            offset_t expected_offset = _level_offsets[level + 1] + index * VERITY_HASH_SIZE;
+            ret = _backend.load_chunk(expected, expected_offset, VERITY_HASH_SIZE);
+            if (ret) {
+                return ret;
+            }
+        }
+        if (memcmp(hash, expected, VERITY_HASH_SIZE) != 0) {
+            return EBADMSG;
+        }
+
+        set_bit(_verified, _level_bits[level] + index);
+        return 0;
+    }
+
+    int VerityBlobFS::verify_range(offset_t offset, uint32_t len) {
+        if (_verified == nullptr) {
+            return EINVAL;  // begin() wasn't called
+        }
+        if (offset > _data_size || len > _data_size - offset) {
+            return EINVAL;  // Not protected by the tree
+        }
+        if (len == 0) {
+            return 0;
+        }
+        uint32_t last = (offset + len - 1) / _block_size;
+        for (uint32_t block = offset / _block_size; block <= last; block++) {
+            int ret = verify_block(0, block);
+            if (ret) {
+                return ret;
+            }
+        }
+        return 0;
+    }
+
+    int VerityBlobFS::load_chunk(void* dest, offset_t offset, uint32_t len) {
+        int ret = verify_range(offset, len);
+        if (ret) {
+            return ret;
+        }
+        return _backend.load_chunk(dest, offset, len);
+    }
+
+    int VerityBlobFS::load_str(const char* &str, offset_t offset) {
+        int ret = _backend.load_str(str, offset);
+        if (ret) {
+            return ret;
+        }
+        ret = verify_range(offset, strlen(str) + 1);
+        if (ret) {
+            _backend.free_str(str);
+            return ret;
+        }
+        return 0;
+    }
+
+    void VerityBlobFS::free_str(const char* str) {
+        _backend.free_str(str);
+    }
+
+    int VerityBlobFS::map_chunk(const void* &ptr, offset_t offset, uint32_t len) {
+        int ret = verify_range(offset, len);
+        if (ret) {
+            return ret;
+        }
+        return _backend.map_chunk(ptr, offset, len);
+    }
+
+    int VerityBlobFS::blob_size(uint32_t &size) {
+        return _backend.blob_size(size);
+    }
+
+    void VerityBlobFS::prefetch(offset_t offset, uint32_t len) {
+        // Blocks are verified when loaded, reading them ahead is safe
+        _backend.prefetch(offset, len);
+    }
+
+    bool VerityBlobFS::supports_prefetch() {
+        return _backend.supports_prefetch();
+    }
+}
@@ -0,0 +1,77 @@
+# pragma once
+#include "blobfs.h"
+
+namespace blobfs {
+    /** Maximum height of the integrity tree */
+    constexpr uint32_t VERITY_MAX_LEVELS = 16;
+
+    /**
+     * Verifies the integrity of a blob built with `--verity`, dm-verity style
+     *
+     * The blob is split in fixed-size blocks, and a Merkle tree of their SHA-256 hashes is stored after them.
+     * Instead of hashing the whole blob upfront, each block is verified the first time it is accessed (together with
+     * the path of the tree leading to it), and remembered in a bitmap afterwards.
+     *
+     * Reads of corrupted blocks fail with EBADMSG.
+     *
+     * It wraps another BlobFS, which is used as the backend:
+     *
+     *     MemoryBlobFS backend(blob);
+     *     VerityBlobFS fs(backend);
+     *     int ret = fs.begin(trusted_root_hash);
+     */
+    class VerityBlobFS : public BlobFS {
+    protected:
+        BlobFS& _backend;
+        uint32_t _block_size;
+        uint32_t _data_size;
+        uint8_t _root_hash[VERITY_HASH_SIZE];
+        /** Offset of the root hash in the blob, it is hashed as zeros */
+        offset_t _root_hash_offset;
+
+        /** Number of levels, including the data blocks at level 0. The top level has a single block */
+        uint32_t _levels;
+        /** Number of blocks at each level */
+        uint32_t _level_blocks[VERITY_MAX_LEVELS];
+        /** Offset of each level, level 0 is the data itself */
+        offset_t _level_offsets[VERITY_MAX_LEVELS];
+        /** Index of the first bit of each level in `_verified` */
+        uint32_t _level_bits[VERITY_MAX_LEVELS];
+        /** Bitmap of blocks (at all levels) that were already verified */
+        uint32_t* _verified;
+
+        int verify_block(uint32_t level, uint32_t index);
+        int verify_range(offset_t offset, uint32_t len);
+
+    public:
+        VerityBlobFS(BlobFS& backend);
+        ~VerityBlobFS();
+
+        /**
+         * Loads the integrity tree parameters from the backend's superblock
+         *
+         * Nothing is hashed yet, it only compares the root hash with the trusted one.
+         *
+         * @param[in] root_hash Trusted root hash (VERITY_HASH_SIZE bytes), or nullptr to trust the one in the superblock
+         * @return 0 on success, ENODATA if the blob has no integrity tree, EBADMSG if the root hash doesn't match, or errno
+         */
+        int begin(const uint8_t* root_hash = nullptr);
+
+        /**
+         * Returns the number of blocks verified so far, out of the number of data blocks
+         *
+         * @param[out] verified Number of data blocks that were verified
+         * @param[out] total Number of data blocks
+         * @return 0 on success, or errno
+         */
+        int verified_blocks(uint32_t &verified, uint32_t &total);
+
+        virtual int load_chunk(void* dest, offset_t offset, uint32_t len);
+        virtual int load_str(const char* &str, offset_t offset);
+        virtual void free_str(const char* str);
+        virtual int map_chunk(const void* &ptr, offset_t offset, uint32_t len);
+        virtual int blob_size(uint32_t &size);
+        virtual void prefetch(offset_t offset, uint32_t len);
+        virtual bool supports_prefetch();
+    };
+}
@@ -1 +1 @@
-from .impl import compile, compile_path, load
+from .impl import compile, compile_path, compile_sharded, load, load_path, WHITEOUT, OpaqueDir, Shard, NestedBlob
@@ -1,12 +1,34 @@
-from .impl import compile_path
+from .impl import compile, compile_sharded, load_path
 import argparse
 import watchdog
 
-def main_create(src, dest, format='raw', watch=False, compress=False, prefix=None, sufix=None):
+def main_create(src, dest, format='raw', watch=False, compress=False, codec_objective="smallest", codec_report=False, http_metadata=False, precompress=None, verity=0, dir_stats=False, case_insensitive=False, bloom_filters=False, eytzinger_index=False, fingerprints=False, btree_index=0, btree_min_entries=None, path_hints=False, inode_table=False, shards=0, jobs=None, prefix=None, sufix=None):
     def do_create():
         print("Creating BlobFS...")
-        raw_blob = compile_path(src, compress=compress)
+        report = []
+        root_hash = []
+        options = dict(compress=compress, objective=codec_objective, codec_report=report,
+                       http_metadata=http_metadata, precompress=precompress.split(",") if precompress else (),
+                       verity_block_size=verity, root_hash=root_hash if verity else None, dir_stats=dir_stats,
+                       fold_case=case_insensitive, bloom_filters=bloom_filters,
+                       eytzinger=eytzinger_index, fingerprints=fingerprints,
+                       btree_node_size=btree_index, btree_min_entries=btree_min_entries, path_hints=path_hints,
+                       inode_table=inode_table)
+        if shards:
+            raw_blob, shard_blobs = compile_sharded(load_path(src), shards=shards, jobs=jobs, **options)
+        else:
+            raw_blob, shard_blobs = compile(load_path(src), **options), []
+        if codec_report:
+            for choice in report:
+                print(choice)
+        if verity:
+            print(f"Integrity tree root hash: {root_hash[0].hex()}")
 
+        write_blob(dest, raw_blob)
+        for i, shard_blob in enumerate(shard_blobs):
+            write_blob(f"{dest}.shard{i}", shard_blob)
+
+    def write_blob(dest, raw_blob):
         if format == "raw":
             blob = raw_blob
         elif format == 'py':
@@ -73,6 +95,35 @@ create_parser.add_argument("--format", metavar="FORMAT", default="raw", choices=
                           help="How to encode the blob")
 create_parser.add_argument("--watch", action="store_true", help="Watch for FS changes")
 create_parser.add_argument("--compress", action="store_true", help="Enable file compression")
+create_parser.add_argument("--codec-objective", metavar="OBJECTIVE", default="smallest",
+                          help="Trade-off used to pick each file's codec: smallest, balanced, fastest, or a weight between 0 (smallest) and 1 (fastest to read)")
+create_parser.add_argument("--codec-report", action="store_true", help="Print the codec chosen for each file")
+create_parser.add_argument("--http-metadata", action="store_true", help="Store content hashes and MIME types of files")
+create_parser.add_argument("--precompress", metavar="ENCODINGS",
+                          help="Comma-separated precompressed variants to store for each file (gzip, br), implies --http-metadata")
+create_parser.add_argument("--verity", metavar="BLOCK_SIZE", type=int, nargs="?", const=4096, default=0,
+                          help="Append an integrity tree (Merkle tree of SHA-256 hashes) of BLOCK_SIZE blocks, 4096 by default")
+create_parser.add_argument("--dir-stats", action="store_true",
+                          help="Store the number of files, directories and bytes below every directory")
+create_parser.add_argument("--case-insensitive", action="store_true",
+                          help="Store an index of the case-folded names of every directory, for case-insensitive lookups. Fails if names only differ by case")
+create_parser.add_argument("--bloom-filters", action="store_true",
+                          help="Store a Bloom filter of the names of every directory, so that lookups of missing names are rejected quickly")
+create_parser.add_argument("--eytzinger-index", action="store_true",
+                          help="Store an index of the names of every directory laid out in Eytzinger order, for cache-friendly lookups in big directories")
+create_parser.add_argument("--fingerprints", action="store_true",
+                          help="Store a column of 16-bit fingerprints of the names of every directory, so that lookups scan them with SIMD instructions")
+create_parser.add_argument("--btree-index", metavar="NODE_SIZE", type=int, nargs="?", const=4096, default=0,
+                          help="Store a B+-tree of the names of big directories, with nodes of NODE_SIZE bytes (a flash sector or disk block), 4096 by default")
+create_parser.add_argument("--btree-min-entries", metavar="N", type=int,
+                          help="Only store B+-trees for directories with at least N entries, by default those whose entries don't fit a single node")
+create_parser.add_argument("--path-hints", action="store_true",
+                          help="Store a table of the directories by the hash of their path, so that lookups of deep paths prefetch every level at once")
+create_parser.add_argument("--inode-table", action="store_true",
+                          help="Store a table of every inode, so that they are numbered densely from 0 (st_ino) and caches can be flat arrays")
+create_parser.add_argument("--shards", metavar="N", type=int, default=0,
+                          help="Split the filesystem across N shard blobs (DEST.shard0, DEST.shard1, ...), routed by the root index at DEST")
+create_parser.add_argument("--jobs", metavar="N", type=int, help="Number of processes used to build shards in parallel")
 create_parser.add_argument("--prefix", help="store a prefix to the file")
 create_parser.add_argument("--sufix", help="store a sufix to the file")
 cmds["create"] = main_create
@@ -3,7 +3,12 @@ import os
 from enum import IntFlag
 import struct
 import zlib
+import gzip
+import hashlib
+import mimetypes
 import time
+import concurrent.futures
+import functools
 from watchdog.observers import Observer
 from watchdog.events import FileSystemEventHandler
 
@@ -11,16 +16,486 @@ PTR_SIZE = 4
 ENTRY_SIZE = 1 + 2 * PTR_SIZE
 DIRENTRY_SIZE = PTR_SIZE + ENTRY_SIZE
 
+SUPERBLOCK_MAGIC = 0x53464c42  # "BLFS"
+SUPERBLOCK_FORMAT = "<IIIIIIII32sIIIIII"
+VERITY_HASH_SIZE = 32
+# The root hash follows the first 8 fields of the superblock
+VERITY_ROOT_HASH_OFFSET = ENTRY_SIZE + struct.calcsize("<IIIIIIII")
+# content_hash, mime_id, gzip_size, gzip_offset, brotli_size, brotli_offset, stored_size -- stored_size is what lets the
+# HTTP server send FLAG_DEFLATE contents as-is, readers treat records too short to have it as "unknown"
+FILE_EXT_FORMAT = "<16sHIIIII"
+CONTENT_HASH_SIZE = 16
+# file_count, dir_count, logical_bytes, stored_bytes, fold_index_offset, bloom_offset, bloom_blocks, eytzinger_offset,
+# fingerprint_offset, btree_offset, btree_node_size, inode_base
+DIR_EXT_FORMAT = "<IIQQIIIIIIII"
+# inode_base is the last field, patched in once the inode table is sorted
+DIR_EXT_INODE_BASE_OFFSET = struct.calcsize(DIR_EXT_FORMAT) - 4
+# file_count of a directory whose subtree goes into shards
+DIR_EXT_TOTALS_UNKNOWN = 0xFFFFFFFF
+# hash, index
+FOLD_ENTRY_FORMAT = "<II"
+# hash, directory inode
+PATH_HINT_FORMAT = "<I9s"
+# B+-tree nodes: count, leaf, reserved, next -- Followed by count keys and count values
+BTREE_NODE_FORMAT = "<HBBI"
+BTREE_MAX_NODE_SIZE = 64 * 1024
+BTREE_MAX_DEPTH = 8
+# Split-block Bloom filters: Each name sets one bit in each 32-bit word of a block
+BLOOM_BLOCK_WORDS = 8
+BLOOM_SALTS = (0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d, 0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31)
+# Size of the filters, about 1% of false positives
+BLOOM_BITS_PER_NAME = 12
+DEFAULT_MIME_TYPE = "application/octet-stream"
+
 class InodeFlags(IntFlag):
     IS_DIR = 1
     DEFLATE = 2  # Only for files
+    EXT = 4  # An extension record is stored right before the contents of files / the entries of directories
+    WHITEOUT = 8  # For overlay layers: Files are whiteouts, directories are opaque
+    SHARD = 0x10  # Only for directories of a root index, their contents are stored in other blobs
+    NESTED = 0x20  # Only for files, their contents are a blob mounted on them
+    SUPERBLOCK = 0x80  # Only for the root inode, a superblock follows it
+
+
+class Whiteout:
+    """Overlay layer entry hiding the entry with the same name in lower layers"""
+    def __repr__(self):
+        return "WHITEOUT"
+
+    def __reduce__(self):
+        return "WHITEOUT"  # Stays a singleton when pickled
+
+WHITEOUT = Whiteout()
+
+
+class OpaqueDir(dict):
+    """Overlay layer directory hiding the contents of the same directory in lower layers"""
+    def __eq__(self, other):
+        return isinstance(other, OpaqueDir) and dict.__eq__(self, other)
+
+    def __ne__(self, other):
+        return not self == other
+
+class NestedBlob:
+    """A blob embedded as-is in another one, and mounted on its entry"""
+    def __init__(self, blob):
+        self.blob = bytes(blob)
+        self._alignment = None
+
+    @property
+    def alignment(self):
+        """Alignment of its offset in the outer blob, so that its B+-tree nodes are aligned in the outer blob too"""
+        if self._alignment is None:
+            self._alignment = btree_alignment(self.blob)
+        return self._alignment
+
+    def __eq__(self, other):
+        return isinstance(other, NestedBlob) and self.blob == other.blob
+
+    def __repr__(self):
+        return f"NestedBlob(size={len(self.blob)})"
+
+# Files with this suffix are nested blobs, mounted without the suffix, when compiling a directory
+NESTED_BLOB_SUFFIX = ".blobfs"
+
+
+def btree_alignment(blob):
+    """Largest B+-tree node size of a blob, including the ones nested in it, or 1 if it has no B+-tree"""
+    size, ptr, flags = struct.unpack_from("<IIB", blob, 0)
+    dir_ext_size = 0
+    if flags & InodeFlags.SUPERBLOCK:
+        # dir_ext_size follows shard_count, older superblocks are shorter
+        superblock_size, = struct.unpack_from("<I", blob, ENTRY_SIZE + 4)
+        dir_ext_offset = struct.calcsize("<IIIIIIII32sI")
+        if superblock_size >= dir_ext_offset + 4:
+            dir_ext_size, = struct.unpack_from("<I", blob, ENTRY_SIZE + dir_ext_offset)
+    # btree_node_size follows btree_offset
+    node_size_offset = struct.calcsize("<IIQQIIIIII")
+    alignment = 1
+    visited = set()
+    pending = [(size, ptr, flags)]
+    while pending:
+        size, ptr, flags = pending.pop()
+        if flags & InodeFlags.NESTED:
+            alignment = max(alignment, btree_alignment(blob[ptr:ptr + size]))
+            continue
+        if not flags & InodeFlags.IS_DIR or flags & InodeFlags.SHARD or ptr in visited:
+            continue
+        visited.add(ptr)
+        if flags & InodeFlags.EXT and dir_ext_size >= node_size_offset + 4:
+            node_size, = struct.unpack_from("<I", blob, ptr - dir_ext_size + node_size_offset)
+            if node_size <= BTREE_MAX_NODE_SIZE:
+                alignment = max(alignment, node_size)
+        for i in range(size):
+            pending.append(struct.unpack_from("<IIB", blob, ptr + i * DIRENTRY_SIZE + PTR_SIZE))
+    return alignment
+
+
+class Shard:
+    """
+    Directory stored in other blobs of a sharded filesystem, see `compile_sharded`
+
+    With ways=1, the whole subtree is stored in its own shard. Otherwise, its entries are partitioned across `ways`
+    shards by the hash of their names.
+    """
+    def __init__(self, entries, ways=1):
+        if ways < 1:
+            raise ValueError(f"Invalid number of shard ways: {ways}")
+        self.entries = entries
+        self.ways = ways
+
+
+class ShardRef:
+    """A directory with InodeFlags.SHARD, as stored in the root index"""
+    def __init__(self, shards):
+        self.shards = list(shards)
+
+    def __eq__(self, other):
+        return isinstance(other, ShardRef) and self.shards == other.shards
+
+    def __repr__(self):
+        return f"ShardRef({self.shards})"
+
+
+def shard_for_name(name):
+    """Routes a name to `shard_for_name(name) % ways`: Its fold_hash, so that names only differing by case share a shard"""
+    return fold_hash(name)
+
+def fold_name(name):
+    """Folds the ASCII letters of a name to lowercase, other characters are kept as-is"""
+    return bytes(name, "utf-8").lower()
+
+
+def fold_hash(name):
+    """FNV-1a hash of the case-folded name, as stored in the case-folded name index"""
+    h = 2166136261
+    for c in fold_name(name):
+        h = ((h ^ c) * 16777619) & 0xffffffff
+    return h
+
+def eytzinger_order(items):
+    """
+    Reorders sorted items as a binary search tree stored level by level (Eytzinger layout)
+
+    Item `k - 1` is node k, whose children are nodes 2k and 2k + 1.
+    """
+    ret = [None] * len(items)
+    sorted_items = iter(items)
+    def fill(node):
+        if node <= len(items):
+            fill(2 * node)
+            ret[node - 1] = next(sorted_items)
+            fill(2 * node + 1)
+    fill(1)
+    return ret
+
+
+def bloom_hash(name):
+    """64-bit FNV-1a hash of the case-folded name, as used by the Bloom filters"""
+    h = 14695981039346656037
+    for c in fold_name(name):
+        h = ((h ^ c) * 1099511628211) & 0xffffffffffffffff
+    return h
+
+
+def build_bloom_filter(names):
+    """Builds the split-block Bloom filter of a directory, returns the filter and its number of blocks"""
+    block_bits = BLOOM_BLOCK_WORDS * 32
+    blocks = max(1, (len(names) * BLOOM_BITS_PER_NAME + block_bits - 1) // block_bits)
+    words = [0] * (blocks * BLOOM_BLOCK_WORDS)
+    for name in names:
+        h = bloom_hash(name)
+        block = ((h >> 32) * blocks) >> 32
+        for i, salt in enumerate(BLOOM_SALTS):
+            bit = ((h * salt) & 0xffffffff) >> 27
+            words[block * BLOOM_BLOCK_WORDS + i] |= 1 << bit
+    return struct.pack(f"<{len(words)}I", *words), blocks
+
+# OCI image layer conventions, used when compiling a directory
+OCI_WHITEOUT_PREFIX = ".wh."
+OCI_OPAQUE_MARKER = ".wh..wh..opq"
+
+
+def brotli_compress(data):
+    # Optional dependency, only needed when brotli variants are requested
+    import brotli
+    return brotli.compress(data, quality=11)
+
+# Precompressed variants that can be stored alongside files, in file extension record order
+PRECOMPRESSORS = {
+    "gzip": lambda data: gzip.compress(data, 9, mtime=0),
+    "br": brotli_compress,
+}
+
+
+# Leading bytes of formats that are already compressed -- Trying to compress them again only wastes build time
+INCOMPRESSIBLE_MAGIC = [
+    b"\x89PNG\r\n\x1a\n",   # PNG
+    b"\xff\xd8\xff",        # JPEG
+    b"\x1f\x8b",            # gzip
+    b"PK\x03\x04",          # zip
+    b"GIF8",                # GIF
+    b"wOF2",                # WOFF2
+    b"BZh",                 # bzip2
+    b"\xfd7zXZ\x00",        # xz
+]
+
+# Codecs that can be stored in the blob, as `name: (inode flags, compress function, candidate levels)`
+CODECS = {
+    "deflate": (InodeFlags.DEFLATE, zlib.compress, (1, 6, 9)),
+}
+
+# Named presets for `CodecCostModel.speed_weight`
+CODEC_OBJECTIVES = {
+    "smallest": 0.0,
+    "balanced": 0.5,
+    "fastest": 1.0,
+}
+
+
+class CodecChoice:
+    """How a single file ended up being stored"""
+    def __init__(self, path, codec, level, size, stored_size, cost):
+        self.path = path
+        self.codec = codec
+        self.level = level
+        self.size = size
+        self.stored_size = stored_size
+        self.cost = cost
+
+    def __repr__(self):
+        level = "" if self.level is None else f":{self.level}"
+        ratio = self.stored_size / self.size if self.size else 1
+        return f"{self.path}: {self.codec}{level} {self.size} -> {self.stored_size} ({ratio:.0%}), cost={self.cost:.3f}"
+
+
+class CodecCostModel:
+    """
+    Chooses the codec and level of each file.
+
+    Every candidate is scored with `(1 - speed_weight) * size_cost + speed_weight * decode_cost`, both relative to
+    storing the file uncompressed:
+    - size_cost: stored_size / size
+    - decode_cost: time to read the stored bytes from the backend plus time to decode them, where reading a byte
+      costs 1 and decoding an output byte costs `decode_costs[codec]`
+
+    `speed_weight=0` picks the smallest encoding, `speed_weight=1` the fastest one to read.
+    """
+    def __init__(self, objective="smallest", codecs=None, decode_costs=None):
+        if isinstance(objective, str):
+            objective = CODEC_OBJECTIVES[objective] if objective in CODEC_OBJECTIVES else float(objective)
+        if not 0 <= objective <= 1:
+            raise ValueError(f"Codec objective must be between 0 and 1, got {objective}")
+        self.speed_weight = objective
+        self.codecs = CODECS if codecs is None else codecs
+        # Inflating a byte is cheaper than fetching one from (uncached) SPI flash, but not free
+        self.decode_costs = {"deflate": 0.5} if decode_costs is None else decode_costs
+
+    def cost(self, codec, size, stored_size):
+        if size == 0:
+            return 0
+        size_cost = stored_size / size
+        decode_cost = size_cost + (self.decode_costs.get(codec, 0) if codec != "raw" else 0)
+        return (1 - self.speed_weight) * size_cost + self.speed_weight * decode_cost
+
+    @staticmethod
+    def is_incompressible(data):
+        return any(data.startswith(magic) for magic in INCOMPRESSIBLE_MAGIC)
+
+    def choose(self, data):
+        """Returns `(stored_data, flags, CodecChoice)` for the cheapest encoding of `data`"""
+        best = (data, 0, CodecChoice(None, "raw", None, len(data), len(data), self.cost("raw", len(data), len(data))))
+        if self.is_incompressible(data):
+            return best
+
+        for codec, (flags, compress, levels) in self.codecs.items():
+            for level in levels:
+                zdata = compress(data, level)
+                cost = self.cost(codec, len(data), len(zdata))
+                if cost < best[2].cost:
+                    best = (zdata, flags, CodecChoice(None, codec, level, len(data), len(zdata), cost))
+        return best
+
+
+def align(n, alignment):
+    return (n + alignment - 1) // alignment * alignment
+
+
+def build_verity_tree(data, block_size):
+    """
+    Builds a dm-verity style Merkle tree over `data`
+
+    Returns the tree, stored level by level from the top (single-block) level down to the hashes of the data blocks,
+    and the root hash (the hash of the top level).
+    """
+    def split_blocks(data):
+        data += b"\0" * (align(len(data), block_size) - len(data))
+        return [data[i:i + block_size] for i in range(0, len(data), block_size)]
+
+    levels = []
+    blocks = split_blocks(data)
+    while True:
+        level = b''.join(hashlib.sha256(block).digest() for block in blocks)
+        blocks = split_blocks(level)
+        levels.append(b''.join(blocks))
+        if len(blocks) == 1:
+            break
+    return b''.join(reversed(levels)), hashlib.sha256(blocks[0]).digest()
+
+
+class SubtreeTotals:
+    """Totals of a directory's subtree, stored in its extension record"""
+    def __init__(self, file_count=0, dir_count=0, logical_bytes=0, stored_bytes=0):
+        self.file_count = file_count
+        self.dir_count = dir_count
+        self.logical_bytes = logical_bytes
+        self.stored_bytes = stored_bytes
+        # Directories routed to shards have their contents in other blobs, so the totals are incomplete
+        self.complete = True
+
+    def add(self, other):
+        self.file_count += other.file_count
+        self.dir_count += other.dir_count
+        self.logical_bytes += other.logical_bytes
+        self.stored_bytes += other.stored_bytes
+        self.complete = self.complete and other.complete
+
+    def pack(self, fold_index_ptr=0, bloom_ptr=0, bloom_blocks=0, eytzinger_ptr=0, fingerprint_ptr=0, btree_ptr=0, btree_node_size=0):
+        if self.complete:
+            totals = (self.file_count, self.dir_count, self.logical_bytes, self.stored_bytes)
+        else:
+            # Unknown: every total is set to its maximum, the indexes are still valid
+            totals = (DIR_EXT_TOTALS_UNKNOWN, DIR_EXT_TOTALS_UNKNOWN, 2**64 - 1, 2**64 - 1)
+        return struct.pack(DIR_EXT_FORMAT, *totals,
+                           fold_index_ptr, bloom_ptr, bloom_blocks, eytzinger_ptr, fingerprint_ptr, btree_ptr,
+                           btree_node_size, 0)
 
 
 class BlobCompiler:
-    def __init__(self, compress=False):
+    def __init__(self, compress=False, objective="smallest", http_metadata=False, precompress=(), verity_block_size=0, shard_count=0, dir_stats=False, fold_case=False, bloom_filters=False, eytzinger=False, fingerprints=False, btree_node_size=0, btree_min_entries=None, path_hints=False, inode_table=False):
         self.blob = io.BytesIO()
         self.cache = {}
         self.compress = compress
+        self.cost_model = CodecCostModel(objective)
+        self.codec_cache = {}
+        # Per-file CodecChoice, in the order files were stored
+        self.codec_report = []
+        # Store content hashes, MIME types and precompressed variants for every file
+        self.http_metadata = http_metadata or bool(precompress)
+        for encoding in precompress:
+            if encoding not in PRECOMPRESSORS:
+                raise ValueError(f"Unknown precompressed encoding: {encoding}")
+        self.precompress = precompress
+        self.mime_types = [DEFAULT_MIME_TYPE]
+        # Block size of the integrity tree, or 0 to skip it
+        if verity_block_size and (verity_block_size % VERITY_HASH_SIZE or verity_block_size < 2 * VERITY_HASH_SIZE):
+            raise ValueError(f"Invalid verity block size: {verity_block_size}")
+        self.verity_block_size = verity_block_size
+        self.root_hash = None
+        # Number of shards, if this is the root index of a sharded filesystem
+        self.shard_count = shard_count
+        # Store the totals of their subtrees before the entries of every directory
+        self.dir_stats = dir_stats
+        # Store an index of the case-folded names of every directory, for case-insensitive lookups
+        self.fold_case = fold_case
+        # Store a Bloom filter of the names of every directory, rejecting most lookups of missing names
+        self.bloom_filters = bloom_filters
+        # Store the case-folded name index of every directory in Eytzinger order, for cache-friendly lookups
+        self.eytzinger = eytzinger
+        # Store a column of 16-bit fingerprints of the names of every directory, scanned with SIMD instructions
+        self.fingerprints = fingerprints
+        # Store a B+-tree of the names of big directories, with nodes of this size (a flash sector or disk block), or 0
+        if btree_node_size and (btree_node_size > BTREE_MAX_NODE_SIZE or btree_node_size < struct.calcsize(BTREE_NODE_FORMAT) + 16):
+            raise ValueError(f"Invalid B-tree node size: {btree_node_size}")
+        self.btree_node_size = btree_node_size
+        # By default, directories whose entries already fit a single node are searched directly
+        self.btree_min_entries = btree_min_entries if btree_min_entries is not None else btree_node_size // DIRENTRY_SIZE
+        # Store a table of the directories by the hash of their path, so that lookups prefetch them
+        self.path_hints = path_hints
+        # fold_hash of the path and packed inode of every directory but the root
+        self.dir_hints = []
+        # Store a table of the offsets of every inode, so that readers number them densely
+        self.inode_table = inode_table
+        # Offset and number of entries of every directory table, deduplicated tables only once
+        self.dir_tables = set()
+
+    @property
+    def has_superblock(self):
+        return self.http_metadata or self.compress or self.verity_block_size or self.shard_count or self.has_dir_ext or self.path_hints or self.inode_table
+
+    @property
+    def has_dir_ext(self):
+        # The inode table numbers the entries of each directory from the inode_base of its record
+        return self.dir_stats or self.fold_case or self.bloom_filters or self.eytzinger or self.fingerprints or self.btree_node_size or self.inode_table
+
+    def mime_id(self, path):
+        mime_type = mimetypes.guess_type(path)[0] or DEFAULT_MIME_TYPE
+        if mime_type not in self.mime_types:
+            self.mime_types.append(mime_type)
+        return self.mime_types.index(mime_type)
+
+    def create_file_ext(self, data, stored_data, path):
+        variants = []
+        for encoding in PRECOMPRESSORS:
+            size, ptr = 0, 0
+            if encoding in self.precompress and not CodecCostModel.is_incompressible(data):
+                encoded = PRECOMPRESSORS[encoding](data)
+                # Not worth serving a variant that is bigger than the original
+                if len(encoded) < len(data):
+                    size, ptr = len(encoded), self.store_data(encoded)
+            variants += [size, ptr]
+        content_hash = hashlib.sha256(data).digest()[:CONTENT_HASH_SIZE]
+        return struct.pack(FILE_EXT_FORMAT, content_hash, self.mime_id(path), *variants, len(stored_data))
+
+    def create_fold_index(self, names, path, eytzinger=False):
+        """Stores the index of the case-folded names of a directory, whose entries are `names` (sorted)"""
+        if not eytzinger:
+            # Only case-insensitive lookups need unique folded names
+            folded = {}
+            for name in names:
+                key = fold_name(name)
+                if key in folded:
+                    raise ValueError(f"Names only differ by case: {path.rstrip('/')}/{folded[key]} and {path.rstrip('/')}/{name}")
+                folded[key] = name
+        index = sorted((fold_hash(name), i) for i, name in enumerate(names))
+        if eytzinger:
+            index = eytzinger_order(index)
+        return self.store_data(b''.join(struct.pack(FOLD_ENTRY_FORMAT, *entry) for entry in index))
+
+    def create_btree(self, names):
+        """Stores a B+-tree of the hashes of the sorted names of a directory, returns the offset of its root"""
+        node_size = self.btree_node_size
+        capacity = (node_size - struct.calcsize(BTREE_NODE_FORMAT)) // 8
+        keys = sorted((fold_hash(name), i) for i, name in enumerate(names))
+
+        # Nodes are aligned to their size so each one is a single page, leaves first so children precede their parents
+        end = self.blob.seek(0, io.SEEK_END)
+        self.blob.write(b"\0" * (align(end, node_size) - end))
+
+        def write_level(items, leaf):
+            nodes = [items[i:i + capacity] for i in range(0, len(items), capacity)]
+            start = self.blob.tell()
+            for n, node in enumerate(nodes):
+                next_ptr = start + (n + 1) * node_size if leaf and n + 1 < len(nodes) else 0
+                data = struct.pack(BTREE_NODE_FORMAT, len(node), 1 if leaf else 0, 0, next_ptr)
+                data += struct.pack(f"<{len(node)}I", *(key for key, value in node))
+                data += struct.pack(f"<{len(node)}I", *(value for key, value in node))
+                self.blob.write(data + b"\0" * (node_size - len(data)))
+            # Each node is indexed by its smallest key on the level above
+            return [(node[0][0], start + n * node_size) for n, node in enumerate(nodes)]
+
+        level = write_level(keys, True)
+        depth = 1
+        while len(level) > 1:
+            level = write_level(level, False)
+            depth += 1
+        if depth > BTREE_MAX_DEPTH:
+            raise ValueError(f"B-tree nodes of {node_size} bytes are too small for {len(names)} entries")
+        return level[0][1]
+
+    def create_fingerprints(self, names):
+        """Stores the fingerprints of the sorted names of a directory, the upper half of their fold_hash"""
+        return self.store_data(struct.pack(f"<{len(names)}H", *(fold_hash(name) >> 16 for name in names)))
 
     def store_data(self, data):
         # TODO: If data is a prefix of some entry already in the cache, that works too!
@@ -30,25 +505,77 @@ class BlobCompiler:
             #print(f"Blob {data} written to {self.cache[data]}")
         return self.cache[data]
     
-    def store_compressed_data(self, data):
-        zdata = zlib.compress(data)
-        
-        if self.compress and len(zdata) < len(data):
-            return self.store_data(zdata), InodeFlags.DEFLATE
-        else: 
+    def store_aligned(self, data, alignment):
+        """Like store_data, at an offset that is a multiple of alignment"""
+        if data not in self.cache or self.cache[data] % alignment:
+            end = self.blob.seek(0, io.SEEK_END)
+            self.blob.write(b"\0" * (align(end, alignment) - end))
+            self.cache[data] = self.blob.tell()
+            self.blob.write(data)
+        return self.cache[data]
+
+    def encode_data(self, data, path=None):
+        if not self.compress:
             #print(f"Storing {data} without compression")
-            return self.store_data(data), 0
-    
-    def create_entry(self, entry):
+            return data, 0
+
+        # Identical files are only trialed once
+        if data not in self.codec_cache:
+            self.codec_cache[data] = self.cost_model.choose(data)
+        zdata, flags, choice = self.codec_cache[data]
+        self.codec_report.append(CodecChoice(path, choice.codec, choice.level, choice.size, choice.stored_size, choice.cost))
+        return zdata, flags
+
+    def create_entry(self, entry, path="/"):
+        """Stores an entry, returns its packed inode data and the SubtreeTotals it adds to its parent"""
+        if entry is WHITEOUT:
+            return struct.pack("<IIB", 0, 0, InodeFlags.WHITEOUT), SubtreeTotals()
+        if isinstance(entry, NestedBlob):
+            # Stored as-is, without compression nor extension record, so that it can be read in place
+            totals = SubtreeTotals(1, 0, len(entry.blob), len(entry.blob))
+            return struct.pack("<IIB", len(entry.blob), self.store_aligned(entry.blob, entry.alignment), InodeFlags.NESTED), totals
+        if isinstance(entry, ShardRef):
+            ptr = self.store_data(b''.join(struct.pack("<I", shard) for shard in entry.shards))
+            totals = SubtreeTotals(0, 1)
+            totals.complete = False
+            return struct.pack("<IIB", len(entry.shards), ptr, InodeFlags.IS_DIR | InodeFlags.SHARD), totals
         if isinstance(entry, dict):
             flags = InodeFlags.IS_DIR
+            if isinstance(entry, OpaqueDir):
+                flags |= InodeFlags.WHITEOUT
             size = len(entry)
             
             entry_table = b''
+            subtree = SubtreeTotals()
+            fold_index_ptr = self.create_fold_index(sorted(entry), path) if self.fold_case and entry else 0
+            eytzinger_ptr = self.create_fold_index(sorted(entry), path, eytzinger=True) if self.eytzinger and entry else 0
+            fingerprint_ptr = self.create_fingerprints(sorted(entry)) if self.fingerprints and entry else 0
+            btree_ptr = 0
+            if self.btree_node_size and entry and len(entry) >= self.btree_min_entries:
+                btree_ptr = self.create_btree(sorted(entry))
+            bloom_ptr, bloom_blocks = 0, 0
+            if self.bloom_filters and entry:
+                bloom, bloom_blocks = build_bloom_filter(entry)
+                bloom_ptr = self.store_data(bloom)
             for child_name, child_entry in sorted(entry.items()):
                 entry_table += struct.pack("<I", self.store_data(bytes(child_name, "utf-8") + b"\0"))
-                entry_table += self.create_entry(child_entry)
-            ptr = self.store_data(entry_table)
+                child_data, child_totals = self.create_entry(child_entry, path.rstrip("/") + "/" + child_name)
+                entry_table += child_data
+                subtree.add(child_totals)
+            if self.has_dir_ext:
+                ext = subtree.pack(fold_index_ptr, bloom_ptr, bloom_blocks, eytzinger_ptr, fingerprint_ptr,
+                                   btree_ptr, self.btree_node_size if btree_ptr else 0)
+                ptr = self.store_data(ext + entry_table) + len(ext)
+                flags |= InodeFlags.EXT
+            else:
+                ptr = self.store_data(entry_table)
+            totals = SubtreeTotals(0, 1)
+            totals.add(subtree)
+            if self.inode_table:
+                self.dir_tables.add((ptr, size))
+            if self.path_hints and path != "/":
+                self.dir_hints.append((fold_hash(path), struct.pack("<IIB", size, ptr, flags)))
+            return struct.pack("<IIB", size, ptr, flags), totals
         else:
             if isinstance(entry, str):
                 entry = bytes(entry, "utf-8")
@@ -56,20 +583,104 @@ class BlobCompiler:
                 raise Exception("Entry must be dict, str or bytes")
             
             size = len(entry)
-            ptr, flags = self.store_compressed_data(entry)
+            stored_data, flags = self.encode_data(entry, path)
+            # Compressed files always get the record, its stored_size is what keeps readers within the stream
+            if self.http_metadata or flags & InodeFlags.DEFLATE:
+                ext = self.create_file_ext(entry, stored_data, path)
+                ptr = self.store_data(ext + stored_data) + len(ext)
+                flags |= InodeFlags.EXT
+            else:
+                ptr = self.store_data(stored_data)
 
-        return struct.pack("<IIB", size, ptr, flags)
-    
+        return struct.pack("<IIB", size, ptr, flags), SubtreeTotals(1, 0, size, len(stored_data))
+
+    def create_path_hints(self):
+        """Stores the hash table of the directories by path, returns its offset and number of slots"""
+        if not self.dir_hints:
+            return 0, 0
+        # At most half full, so that probes stay short
+        capacity = 1
+        while capacity < 2 * len(self.dir_hints):
+            capacity *= 2
+        slots = [None] * capacity
+        for path_hash, inode in self.dir_hints:
+            slot = path_hash % capacity
+            while slots[slot] is not None:
+                slot = (slot + 1) % capacity
+            slots[slot] = struct.pack(PATH_HINT_FORMAT, path_hash, inode)
+        empty = b"\0" * struct.calcsize(PATH_HINT_FORMAT)
+        return self.store_data(b''.join(slot or empty for slot in slots)), capacity
+
+    def create_inode_table(self):
+        """Stores the sorted offsets of every inode, the root first, returns the table's offset and number of inodes"""
+        if not self.inode_table:
+            return 0, 0
+        # The inode of an entry is its inode data, after the name offset
+        inodes = sorted({ptr + i * DIRENTRY_SIZE + PTR_SIZE for ptr, size in self.dir_tables for i in range(size)})
+        inodes.insert(0, 0)
+        # Entries of a table are contiguous, so each one is numbered inode_base + its index
+        numbers = {inode: number for number, inode in enumerate(inodes)}
+        for ptr, size in self.dir_tables:
+            if size:
+                self.blob.seek(ptr - struct.calcsize(DIR_EXT_FORMAT) + DIR_EXT_INODE_BASE_OFFSET)
+                self.blob.write(struct.pack("<I", numbers[ptr + PTR_SIZE]))
+        return self.store_data(b''.join(struct.pack("<I", inode) for inode in inodes)), len(inodes)
+
+    def create_superblock(self):
+        mime_table = b''.join(struct.pack("<I", self.store_data(bytes(mime_type, "utf-8") + b"\0")) for mime_type in self.mime_types)
+        mime_table_ptr = self.store_data(mime_table)
+        path_hint_ptr, path_hint_capacity = self.create_path_hints()
+        inode_table_ptr, inode_count = self.create_inode_table()
+
+        # Everything was stored by now: The integrity tree covers the whole blob, and is stored right after it
+        verity_data_size = self.blob.seek(0, io.SEEK_END) if self.verity_block_size else 0
+        verity_tree_ptr = align(verity_data_size, self.verity_block_size) if self.verity_block_size else 0
+
+        return struct.pack(
+            SUPERBLOCK_FORMAT,
+            SUPERBLOCK_MAGIC,
+            struct.calcsize(SUPERBLOCK_FORMAT),
+            struct.calcsize(FILE_EXT_FORMAT),
+            len(self.mime_types),
+            mime_table_ptr,
+            self.verity_block_size,
+            verity_data_size,
+            verity_tree_ptr,
+            b"\0" * VERITY_HASH_SIZE,  # Root hash is only known after hashing the superblock
+            self.shard_count,
+            struct.calcsize(DIR_EXT_FORMAT) if self.has_dir_ext else 0,
+            path_hint_ptr,
+            path_hint_capacity,
+            inode_table_ptr,
+            inode_count)
+
+    def append_verity_tree(self):
+        """Appends the integrity tree and stores its root hash in the superblock"""
+        data = self.blob.getvalue()
+        tree, root_hash = build_verity_tree(data, self.verity_block_size)
+        self.blob.seek(0, io.SEEK_END)
+        self.blob.write(b"\0" * (align(len(data), self.verity_block_size) - len(data)))
+        self.blob.write(tree)
+        self.blob.seek(VERITY_ROOT_HASH_OFFSET)
+        self.blob.write(root_hash)
+        return root_hash
     
     def compile(self, root):
-        # Reserve space for root entry at offset zero
+        # Reserve space for root entry at offset zero, followed by the superblock
         self.blob.truncate(0)
         self.blob.seek(0)
         self.blob.write(b"x" * ENTRY_SIZE)
+        if self.has_superblock:
+            self.blob.write(b"x" * struct.calcsize(SUPERBLOCK_FORMAT))
         
-        root_entry = self.create_entry(root)
+        root_entry, _ = self.create_entry(root)
+        if self.has_superblock:
+            size, ptr, flags = struct.unpack("<IIB", root_entry)
+            root_entry = struct.pack("<IIB", size, ptr, flags | InodeFlags.SUPERBLOCK) + self.create_superblock()
         self.blob.seek(0)
         self.blob.write(root_entry)
+        if self.verity_block_size:
+            self.root_hash = self.append_verity_tree()
         return self.blob.getvalue()
     
 class BlobLoader:
@@ -91,8 +702,11 @@ class BlobLoader:
         data = self.blob.read(ENTRY_SIZE)
         size, ptr, flags = struct.unpack("<IIB", data)
         
-        if flags & InodeFlags.IS_DIR:
-            ret = {}
+        if flags & InodeFlags.SHARD:
+            self.blob.seek(ptr)
+            return ShardRef(struct.unpack(f"<{size}I", self.blob.read(size * PTR_SIZE)))
+        elif flags & InodeFlags.IS_DIR:
+            ret = OpaqueDir() if flags & InodeFlags.WHITEOUT else {}
             for i in range(size):
                 self.blob.seek(ptr)
                 nameptr, = struct.unpack("<I", self.blob.read(PTR_SIZE))
@@ -101,6 +715,11 @@ class BlobLoader:
                 ret[name] = self.load_entry(ptr)
                 ptr += ENTRY_SIZE
             return ret
+        elif flags & InodeFlags.WHITEOUT:
+            return WHITEOUT
+        elif flags & InodeFlags.NESTED:
+            self.blob.seek(ptr)
+            return NestedBlob(self.blob.read(size))
         else:
             self.blob.seek(ptr)
             if flags & InodeFlags.DEFLATE:
@@ -115,25 +734,89 @@ class BlobLoader:
         return self.load_entry(0)
 
 
-def compile(data, compress=False):
-    blob = BlobCompiler(compress=compress).compile(data)
+def compile(data, codec_report=None, root_hash=None, **options):
+    compiler = BlobCompiler(**options)
+    blob = compiler.compile(data)
+    if root_hash is not None:
+        root_hash.append(compiler.root_hash)
     assert data == load(blob)
+    if codec_report is not None:
+        codec_report.extend(compiler.codec_report)
     return blob
 
 
-def compile_path(path, compress=False):
-    def path_to_data(path):
-        if os.path.isfile(path):
-            with open(path, 'rb') as f:
-                return f.read()
-        elif os.path.isdir(path):
-            return {
-                child: path_to_data(os.path.join(path, child))
-                for child in os.listdir(path)
-            }
+def load_path(path):
+    """Reads a directory tree as a dict, following the OCI whiteout conventions"""
+    if os.path.isfile(path):
+        with open(path, 'rb') as f:
+            return f.read()
+    elif os.path.isdir(path):
+        children = os.listdir(path)
+        ret = OpaqueDir() if OCI_OPAQUE_MARKER in children else {}
+        for child in children:
+            if child == OCI_OPAQUE_MARKER:
+                continue
+            elif child.startswith(OCI_WHITEOUT_PREFIX):
+                ret[child[len(OCI_WHITEOUT_PREFIX):]] = WHITEOUT
+            elif child.endswith(NESTED_BLOB_SUFFIX) and os.path.isfile(os.path.join(path, child)):
+                with open(os.path.join(path, child), 'rb') as f:
+                    ret[child[:-len(NESTED_BLOB_SUFFIX)]] = NestedBlob(f.read())
+            else:
+                ret[child] = load_path(os.path.join(path, child))
+        return ret
+    else:
+        raise IOError(f"Invalid path: {path}")
+
+
+def compile_path(path, **options):
+    return compile(load_path(path), **options)
+
+
+def compile_sharded(data, shards=None, jobs=None, **options):
+    """
+    Compiles a filesystem split across several blobs
+
+    Subtrees wrapped in `Shard` are stored in other blobs, and the rest of the tree in a small root index.
+    With `shards=N`, the entries of the root directory are partitioned across N shards.
+    Shards are compiled in parallel, by up to `jobs` processes.
+
+    Returns the root index and the list of shards
+    """
+    if shards is not None and not isinstance(data, Shard):
+        data = Shard(data, ways=shards)
+
+    shard_trees = []
+    def extract_shards(entry):
+        if isinstance(entry, Shard):
+            ids = []
+            for way in range(entry.ways):
+                ids.append(len(shard_trees))
+                shard_trees.append({})
+            for name, child in entry.entries.items():
+                if contains_shards(child):
+                    raise ValueError(f"Shards can't be nested: {name}")
+                shard_trees[ids[shard_for_name(name) % entry.ways]][name] = child
+            return ShardRef(ids)
+        elif isinstance(entry, dict):
+            ret = OpaqueDir() if isinstance(entry, OpaqueDir) else {}
+            for name, child in entry.items():
+                ret[name] = extract_shards(child)
+            return ret
         else:
-            raise IOException(f"Invalid path: {path}")
-    return compile(path_to_data(path), compress=compress)
+            return entry
+
+    def contains_shards(entry):
+        if isinstance(entry, Shard):
+            return True
+        return isinstance(entry, dict) and any(contains_shards(child) for child in entry.values())
+
+    index_tree = extract_shards(data)
+    # Reports are only collected for the root index, they can't be passed back from the worker processes
+    shard_options = {k: v for k, v in options.items() if k not in ("codec_report", "root_hash")}
+    with concurrent.futures.ProcessPoolExecutor(max_workers=jobs) as executor:
+        shard_blobs = list(executor.map(functools.partial(compile, **shard_options), shard_trees))
+    index = compile(index_tree, shard_count=len(shard_trees), **options)
+    return index, shard_blobs
 
 
 def load(blob):